@@ -7,6 +7,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
 #include "www.h"
 
 /* these need to be preserved by push/pop operation */
@@ -59,9 +62,25 @@ int histSize = 0;
 struct hlist *history = NULL;
 struct authlist *AuthList = NULL;
 
+/* release document buffer, unmapping it if it's a mapped cache file */
+
+void FreeDocBuffer(Doc *doc)
+{
+    if (doc->buffer)
+    {
+        if (doc->mapped)
+            munmap(doc->buffer, doc->mapped);
+        else
+            free(doc->buffer);
+    }
+
+    doc->buffer = 0;
+    doc->mapped = 0;
+}
+
 void FreeDoc(Doc *doc)
 {
-    Free(doc->buffer);
+    FreeDocBuffer(doc);
     Free(doc->host);
     Free(doc->path);
     Free(doc->anchor);
@@ -70,7 +89,6 @@ void FreeDoc(Doc *doc)
 
     doc->port = 0;
     doc->protocol = 0;
-    doc->buffer = 0;
     doc->hdrlen = 0;
     doc->length = 0;
     doc->height = 0;
@@ -80,6 +98,10 @@ void FreeDoc(Doc *doc)
     doc->anchor = 0;
     doc->url = 0;
     doc->cache = 0;
+    doc->date = 0;
+    doc->expires = 0;
+    doc->lastmod = 0;
+    doc->validate = 0;
 }
 
 void SetCurrent()
@@ -95,6 +117,7 @@ void SetCurrent()
     NewDoc.port = 0;
     NewDoc.protocol = 0;
     NewDoc.buffer = 0;
+    NewDoc.mapped = 0;
     NewDoc.hdrlen = 0;
     NewDoc.length = 0;
     NewDoc.height = 0;
@@ -104,6 +127,10 @@ void SetCurrent()
     NewDoc.anchor = 0;
     NewDoc.url = 0;
     NewDoc.cache = 0;
+    NewDoc.date = 0;
+    NewDoc.expires = 0;
+    NewDoc.lastmod = 0;
+    NewDoc.validate = 0;
 }
 
 /*
@@ -200,7 +227,9 @@ char *PopDoc(long *offset)
         NewDoc.where = CurrentDoc.where;
         NewDoc.type = CurrentDoc.type;
         NewDoc.buffer = CurrentDoc.buffer;
+        NewDoc.mapped = CurrentDoc.mapped;
         CurrentDoc.buffer = 0; /* stop SetCurrent from freeing document buffer */
+        CurrentDoc.mapped = 0;
         NewDoc.length = CurrentDoc.length;
         NewDoc.hdrlen = CurrentDoc.hdrlen;
         NewDoc.port = CurrentDoc.port;
@@ -228,6 +257,8 @@ char *PopDoc(long *offset)
     NewDoc.type = hp->type;
     NewDoc.where = hp->where;
 
+    /* GetDocument() looks in memory before asking cache server */
+
     GetDocument(hp->url, NULL, hp->where);
 
 #if 0
@@ -292,13 +323,422 @@ char *PopDoc(long *offset)
     return NewDoc.buffer;
 }
 
+/*
+   In-memory LRU of recently retrieved documents, keyed by absolute
+   url less any anchor, and limited to MEMCACHESIZE bytes in total.
+   Entries hold private copies so that they survive the document
+   buffer being freed or unmapped when the user moves on.
+*/
+
+#define MEMCACHESIZE    0x200000L   /* 2 Mbytes */
+
+struct memdoc
+{
+    struct memdoc *prev;    /* towards most recently used */
+    struct memdoc *next;    /* towards least recently used */
+    char *url;
+    char *cache;            /* file name in shared cache */
+    char *buffer;
+    long length;
+    int hdrlen;
+    int type;
+    long date;              /* freshness info as for Doc */
+    long expires;
+    long lastmod;
+};
+
+struct memdoc *MemHead = NULL, *MemTail = NULL;
+long MemCacheBytes = 0;
+
+static int UrlKeyLen(char *url)
+{
+    return strcspn(url, "#");
+}
+
+static struct memdoc *FindMemDoc(char *url)
+{
+    int n;
+    struct memdoc *mp;
+
+    n = UrlKeyLen(url);
+
+    for (mp = MemHead; mp; mp = mp->next)
+    {
+        if (strncmp(mp->url, url, n) == 0 && mp->url[n] == '\0')
+            return mp;
+    }
+
+    return NULL;
+}
+
+static void UnlinkMemDoc(struct memdoc *mp)
+{
+    if (mp->prev)
+        mp->prev->next = mp->next;
+    else
+        MemHead = mp->next;
+
+    if (mp->next)
+        mp->next->prev = mp->prev;
+    else
+        MemTail = mp->prev;
+}
+
+static void FreeMemDoc(struct memdoc *mp)
+{
+    UnlinkMemDoc(mp);
+    MemCacheBytes -= mp->length;
+    Free(mp->cache);
+    free(mp->url);
+    free(mp->buffer);
+    free(mp);
+}
+
+/* drop any copy of url, e.g. when the user asks for a reload */
+
+void ForgetDoc(char *url)
+{
+    struct memdoc *mp;
+
+    if (url && (mp = FindMemDoc(url)))
+        FreeMemDoc(mp);
+}
+
+/* keep a copy of NewDoc in memory, evicting older entries as needed */
+
+void RememberDoc(void)
+{
+    int n;
+    struct memdoc *mp;
+
+    if (NewDoc.buffer == NULL || NewDoc.url == NULL ||
+            NewDoc.length > MEMCACHESIZE/4)
+        return;
+
+    ForgetDoc(NewDoc.url);
+
+    while (MemTail && MemCacheBytes + NewDoc.length > MEMCACHESIZE)
+        FreeMemDoc(MemTail);
+
+    if ((mp = (struct memdoc *)malloc(sizeof(struct memdoc))) == NULL)
+        return;
+
+    if ((mp->buffer = malloc(NewDoc.length + 1)) == NULL)
+    {
+        free(mp);
+        return;
+    }
+
+    n = UrlKeyLen(NewDoc.url);
+    mp->url = malloc(n + 1);
+    memcpy(mp->url, NewDoc.url, n);
+    mp->url[n] = '\0';
+    mp->cache = (NewDoc.cache ? strdup(NewDoc.cache) : NULL);
+
+    memcpy(mp->buffer, NewDoc.buffer, NewDoc.length);
+    mp->buffer[NewDoc.length] = '\0';
+    mp->length = NewDoc.length;
+    mp->hdrlen = NewDoc.hdrlen;
+    mp->type = NewDoc.type;
+    mp->date = NewDoc.date;
+    mp->expires = NewDoc.expires;
+    mp->lastmod = NewDoc.lastmod;
+
+    mp->prev = NULL;
+    mp->next = MemHead;
+
+    if (MemHead)
+        MemHead->prev = mp;
+    else
+        MemTail = mp;
+
+    MemHead = mp;
+    MemCacheBytes += mp->length;
+}
+
+/* return copy of NewDoc.url from memory or NULL if not held,
+   the caller should check IsFresh() before using it */
+
+char *RecallDoc(void)
+{
+    struct memdoc *mp;
+    char *buf;
+
+    if (NewDoc.url == NULL || (mp = FindMemDoc(NewDoc.url)) == NULL)
+        return NULL;
+
+    if ((buf = malloc(mp->length + 1)) == NULL)
+        return NULL;
+
+    memcpy(buf, mp->buffer, mp->length + 1);
+
+    /* move to front as most recently used */
+
+    UnlinkMemDoc(mp);
+    mp->prev = NULL;
+    mp->next = MemHead;
+
+    if (MemHead)
+        MemHead->prev = mp;
+    else
+        MemTail = mp;
+
+    MemHead = mp;
+
+    FreeDocBuffer(&NewDoc);
+    NewDoc.buffer = buf;
+    NewDoc.length = mp->length;
+    NewDoc.hdrlen = mp->hdrlen;
+    NewDoc.type = mp->type;
+    NewDoc.date = mp->date;
+    NewDoc.expires = mp->expires;
+    NewDoc.lastmod = mp->lastmod;
+    Free(NewDoc.cache);
+    NewDoc.cache = (mp->cache ? strdup(mp->cache) : NULL);
+
+    return buf;
+}
+
+/* answers from batched MFIND awaiting use by GetCachedDoc() */
+
+struct resolved
+{
+    char *url;
+    char *reply;        /* "200 file" or "404 suggested-file" */
+    struct resolved *next;
+};
+
+struct resolved *Resolved = NULL;
+
+/* registrations deferred while a batch is open, sent as MREGISTER */
+
+int CacheBatching = 0;
+int nPending = 0;
+int maxPending = 0;
+char **Pending = NULL;
+
+/* remove and return reply for url from list of resolved urls */
+
+static char *TakeResolved(char *url)
+{
+    char *reply;
+    struct resolved *rp, **prp;
+
+    for (prp = &Resolved; (rp = *prp); prp = &rp->next)
+    {
+        if (strcmp(rp->url, url) == 0)
+        {
+            *prp = rp->next;
+            reply = rp->reply;
+            free(rp->url);
+            free(rp);
+            return reply;
+        }
+    }
+
+    return NULL;
+}
+
+/* is url held in memory or known from MFIND to be in shared cache? */
+
+int IsCached(char *url)
+{
+    struct resolved *rp;
+
+    if (FindMemDoc(url))
+        return 1;
+
+    for (rp = Resolved; rp; rp = rp->next)
+    {
+        if (strcmp(rp->url, url) == 0)
+            return (strncmp(rp->reply, "200", 3) == 0);
+    }
+
+    return 0;
+}
+
+/*
+   Resolve urls for a document's inline images in one exchange
+   with the cache server, and defer registration of any documents
+   retrieved until EndCacheBatch() is called.
+*/
+
+void BeginCacheBatch(char **urls, int n)
+{
+    int i;
+    char **replies;
+    struct resolved *rp;
+
+    CacheBatching = 1;
+
+    if (n == 0 || (replies = (char **)malloc(n * sizeof(char *))) == NULL)
+        return;
+
+    QueryCacheBatch("MFIND", urls, n, replies);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (replies[i] == NULL)
+            continue;
+
+        if ((rp = (struct resolved *)malloc(sizeof(struct resolved))) == NULL)
+        {
+            free(replies[i]);
+            continue;
+        }
+
+        rp->url = strdup(urls[i]);
+        rp->reply = replies[i];
+        rp->next = Resolved;
+        Resolved = rp;
+    }
+
+    free(replies);
+}
+
+/* send deferred registrations and discard unused answers */
+
+void EndCacheBatch(void)
+{
+    int i;
+    struct resolved *rp;
+
+    CacheBatching = 0;
+
+    if (nPending > 0)
+    {
+        QueryCacheBatch("MREGISTER", Pending, nPending, NULL);
+
+        for (i = 0; i < nPending; ++i)
+            free(Pending[i]);
+
+        nPending = 0;
+    }
+
+    while ((rp = Resolved))
+    {
+        Resolved = rp->next;
+        free(rp->url);
+        free(rp->reply);
+        free(rp);
+    }
+}
+
+/*
+   Load named file from shared cache into NewDoc. The file is mapped
+   copy-on-write rather than read into a malloc'ed buffer, provided
+   the page holding the end of the file has room for the terminating
+   '\0' which mmap supplies for free. Compressed files are read as
+   Uncompress() frees the buffer it is given.
+
+   The mapping is writable as LayoutPart() in display.c briefly puts
+   a '\0' into the buffer to end a partial layout. MAP_PRIVATE keeps
+   such writes to our own copy of the page. Cache files are never
+   rewritten in place (see RegisterDoc), so the mapping can't change
+   or be truncated under the parser.
+*/
+
+static char *ReadCachedFile(char *file)
+{
+    int fd, n;
+    unsigned int size;
+    char *buf, *p;
+
+    if ((fd = open(file, O_RDONLY)) == -1)
+    {
+        Warn("%s: errno %d", file, errno);
+        return NULL;
+    }
+
+    size = lseek(fd, 0L, SEEK_END);
+    buf = NULL;
+    p = (NewDoc.path ? strrchr(NewDoc.path, '.') : NULL);
+
+    if (size > 0 && size % getpagesize() != 0 && !(p && strcasecmp(p, ".z") == 0))
+    {
+        buf = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0L);
+
+        if (buf == (char *)MAP_FAILED)
+            buf = NULL;
+        else
+            NewDoc.mapped = size;
+    }
+
+    if (buf == NULL)
+    {
+        if ((buf = malloc(1 + size)) == NULL)
+        {
+            close(fd);
+            Warn("Can't allocate %d bytes for %s", size, file);
+            return NULL;
+        }
+
+        lseek(fd, 0L, SEEK_SET);
+
+        if ((n = read(fd, (void *)buf, size)) < 0)
+            n = 0;
+
+        buf[n] = '\0';
+        size = n;
+        NewDoc.mapped = 0;
+    }
+
+    close(fd);
+    NewDoc.buffer = buf;
+    NewDoc.length = size;
+
+    if (strncmp(NewDoc.buffer, "HTTP/", 5) == 0)
+        NewDoc.hdrlen = HeaderLength(NewDoc.buffer, &NewDoc.type);
+    else
+        NewDoc.hdrlen = 0;
+
+    /* entries registered without freshness info */
+
+    if (!NewDoc.date && !NewDoc.expires && !NewDoc.lastmod)
+        HeaderDates(&NewDoc);
+
+    NewDoc.cache = strdup(file);
+    NewDocumentType();
+    return NewDoc.buffer;
+}
+
 /* read file from shared cache */
 char *GetCachedDoc(void)
 {
     char command[256], *response, *file, *q, *buf;
-    int len, fd;
-    unsigned int size;
-    FILE *fp;
+    int len;
+
+    NewDoc.cache = NULL;
+
+    /* use answer from earlier MFIND if we have one */
+
+    if ((response = TakeResolved(NewDoc.url)) != NULL)
+    {
+        file = response + 4;  /* skip status code */
+
+        if (strncmp(response, "200", 3) == 0)
+        {
+            /* "200 file date expires lastmod" */
+
+            for (q = file; *q && *q != ' '; ++q);
+
+            if (*q == ' ')
+            {
+                *q++ = '\0';
+                sscanf(q, "%ld %ld %ld", &NewDoc.date, &NewDoc.expires, &NewDoc.lastmod);
+            }
+
+            buf = ReadCachedFile(file);
+        }
+        else
+        {
+            NewDoc.cache = strdup(file);
+            buf = NULL;
+        }
+
+        free(response);
+        return buf;
+    }
 
     sprintf(command, "FIND %s", NewDoc.url);
 
@@ -313,8 +753,6 @@ char *GetCachedDoc(void)
     /* 404 Not found - then note suggested file name for
        where to save data after retrieving it in normal way */
 
-    NewDoc.cache = NULL;
-
     if (strncmp(response, "404", 3) == 0)
     {
         file = strchr(response, ':');
@@ -326,7 +764,9 @@ char *GetCachedDoc(void)
         return NULL;
     }
 
-    /* otherwise should be "200 OK\nfile\n\n" */
+    /* otherwise should be "200 OK\nfile\n\n" optionally
+       with "Date: ", "Expires: " and "Last-Modified: " lines
+       giving seconds since 1970 before the blank line */
 
     if (strncmp(response, "200", 3) != 0)
         return 0;
@@ -337,56 +777,133 @@ char *GetCachedDoc(void)
         ++file;
 
     for (q = file; *q && *q != '\n' && *q != '\r'; ++q);
-    *q = '\0';
 
-    if ((fd = open(file, O_RDONLY)) == -1)
+    while (*q == '\r' || (*q == '\n' && q[1] != '\n'))
     {
-        Warn("%s: errno %d", file, errno);
-        return NULL;
+        *q++ = '\0';
+
+        if (strncmp(q, "Date: ", 6) == 0)
+            NewDoc.date = atol(q+6);
+        else if (strncmp(q, "Expires: ", 9) == 0)
+            NewDoc.expires = atol(q+9);
+        else if (strncmp(q, "Last-Modified: ", 15) == 0)
+            NewDoc.lastmod = atol(q+15);
+
+        while (*q && *q != '\n' && *q != '\r')
+            ++q;
     }
 
-    size = lseek(fd, 0L, SEEK_END);
+    *q = '\0';
 
-    buf = malloc(1 + size);
-    lseek(fd, 0L, SEEK_SET);
+    return ReadCachedFile(file);
+}
 
-    /* the next line assumes that read won't return -1 look at man page! */
-    buf[read(fd, (void *)buf, size)] = '\0';
+/*
+   Can the cached copy of doc be used without checking with
+   the server? Entries with nothing to revalidate against are
+   trusted as before. Otherwise use Expires: if given, else
+   allow 10% of the document's age at the time it was fetched.
+*/
 
-    close(fd);
-    NewDoc.buffer = buf;
-    NewDoc.length = size;
+int IsFresh(Doc *doc)
+{
+    long now;
 
-    if (strncmp(NewDoc.buffer, "HTTP/", 5) == 0)
-        NewDoc.hdrlen = HeaderLength(NewDoc.buffer, &NewDoc.type);
-    else
-        NewDoc.hdrlen = 0;
+    if (doc->protocol != HTTP || (!doc->lastmod && !doc->date))
+        return 1;
 
-    NewDoc.cache = strdup(file);
-    NewDocumentType();
-    return NewDoc.buffer;
+    now = time(NULL);
+
+    if (doc->expires)
+        return (now < doc->expires);
+
+    if (doc->date && doc->lastmod && doc->lastmod < doc->date)
+        return (now - doc->date < (doc->date - doc->lastmod)/10);
+
+    return 0;
 }
 
-/* save NewDoc in shared cache and register with server */
+/* save NewDoc in shared cache and register with server. The data is
+   written to a temporary file which is then renamed over the old one,
+   as other browsers may have the old file mapped by ReadCachedFile() */
 
 int RegisterDoc(char *buf)
 {
-    char *response, cmd[512];
-    int len;
     FILE *fp;
+    char *tmpfile;
+    int ok;
+
+    if (NewDoc.cache == NULL)
+        return 0;
 
     Announce("Saving data in shared cache ...");
 
-    if ((fp = fopen(NewDoc.cache, "w")) == NULL)
+    if ((tmpfile = malloc(strlen(NewDoc.cache) + 16)) == NULL)
+        return 0;
+
+    sprintf(tmpfile, "%s.%d", NewDoc.cache, (int)getpid());
+
+    if ((fp = fopen(tmpfile, "w")) == NULL)
+    {
+        Warn("Can't create cache file: %s", tmpfile);
+        free(tmpfile);
+        return 0;
+    }
+
+    ok = (fwrite(NewDoc.buffer, 1, NewDoc.length, fp) == NewDoc.length);
+
+    if (fclose(fp) != 0)
+        ok = 0;
+
+    if (!ok || rename(tmpfile, NewDoc.cache) == -1)
     {
-        Warn("Can't create cache file: %s", NewDoc.cache);
+        Warn("Can't write cache file: %s", NewDoc.cache);
+        unlink(tmpfile);
+        free(tmpfile);
         return 0;
     }
 
-    fwrite(NewDoc.buffer, NewDoc.length, 1, fp);
-    fclose(fp);
+    free(tmpfile);
+    return RegisterCacheEntry();
+}
+
+/* tell server about NewDoc's cache file and freshness info */
+
+int RegisterCacheEntry(void)
+{
+    char *response, cmd[512], **pp;
+    int len;
+
+    /* defer registration until end of batch if one is open */
+
+    if (CacheBatching)
+    {
+        if (nPending == maxPending)
+        {
+            len = (maxPending ? 2 * maxPending : 32);
+            pp = (char **)realloc(Pending, len * sizeof(char *));
+
+            if (pp == NULL)
+                goto single;
+
+            Pending = pp;
+            maxPending = len;
+        }
+
+        sprintf(cmd, "%s %s %ld %ld %ld", NewDoc.url, NewDoc.cache,
+                    NewDoc.date, NewDoc.expires, NewDoc.lastmod);
+
+        if ((Pending[nPending] = strdup(cmd)) != NULL)
+        {
+            ++nPending;
+            return 1;
+        }
+    }
+
+  single:
 
-    sprintf(cmd, "REGISTER %s %s", NewDoc.url, NewDoc.cache);
+    sprintf(cmd, "REGISTER %s %s %ld %ld %ld", NewDoc.url, NewDoc.cache,
+                NewDoc.date, NewDoc.expires, NewDoc.lastmod);
 
     /* error message issued by QueryCacheServer() */
     if ((len = QueryCacheServer(cmd, &response)) <= 0)
@@ -1,6 +1,9 @@
 /* display the file in the window */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
@@ -34,7 +37,10 @@ extern char *targetId;     /* named ID (or anchor NAME) */
 extern long ViewOffset;    /* for toggling between HTML/TEXT views */
 extern long IdOffset;      /* offset of named ID */
 extern Frame background;
+extern int paintlen;
 extern XFontStruct *Fonts[FONTS];
+extern long LastBlock;     /* start of last top level block */
+extern int layout_width;   /* window width of last ParseHTML() */
 /* 
     The current top line is displayed at the top of the window,the pixel
     offset is the number of pixels from the start of the document.
@@ -56,6 +62,12 @@ int chWidth;            /* width of average char */
 int spWidth;            /* width of space char */
 int font = -1;               /* index into Fonts[] */
 
+static char *LineBase;   /* text indexed by LineStart or NULL */
+static long *LineStart;  /* offset from LineBase of each line */
+static long LineCount;   /* number of lines in text */
+static long LineMax;     /* size of LineStart array */
+static long LongestLine; /* in chars, for document width */
+
 XFontStruct *pFontInfo;
 
 void SetDisplayWin(Window aWin)
@@ -112,12 +124,125 @@ void SetEmphFont(GC gc, XFontStruct *pFont, XFontStruct *pNormal)
                  and that buffer and hdrlen are ok.
 */
 
+/*
+    Large HTML documents are laid out lazily, so that the first window
+    full can be shown without waiting for the rest. The layout simply
+    stops LAYOUTSLICE bytes in, as it does for documents shown while
+    they arrive, and PollEvents() calls MoreLayout() whenever it is
+    idle to lay out another LAYOUTSLICE bytes with ResumeHTML(), which
+    carries on from the last top level block reached rather than
+    laying out the whole prefix again. Each pass thus takes about as
+    long as the first, so user input is attended to between them until
+    the whole document is laid out. Meanwhile the scrollbar shows the
+    height of the document estimated from the part laid out so far.
+    The cache batch begun by ResolveImages() is ended once the layout
+    is complete, as images are only looked up as they are laid out.
+*/
+
+#define LAZYLAYOUT   (256L<<10)  /* lay out larger documents lazily */
+#define LAYOUTSLICE  (32L<<10)   /* bytes laid out in each pass */
+
+char *LayoutEnd;         /* where lazy layout stopped or NULL when done */
+static char *DocEnd;     /* end of document being laid out lazily */
+static long LayoutHeight;  /* height of the part laid out */
+
+/* lay out the document as far as LayoutEnd, carrying on from the
+   last layout if more is set, and return the actual or estimated
+   document height */
+
+static long LayoutPart(int *width, int more)
+{
+    int c;
+    char *start;
+
+    if (!LayoutEnd)
+        return (more ? ResumeHTML(width) : ParseHTML(width));
+
+    c = *LayoutEnd;
+    *LayoutEnd = '\0';
+    LayoutHeight = (more ? ResumeHTML(width) : ParseHTML(width));
+    *LayoutEnd = c;
+
+    start = buffer + hdrlen;
+    return (long)((double)LayoutHeight * (DocEnd - start) / (LayoutEnd - start));
+}
+
+/* lay out the next slice of the document if more is set, or
+   otherwise as much as before again, preserving the view */
+
+static void ExtendLayout(int more)
+{
+    long h;
+
+    if (more)
+        LayoutEnd = (DocEnd - LayoutEnd > LAYOUTSLICE ? LayoutEnd + LAYOUTSLICE : NULL);
+
+    h = PixelOffset;
+    new_form = 0;
+    targetptr = 0;
+    FreeFrames(background.child);
+    background.child = NULL;
+    PixelOffset = 0;
+    buf_height = LayoutPart(&buf_width, more);
+
+    if (more && !LayoutEnd)
+        EndCacheBatch();
+
+    if (h > buf_height - WinHeight)
+        h = buf_height - WinHeight;
+
+    if (h > 0)
+        DeltaHTMLPosition(h);
+
+    SetScrollBarWidth(buf_width);
+    SetScrollBarHeight(buf_height);
+    SetScrollBarHPosition(PixelIndent, buf_width);
+    SetScrollBarVPosition(PixelOffset, buf_height);
+}
+
+/* lay out the part of the document laid out so far again, e.g.
+   to create image resources afresh after CloneSelf() */
+
+void RefreshLayout(void)
+{
+    if (document == HTMLDOCUMENT)
+        ExtendLayout(0);
+}
+
+/* called when idle to continue laying out a large document,
+   returns 0 if there is nothing more to do while idle */
+
+int MoreLayout(void)
+{
+    long y;
+
+    if (!LayoutEnd || document != HTMLDOCUMENT)
+        return 0;
+
+    /* the blocks above the last one are unchanged */
+
+    y = LastBlock;
+    ExtendLayout(1);
+    DisplayScrollBar();
+
+    y = WinTop + (y - PixelOffset);
+
+    if (y < WinTop)
+        y = WinTop;
+
+    if (y < WinBottom)
+        DisplayDoc(WinLeft, y, WinWidth, WinBottom - y);
+
+    XFlush(display);
+    return 1;
+}
+
 void NewBuffer(char *buf)
 {
-    long target;
+    long target, len;
 
-    if (buffer && buffer != buf)
-        free(buffer);
+    /* the previous buffer belonged to CurrentDoc
+       and has already been released by SetCurrent() */
 
     buffer = buf;
     hdrlen = CurrentDoc.hdrlen;
@@ -125,6 +250,8 @@ void NewBuffer(char *buf)
     StartOfLine = buffer+hdrlen;
     PixelOffset = 0;
     PixelIndent = 0;
+    LayoutEnd = NULL;
+    LineBase = NULL;
 
     if (document == HTMLDOCUMENT)
     {
@@ -143,7 +270,29 @@ void NewBuffer(char *buf)
     lineHeight = 2 + pFontInfo->max_bounds.ascent + pFontInfo->max_bounds.descent;
     chDescent = pFontInfo->max_bounds.descent;
     chWidth = XTextWidth(pFontInfo, " ", 1);
-    buf_height = DocHeight(buffer+hdrlen, &buf_width);
+
+    /* one cache server exchange for all inline images, after
+       ending any batch left by a document not laid out in full */
+
+    EndCacheBatch();
+
+    if (document == HTMLDOCUMENT)
+        ResolveImages(buffer+hdrlen);
+
+    /* unless looking for a named Id, lay out large documents lazily */
+
+    if (document == HTMLDOCUMENT && buffer && !targetId &&
+            (len = strlen(buffer+hdrlen)) > LAZYLAYOUT)
+    {
+        DocEnd = buffer + hdrlen + len;
+        LayoutEnd = buffer + hdrlen + LAYOUTSLICE;
+        buf_height = LayoutPart(&buf_width, 0);
+    }
+    else
+        buf_height = DocHeight(buffer+hdrlen, &buf_width);
+
+    if (!LayoutEnd)
+        EndCacheBatch();
 
     if (document == HTMLDOCUMENT && IdOffset > 0)
     {
@@ -166,17 +315,385 @@ void NewBuffer(char *buf)
     SetScrollBarVPosition(PixelOffset, buf_height);
 }
 
+/*
+    Show an HTML document as it arrives. GetData() calls this with the
+    len bytes received so far after each read. The layout simply stops
+    where the data does. Once part of the document is shown, GetData()
+    grows its buffer with MovePartial(), which leaves the buffer that
+    the layout points into alone. The layout is then done again with
+    the new buffer, but no more than once every PARTIALDELAY mS, and
+    the old buffer is freed. Blocks before the last one of the previous
+    layout are unchanged, so only the window below that is repainted.
+    Returns 0 if the document isn't HTML.
+*/
+
+#define PARTIALDELAY    1000
+
+int Streaming;           /* set while getting a document to display */
+int PartialShown;        /* set once part of it has been displayed */
+
+static char *retired;    /* replaced by GetData() but still shown */
+
+int PartialBuffer(char *buf, int len)
+{
+    static struct timeval last;
+    struct timeval now;
+    int c, hlen, type;
+    long y;
+
+    /* nothing to do until the buffer moves */
+
+    if (PartialShown && buf == buffer)
+        return 1;
+
+    gettimeofday(&now, NULL);
+
+    if (PartialShown && (now.tv_sec - last.tv_sec) * 1000 +
+            (now.tv_usec - last.tv_usec) / 1000 < PARTIALDELAY)
+        return 1;
+
+    type = TEXTDOCUMENT;
+
+    if ((hlen = HeaderLength(buf, &type)) == 0 || type != HTMLDOCUMENT)
+        return 0;
+
+    y = (PartialShown ? LastBlock : 0);
+
+    if (!PartialShown)
+    {
+        PixelOffset = 0;
+        PixelIndent = 0;
+        PartialShown = 1;
+    }
+
+    last = now;
+    buffer = buf;
+    hdrlen = hlen;
+    document = HTMLDOCUMENT;
+    LayoutEnd = NULL;
+    StartOfLine = buffer+hdrlen;
+    targetptr = 0;
+    targetId = 0;
+
+    FreeImages(0);
+    FreeForms();
+    FreeFrames(background.child);
+    background.child = NULL;
+    SetFont(disp_gc, IDX_NORMALFONT);
+
+    /* parse what we have, which may end mid chunk */
+
+    c = buf[len];
+    buf[len] = '\0';
+    buf_height = ParseHTML(&buf_width);
+    buf[len] = c;
+
+    Free(retired);
+    retired = NULL;
+
+    SetScrollBarWidth(buf_width);
+    SetScrollBarHeight(buf_height);
+    SetScrollBarHPosition(PixelIndent, buf_width);
+    SetScrollBarVPosition(PixelOffset, buf_height);
+    DisplayScrollBar();
+
+    y = WinTop + (y - PixelOffset);
+
+    if (y < WinTop)
+        y = WinTop;
+
+    if (y < WinBottom)
+        DisplayDoc(WinLeft, y, WinWidth, WinBottom - y);
+
+    XFlush(display);
+    return 1;
+}
+
+/* grow GetData()'s buffer buf holding len bytes to size bytes,
+   keeping it for the layout if shown, returns NULL on failure */
+
+char *MovePartial(char *buf, int len, int size)
+{
+    char *p;
+
+    if (buf != buffer)
+        return realloc(buf, size);
+
+    if ((p = malloc(size)) != NULL)
+    {
+        memcpy(p, buf, len);
+        Free(retired);
+        retired = buf;
+    }
+
+    return p;
+}
+
+/* the document shown by PartialBuffer() has arrived in full and is
+   about to be displayed, or if not, redisplay the current document.
+   The partial layout may point into buffers freed by now, so it is
+   dropped, and with no current document, e.g. at startup, the window
+   is cleared */
+
+void EndPartialBuffer(int arrived)
+{
+    if (!PartialShown)
+        return;
+
+    PartialShown = 0;
+
+    if (!arrived && CurrentDoc.buffer)
+        NewBuffer(CurrentDoc.buffer);
+    else
+    {
+        buffer = NULL;
+        hdrlen = 0;
+        document = TEXTDOCUMENT;
+        LayoutEnd = NULL;
+        paintlen = 0;
+        background.length = 0;
+        FreeImages(0);
+        FreeForms();
+        FreeFrames(background.child);
+        background.child = NULL;
+        PixelOffset = PixelIndent = 0;
+        buf_height = buf_width = 0;
+        SetScrollBarWidth(buf_width);
+        SetScrollBarHeight(buf_height);
+        SetScrollBarHPosition(PixelIndent, buf_width);
+        SetScrollBarVPosition(PixelOffset, buf_height);
+    }
+
+    Free(retired);
+    retired = NULL;
+
+    if (!arrived)
+    {
+        DisplayScrollBar();
+        DisplayDoc(WinLeft, WinTop, WinWidth, WinHeight);
+    }
+}
+
+/*
+  The document area is painted into an off screen pixmap the
+  size of the window and copied from there to the window, so
+  that scrolling only has to paint the strip uncovered by the
+  copy, and Expose events can be repaired with a single copy
+  rather than by painting the document again. The paint code
+  draws to win throughout, so BeginPaint() points win at the
+  pixmap and EndPaint() points it back again. The pixmap is
+  only drawn to once it holds the whole document area, until
+  then drawing goes straight to the window as before.
+*/
+
+extern int depth;
+
+static Pixmap backing;          /* off screen copy of document area */
+static Window window;           /* the real window while win is backing */
+static GC copy_gc;              /* without graphics exposures */
+static unsigned int backingWidth, backingHeight;
+static int backingValid;        /* backing holds whole document area */
+static int painting;            /* nesting depth of BeginPaint() */
+static XRectangle damage;       /* area to copy to window by ShowDamage() */
+static int damaged;
+
+/* make sure backing is big enough for the window */
+
+static int NewBacking(void)
+{
+    if (backing && (backingWidth < win_width || backingHeight < win_height))
+    {
+        XFreePixmap(display, backing);
+        backing = 0;
+    }
+
+    if (!backing && win_width > 0 && win_height > 0)
+    {
+        backingWidth = win_width;
+        backingHeight = win_height;
+        backing = XCreatePixmap(display, win, backingWidth, backingHeight, depth);
+
+        if (!copy_gc)
+        {
+            copy_gc = XCreateGC(display, win, 0, NULL);
+            XSetGraphicsExposures(display, copy_gc, False);
+        }
+    }
+
+    return (backing != 0);
+}
+
+void BeginPaint(void)
+{
+    if (painting++ == 0 && backingValid)
+    {
+        window = win;
+        win = backing;
+    }
+}
+
+void EndPaint(void)
+{
+    if (--painting == 0 && window)
+    {
+        win = window;
+        window = 0;
+    }
+}
+
+/* note area of backing to be copied to window */
+
+void Damage(int x, int y, unsigned int w, unsigned int h)
+{
+    int x2, y2;
+
+    if (!backingValid)
+        return;
+
+    x2 = x + w;
+    y2 = y + h;
+
+    if (x < WinLeft)
+        x = WinLeft;
+
+    if (y < WinTop)
+        y = WinTop;
+
+    if (x2 > WinRight)
+        x2 = WinRight;
+
+    if (y2 > WinBottom)
+        y2 = WinBottom;
+
+    if (x2 <= x || y2 <= y)
+        return;
+
+    if (damaged)
+    {
+        if (x > damage.x)
+            x = damage.x;
+
+        if (y > damage.y)
+            y = damage.y;
+
+        if (x2 < damage.x + damage.width)
+            x2 = damage.x + damage.width;
+
+        if (y2 < damage.y + damage.height)
+            y2 = damage.y + damage.height;
+    }
+
+    damage.x = x;
+    damage.y = y;
+    damage.width = x2 - x;
+    damage.height = y2 - y;
+    damaged = 1;
+}
+
+/* copy damaged area from backing to window */
+
+void ShowDamage(void)
+{
+    if (painting || !damaged)
+        return;
+
+    if (backingValid)
+        XCopyArea(display, backing, win, copy_gc,
+                    damage.x, damage.y, damage.width, damage.height,
+                    damage.x, damage.y);
+
+    damaged = 0;
+}
+
+/* repair window from backing, returns 0 if it must be painted */
+
+int ShowBacking(void)
+{
+    if (!backingValid)
+        return 0;
+
+    Damage(WinLeft, WinTop, WinWidth, WinHeight);
+    ShowDamage();
+    return 1;
+}
+
+/* scroll w x h area at (x1, y1) of document area to (x2, y2) */
+
+static void ScrollDoc(int x1, int y1, unsigned int w, unsigned int h, int x2, int y2)
+{
+    XRectangle rect;
+
+    if (backingValid)
+    {
+        XCopyArea(display, backing, backing, copy_gc, x1, y1, w, h, x2, y2);
+        Damage(WinLeft, WinTop, WinWidth, WinHeight);
+        return;
+    }
+
+    rect.x = WinLeft;
+    rect.y = WinTop;
+    rect.width = WinWidth;
+    rect.height = WinHeight;
+    XSetClipRectangles(display, disp_gc, 0, 0, &rect, 1, Unsorted);
+
+    XCopyArea(display, win, win, disp_gc, x1, y1, w, h, x2, y2);
+
+    /* we must note that a copy request has been issued, and avoid further
+       such requests until all resulting GraphicsExpose events are handled
+       as these will repair any holes caused by windows above this one */
+
+    ExposeCount = 1;
+}
+
 void DisplaySizeChanged(int all)
 {
     int max_indent;
-    long h, target;
+    long h, target, len;
+    char *start;
 
-    if (document == HTMLDOCUMENT)
+    backingValid = 0;  /* so next DisplayDoc() paints it all */
+
+    /* line breaks depend only on the window width, so when
+       the window has merely changed height there is no need
+       to lay out the document again, which for long documents
+       is what makes interactive resizing sluggish */
+
+    if (document == HTMLDOCUMENT && all && layout_width == WinWidth)
+    {
+        h = buf_height - WinHeight;
+
+        if (h <= 0)
+            h = 0;
+
+        if (PixelOffset > h)
+            DeltaHTMLPosition(h);
+    }
+    else if (document == HTMLDOCUMENT)
     {
         new_form = 0;
         targetptr = TopStr(&background);
         PixelOffset = 0;
-        buf_height = ParseHTML(&buf_width);
+
+        /* a large document is laid out afresh only as far as a slice
+           past the view, as NewBuffer() does for the first window full,
+           and the rest is left to MoreLayout(), so that dragging the
+           window border doesn't wait on the whole document each time */
+
+        start = buffer + hdrlen;
+
+        if (buffer && !Streaming && (len = strlen(start)) > LAZYLAYOUT)
+        {
+            DocEnd = start + len;
+            LayoutEnd = (targetptr > start ? targetptr : start) + LAYOUTSLICE;
+
+            if (LayoutEnd >= DocEnd)
+                LayoutEnd = NULL;
+        }
+
+        buf_height = LayoutPart(&buf_width, 0);
+
+        if (!LayoutEnd)
+            EndCacheBatch();
 
         if (ViewOffset > 0)
         {
@@ -194,7 +711,7 @@ void DisplaySizeChanged(int all)
     else if (all || buf_height == 0)
     {
         PixelOffset = CurrentHeight(buffer);
-        buf_height = DocHeight(buffer, &buf_width);
+        buf_height = DocHeight(buffer+hdrlen, &buf_width);
     }
 
     max_indent = (buf_width > WinWidth ? buf_width - WinWidth : 0);
@@ -247,76 +764,114 @@ char *TextLine(char *s)
 }
 
 
-/* work out how far window has moved relative to document */
+/*
+    Plain text documents are indexed by the start of each line, so
+    the line at a given pixel offset can be found directly instead of
+    counting newlines from the current top line, which made dragging
+    the slider through large log files painfully slow. The index is
+    built by DocHeight() using memchr(), which the C library vectorises,
+    and is discarded by NewBuffer().
+*/
 
-int DeltaTextPosition(long h)
+static void IndexLines(char *buf)
 {
-    long d1;
-    char *p1;
-    int delta;
-    int nClipped;            /* the number of pixels hidden for this line */
+    char *p, *q, *end;
+    long len;
 
-    nClipped = PixelOffset % lineHeight;
+    end = buf + strlen(buf);
+    LineBase = buf;
+    LineCount = LongestLine = 0;
 
-    /* find the text line which intersects/starts from top of window */
-    /* d1 is pixel offset to new top line, p1 points to its text */
-    /* PixelOffset is the pixel offset to the previous top line */
-
-    if (h > PixelOffset)
-    {     /* search forward */
-        d1 = PixelOffset-nClipped;
-        p1 = StartOfLine;
+    if (*buf == '\0')
+        return;
 
-        while (d1 + lineHeight <= h)
+    for (p = buf;; p = q)
+    {
+        if (LineCount == LineMax)
         {
-            while (*p1)
-            {
-                if (*p1++ != '\n')
-                     continue;
+            LineMax = (LineMax ? 2 * LineMax : 1024);
+            LineStart = (long *)realloc(LineStart, LineMax * sizeof(long));
 
-                d1 += lineHeight;
-                break;
+            if (LineStart == NULL)
+            {
+                fprintf(stderr, "Panic: can't allocate line index\n");
+                exit(1);
             }
+        }
+
+        LineStart[LineCount++] = p - buf;
+
+        if ((q = memchr(p, '\n', end - p)) == NULL)
+        {
+            len = end - p - 1;
 
-            if (*p1 == '\0')
-                break;         /* this should be unnecessary */
+            if (len > LongestLine)
+                LongestLine = len;
+
+            break;
         }
+
+        len = ++q - p;
+
+        if (len > LongestLine)
+            LongestLine = len;
     }
-    else  /* search backward */
-    {
-        d1 = PixelOffset-nClipped;
-        p1 = StartOfLine;
+}
 
-        while (d1 > h)
-        {
-            if (p1 == buffer+hdrlen)
-                 break;         /* this should be unnecessary */
+/* return number of line containing p, counting from 0 */
 
-            /* now move back to start of previous line*/
+static long LineOf(char *p)
+{
+    long lo, hi, mid, offset;
 
-            --p1;  /* to first point to \n at end of previous line */
+    if (LineBase != buffer+hdrlen)
+        IndexLines(buffer+hdrlen);
 
-            for (;;)   /* and find start of that line */
-            {
-                if (p1 == buffer+hdrlen)
-                        break;
-                else if (*--p1 == '\n')
-                {
-                        ++p1;
-                        break;
-                }
-            }
+    offset = p - LineBase;
+    lo = 0;
+    hi = LineCount - 1;
 
-            /* finally adjust pixel offset to start of that line */
-            d1 -= lineHeight;
-        }
+    if (hi <= 0 || offset <= 0)
+        return 0;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1)/2;
+
+        if (LineStart[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
-    
+
+    return lo;
+}
+
+/* work out how far window has moved relative to document */
+
+int DeltaTextPosition(long h)
+{
+    long n;
+    int delta;
+
+    if (LineBase != buffer+hdrlen)
+        IndexLines(buffer+hdrlen);
+
+    /* find the text line which intersects/starts from top of window */
+
+    n = h / lineHeight;
+
+    if (n >= LineCount)
+        n = LineCount - 1;
+
+    if (n < 0)
+        n = 0;
+
     /* delta is required movement of window in pixels */
 
     delta = h - PixelOffset;
 
-    StartOfLine = p1;
+    StartOfLine = LineBase + (LineCount > 0 ? LineStart[n] : 0);
     PixelOffset = h;
     return delta;
 }
@@ -325,7 +880,6 @@ int DeltaTextPosition(long h)
 
 void MoveHDisplay(int indent)
 {
-    XRectangle rect;
     int delta;
 
     /* see if change in pixel offset from start of document is
@@ -339,37 +893,17 @@ void MoveHDisplay(int indent)
     {
         /* document moves left by delta pixels thru window */
 
-        rect.x = WinLeft;
-        rect.y = WinTop;
-        rect.width = WinWidth;
-        rect.height = WinHeight;
-        XSetClipRectangles(display, disp_gc, 0, 0, &rect, 1, Unsorted);
-
-        XCopyArea(display, win, win, disp_gc,
-                    WinLeft + delta, WinTop,
+        ScrollDoc(WinLeft + delta, WinTop,
                     WinWidth - delta, WinHeight,
                     WinLeft, WinTop);
 
-        /* we must note that a copy request has been issued, and avoid further
-           such requests until all resulting GraphicsExpose events are handled
-           as these will repair any holes caused by windows above this one */
-
-        ExposeCount = 1;
-
         DisplayDoc(WinRight - delta, WinTop, delta, WinHeight);
     }
     else if (delta < 0 && -delta < (2 * WinWidth)/3)
     {
         /* document moves right by -delta pixels thru window */
 
-        rect.x = WinLeft;
-        rect.y = WinTop;
-        rect.width = WinWidth;
-        rect.height = WinHeight;
-        XSetClipRectangles(display, disp_gc, 0, 0, &rect, 1, Unsorted);
-
-        XCopyArea(display, win, win, disp_gc,
-                    WinLeft, WinTop,
+        ScrollDoc(WinLeft, WinTop,
                     WinWidth + delta, WinHeight,
                     WinLeft - delta, WinTop);
 
@@ -383,14 +917,25 @@ void MoveHDisplay(int indent)
 
 void MoveVDisplay(long h)
 {
-    XRectangle rect;
     int delta;
 
     /* see if change in pixel offset from start of document is
        small enough to justify a scroll of window contents     */
 
     if (document == HTMLDOCUMENT)
+    {
+        /* ensure a large document has been laid out this far */
+
+        while (LayoutEnd && h + WinHeight > LayoutHeight)
+        {
+            ExtendLayout(1);
+
+            if (h > buf_height - WinHeight)
+                h = (buf_height > WinHeight ? buf_height - WinHeight : 0);
+        }
+
         delta = DeltaHTMLPosition(h);
+    }
     else
         delta = DeltaTextPosition(h);
 
@@ -398,37 +943,17 @@ void MoveVDisplay(long h)
     {
         /* document moves up by delta pixels thru window */
 
-        rect.x = WinLeft;
-        rect.y = WinTop;
-        rect.width = WinWidth;
-        rect.height = WinHeight;
-        XSetClipRectangles(display, disp_gc, 0, 0, &rect, 1, Unsorted);
-
-        XCopyArea(display, win, win, disp_gc,
-                    WinLeft, WinTop + delta,
+        ScrollDoc(WinLeft, WinTop + delta,
                     WinWidth, WinHeight - delta,
                     WinLeft, WinTop);
 
-        /* we must note that a copy request has been issued, and avoid further
-           such requests until all resulting GraphicsExpose events are handled
-           as these will repair any holes caused by windows above this one */
-
-        ExposeCount = 1;
-
         DisplayDoc(WinLeft, WinBottom - delta, WinWidth, delta);
     }
     else if (delta < 0 && -delta < (2 * WinHeight)/3)
     {
         /* document moves down by delta pixels thru window */
 
-        rect.x = WinLeft;
-        rect.y = WinTop;
-        rect.width = WinWidth;
-        rect.height = WinHeight;
-        XSetClipRectangles(display, disp_gc, 0, 0, &rect, 1, Unsorted);
-
-        XCopyArea(display, win, win, disp_gc,
-                    WinLeft, WinTop,
+        ScrollDoc(WinLeft, WinTop,
                     WinWidth, WinHeight + delta,
                     WinLeft, WinTop - delta);
 
@@ -668,7 +1193,7 @@ void SlideVDisplay(int slider, int scrollExtent)
 
 */
 
-void DisplayDoc(int x, int y, unsigned int w, unsigned int h)
+static void PaintDoc(int x, int y, unsigned int w, unsigned int h)
 {
     int line_number, c, len, x1, y1;
     char *p, *r, lbuf[512];
@@ -679,12 +1204,10 @@ void DisplayDoc(int x, int y, unsigned int w, unsigned int h)
     if (document == HTMLDOCUMENT)
     {
         DisplayHTML(x, y, w, h);
-        PaintVersion(error);
         return;
     }
 
     error = 0;
-    PaintVersion(error);
 
     nClipped = PixelOffset % lineHeight;
     SetFont(disp_gc, IDX_FIXEDFONT);
@@ -772,6 +1295,29 @@ void DisplayDoc(int x, int y, unsigned int w, unsigned int h)
     }
 }
 
+/* paint given area of document via backing, the whole
+   area is painted if backing doesn't yet hold it */
+
+void DisplayDoc(int x, int y, unsigned int w, unsigned int h)
+{
+    if (!backingValid && !painting && NewBacking())
+    {
+        x = WinLeft;
+        y = WinTop;
+        w = WinWidth;
+        h = WinHeight;
+        backingValid = 1;
+    }
+
+    BeginPaint();
+    PaintDoc(x, y, w, h);
+    EndPaint();
+
+    PaintVersion(error);
+    Damage(x, y, w, h);
+    ShowDamage();
+}
+
 /* what is the offset from the start of the file to the current line? */
 
 long CurrentHeight(char *buf)
@@ -796,7 +1342,6 @@ long CurrentHeight(char *buf)
 /* how long (in pixels) is the file ? */
 long DocHeight(char *buf, int *width)
 {
-    char *p;
     int w;
     long height;
     extern int debug;
@@ -812,23 +1357,11 @@ long DocHeight(char *buf, int *width)
     }
     else
     {
-        height = (*buf ? lineHeight : 0);
-        p = buf;
+        if (buf != LineBase)
+            IndexLines(buf);
 
-        while (*buf)
-        {
-            if (*buf++ == '\n')
-            {
-                height += lineHeight;
-                w = chWidth * (buf - p);
-                p = buf;
-
-                if (w > *width)
-                    *width = w;
-            }
-        }
-
-        w = chWidth * (buf - p - 1);
+        height = LineCount * lineHeight;
+        w = chWidth * LongestLine;
 
         if (w > *width)
             *width = w;
@@ -974,15 +1507,8 @@ void FindString(char *str, char **next)
         }
         else   */
         {
-            p = buffer;
             StartOfLine = buffer+i;
-            PixelOffset = (*p ? lineHeight : 0);
-
-            while (*p && p < StartOfLine)
-            {
-                if (*p++ == '\n')
-                    PixelOffset += lineHeight;
-            }
+            PixelOffset = LineOf(StartOfLine) * lineHeight;
 
             if (PixelOffset + WinHeight > buf_height)
             {
@@ -1008,7 +1534,7 @@ void FindString(char *str, char **next)
 /* toggle view between HTML and PLAIN */
 void ToggleView(void)
 {
-    char *p, *q, *start;
+    char *q, *start;
     long offset, maxOffset, target;
 
     if (CurrentDoc.type == HTMLDOCUMENT)
@@ -1017,17 +1543,9 @@ void ToggleView(void)
         {
             document = TEXTDOCUMENT;
             SetFont(disp_gc, IDX_FIXEDFONT);
-            p = buffer+hdrlen;
             start = TopStr(&background);
-            offset = 0;   /* (*p ? lineHeight : 0); */
-
-            while (*p && p < start)
-            {
-                if (*p++ == '\n')
-                    offset += lineHeight;
-            }
-
             buf_height = DocHeight(buffer+hdrlen, &buf_width);
+            offset = LineOf(start) * lineHeight;
             maxOffset = buf_height - WinHeight;
 
             if (offset > maxOffset)
@@ -1043,7 +1561,9 @@ void ToggleView(void)
             SetFont(disp_gc, IDX_NORMALFONT);
             targetptr = StartOfLine;
             PixelOffset = 0;
+            LayoutEnd = NULL;
             buf_height = ParseHTML(&buf_width);
+            EndCacheBatch();  /* as the layout is complete */
 
             if (ViewOffset > 0)
             {
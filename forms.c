@@ -221,8 +221,8 @@ Field *GetField(Form *form, int type, int x, char *name, int nlen,
             }
         }
 
-        Warn("Can't find field %d in form for %s", form->i, form->action);
-        return NULL;
+        /* otherwise a new field beyond the part of a
+           large document laid out before, see NewBuffer() */
     }
 
     field = (Field *)malloc(sizeof(Field));
@@ -310,7 +310,7 @@ Option *AddOption(Field *field, int flags, char *label, int len)
     {
         for (option = field->options; option != NULL; option = option->next)
         {
-            if (option->j == option->j)
+            if (option->j == field->j)
             {
                 field->j += 1;
                 font = flags & 0x0F;
@@ -322,9 +322,6 @@ Option *AddOption(Field *field, int flags, char *label, int len)
                 return option;
             }
         }
-
-        Warn("Can't find option %d in field for %s", field->i, field->name);
-        return NULL;
     }
 
     option = (Option *)malloc(sizeof(Option));
@@ -146,7 +146,11 @@ int Magic64[256] =    /* for 4 levels of red and blue */
 
 };
 
-struct
+/* the screen descriptor and GIF89 extensions are only needed while
+   StartGif() reads the header, so are kept on its stack, leaving no
+   decoder state in statics */
+
+typedef struct
     {
         unsigned int    Width;
         unsigned int    Height;
@@ -156,19 +160,18 @@ struct
         unsigned int    Background;
         unsigned int    AspectRatio;
         int             xGreyScale;
-    } GifScreen;
+    } ScreenDesc;
 
-struct
+typedef struct
     {
         int     transparent;
         int     delayTime;
         int     inputFlag;
         int     disposal;
-    } Gif89 = { -1, -1, -1, 0 };
+    } Gif89Ext;
 
 int verbose = FALSE;
 int showComment = FALSE;
-int ZeroDataBlock = FALSE;
 
 size_t ReadOK(Block *bp, unsigned char *buffer, int len)
 {
@@ -185,193 +188,6 @@ size_t ReadOK(Block *bp, unsigned char *buffer, int len)
     return 0;
 }
 
-/*
-**  Pulled out of nextCode
-*/
-static  int             curbit, lastbit, get_done, last_byte;
-static  int             return_clear;
-/*
-**  Out of nextLWZ
-*/
-static int      stack[(1<<(MAX_LWZ_BITS))*2], *sp;
-static int      code_size, set_code_size;
-static int      max_code, max_code_size;
-static int      clear_code, end_code;
-
-static void initLWZ(int input_code_size)
-{
-        static int      inited = FALSE;
-
-        set_code_size = input_code_size;
-        code_size     = set_code_size + 1;
-        clear_code    = 1 << set_code_size ;
-        end_code      = clear_code + 1;
-        max_code_size = 2 * clear_code;
-        max_code      = clear_code + 2;
-
-        curbit = lastbit = 0;
-        last_byte = 2;
-        get_done = FALSE;
-
-        return_clear = TRUE;
-
-        sp = stack;
-}
-
-static int nextCode(Block *bp, int code_size)
-{
-        static unsigned char    buf[280];
-        static int maskTbl[16] = {
-                0x0000, 0x0001, 0x0003, 0x0007,
-                0x000f, 0x001f, 0x003f, 0x007f,
-                0x00ff, 0x01ff, 0x03ff, 0x07ff,
-                0x0fff, 0x1fff, 0x3fff, 0x7fff,
-        };
-        int                     i, j, ret, end;
-
-        if (return_clear) {
-                return_clear = FALSE;
-                return clear_code;
-        }
-
-        end = curbit + code_size;
-
-        if (end >= lastbit) {
-                int     count;
-
-                if (get_done) {
-                        if (curbit >= lastbit)
-                        {
-#if 0
-                                ERROR("ran off the end of my bits" );
-#endif
-                        }
-                        return -1;
-                }
-                buf[0] = buf[last_byte-2];
-                buf[1] = buf[last_byte-1];
-
-                if ((count = GetDataBlock(bp, &buf[2])) == 0)
-                        get_done = TRUE;
-
-                last_byte = 2 + count;
-                curbit = (curbit - lastbit) + 16;
-                lastbit = (2+count)*8 ;
-
-                end = curbit + code_size;
-        }
-
-        j = end / 8;
-        i = curbit / 8;
-
-        if (i == j)
-                ret = (int)buf[i];
-        else if (i + 1 == j)
-                ret = (int)buf[i] | ((int)buf[i+1] << 8);
-        else
-                ret = (int)buf[i] | ((int)buf[i+1] << 8) | ((int)buf[i+2] << 16);
-
-        ret = (ret >> (curbit % 8)) & maskTbl[code_size];
-
-        curbit += code_size;
-
-        return ret;
-}
-
-#define readLWZ(bp) ((sp > stack) ? *--sp : nextLWZ(bp))
-
-static int nextLWZ(Block *bp)
-{
-        static int       table[2][(1<< MAX_LWZ_BITS)];
-        static int       firstcode, oldcode;
-        int              code, incode;
-        register int     i;
-
-        while ((code = nextCode(bp, code_size)) >= 0) {
-               if (code == clear_code) {
-
-                        /* corrupt GIFs can make this happen */
-                        if (clear_code >= (1<<MAX_LWZ_BITS))
-                        {
-                                return -2;
-                        }
-
-                       for (i = 0; i < clear_code; ++i) {
-                               table[0][i] = 0;
-                               table[1][i] = i;
-                       }
-                       for (; i < (1<<MAX_LWZ_BITS); ++i)
-                               table[0][i] = table[1][i] = 0;
-                       code_size = set_code_size+1;
-                       max_code_size = 2*clear_code;
-                       max_code = clear_code+2;
-                       sp = stack;
-                        do {
-                               firstcode = oldcode = nextCode(bp, code_size);
-                        } while (firstcode == clear_code);
-
-                        return firstcode;
-               }
-               if (code == end_code) {
-                       int             count;
-                       unsigned char   buf[260];
-
-                       if (ZeroDataBlock)
-                               return -2;
-
-                       while ((count = GetDataBlock(bp, buf)) > 0)
-                               ;
-
-                       if (count != 0)
-                        {
-#if 0
-                               INFO_MSG(("missing EOD in data stream (common occurence)"));
-#endif
-                        }
-                       return -2;
-               }
-
-               incode = code;
-
-               if (code >= max_code) {
-                       *sp++ = firstcode;
-                       code = oldcode;
-               }
-
-               while (code >= clear_code) {
-                       *sp++ = table[1][code];
-                       if (code == table[0][code])
-                        {
-#if 0
-                               ERROR("circular table entry BIG ERROR");
-                               return(code);
-#endif
-                        }
-                       code = table[0][code];
-               }
-
-               *sp++ = firstcode = table[1][code];
-
-               if ((code = max_code) <(1<<MAX_LWZ_BITS)) {
-                       table[0][code] = oldcode;
-                       table[1][code] = firstcode;
-                       ++max_code;
-                       if ((max_code >= max_code_size) &&
-                               (max_code_size < (1<<MAX_LWZ_BITS))) {
-                               max_code_size *= 2;
-                               ++code_size;
-                       }
-               }
-
-               oldcode = incode;
-
-               if (sp > stack)
-                       return *--sp;
-        }
-        return code;
-}
-
-
 static int GetDataBlock(Block *bp, unsigned char *buf)
 {
     unsigned char count;
@@ -384,8 +200,6 @@ static int GetDataBlock(Block *bp, unsigned char *buf)
         return -1;
     }
 
-    ZeroDataBlock = count == 0;
-
     if ((count != 0) && (! ReadOK(bp, buf, count)))
     {
         fprintf(stderr, "error in reading DataBlock\n");
@@ -395,348 +209,343 @@ static int GetDataBlock(Block *bp, unsigned char *buf)
     return (int)(count);
 }
 
-static unsigned char *ReadImage(Block *bp, int len, int height,
-     Color colors[MAXCOLORMAPSIZE], int grey, int interlace, int ignore)
+/*
+    The LZW decoder keeps its state in an LZW structure rather than
+    in statics, so that several images can be decoded at once. Each
+    table entry holds the code for its prefix, its last char and the
+    length of its string, so that strings are written backwards
+    straight into the caller's row instead of being pushed through
+    a stack a char at a time. Codes are taken from a bit buffer as
+    wide as a long, which is refilled from the current data sub-block
+    as many bytes at a time as it will hold.
+*/
+
+#define LZW_TABLE   (1 << MAX_LWZ_BITS)
+#define BUFBITS     (8 * sizeof(unsigned long))
+
+typedef struct
 {
-    unsigned char   c;      
-    int             v;
-    int             xpos = 0, ypos = 0, pass = 0;
-    unsigned char   *data, *dp, *dy;
-    int             cr, cg, cb, r, g, b, row, col;
-    Color           color;
+    Block *bp;                  /* the GIF data */
+    unsigned char block[256];   /* current data sub-block */
+    int next, count;            /* position in and size of block */
+    int done;                   /* no more data sub-blocks */
+    int finished;               /* seen end code or bad data */
+    int partial;                /* more data may yet arrive */
+    unsigned long bits;         /* bit buffer, next code in lsb */
+    int nbits;                  /* number of bits in buffer */
+    int init_size;              /* code size after clear code */
+    int code_size, clear_code, end_code;
+    int max_code, max_code_size;
+    int oldcode;                /* last code or -1 after clear code */
+    unsigned char *held;        /* rest of string too long for last row */
+    int nheld;
+    unsigned short prefix[LZW_TABLE];
+    unsigned char suffix[LZW_TABLE];
+    unsigned short length[LZW_TABLE];
+    unsigned char string[LZW_TABLE];  /* for strings that don't fit */
+} LZW;
+
+/* returns 0 if the initial code size is out of range */
+
+static int InitLZW(LZW *lz, Block *bp, int input_code_size)
+{
+    int i;
 
-  /*
-   *  Initialize the Compression routines
-   */
+    lz->bp = bp;
+    lz->next = lz->count = 0;
+    lz->done = lz->finished = lz->partial = FALSE;
+    lz->bits = 0;
+    lz->nbits = 0;
+    lz->nheld = 0;
 
-    if (! ReadOK(bp,&c,1))
-    {
-        fprintf(stderr, "EOF / read error on image data\n");
-        return(NULL);
-    }
+    /* corrupt GIFs can make this happen */
 
-    initLWZ(c);
+    if (input_code_size < 1 || input_code_size >= MAX_LWZ_BITS)
+        return 0;
 
-   /*
-    *  If this is an "uninteresting picture" ignore it.
-    */
+    lz->init_size = lz->code_size = input_code_size + 1;
+    lz->clear_code = 1 << input_code_size;
+    lz->end_code = lz->clear_code + 1;
+    lz->max_code = lz->clear_code + 2;
+    lz->max_code_size = 2 * lz->clear_code;
+    lz->oldcode = -1;
 
-    if (ignore)
+    for (i = 0; i < lz->clear_code; ++i)
     {
-        if (verbose)
-            fprintf(stderr, "skipping image...\n" );
+        lz->prefix[i] = 0;
+        lz->suffix[i] = i;
+        lz->length[i] = 1;
+    }
 
-        while (readLWZ(bp) >= 0);
+    return 1;
+}
 
-        return NULL;
-    }
+/* has the whole of the next data sub-block arrived? */
 
-    data = (unsigned char *)malloc(len * height);
+static int BlockReady(Block *bp)
+{
+    return (bp->next < bp->size &&
+            bp->next + 1 + (unsigned char)bp->buffer[bp->next] <= bp->size);
+}
 
-    if (data == NULL)
-    {
-        fprintf(stderr, "Cannot allocate space for image data\n");
-        return(NULL);
-    }
+/* returns next code, -1 at end of data, or -2 if
+   the data is partial and the rest hasn't arrived */
 
-    if (verbose)
-        fprintf(stderr, "reading %d by %d%s GIF image\n",
-                 len, height, interlace ? " interlaced" : "" );
+static int NextCode(LZW *lz)
+{
+    int code;
 
-    if (interlace)
+    while (lz->nbits < lz->code_size)
     {
-        int i;
-        int pass = 0, step = 8;
-
-        for (i = 0; i < height; ++i)
+        if (lz->next >= lz->count)
         {
-            dp = &data[len*ypos];
-            col = ypos & 15;
+            if (lz->partial && !lz->done && !BlockReady(lz->bp))
+                return -2;
 
-            for (xpos = 0; xpos < len; ++xpos)
+            if (lz->done || (lz->count = GetDataBlock(lz->bp, lz->block)) <= 0)
             {
-                if ((v = readLWZ(bp)) < 0)
-                    goto fini;
-
-                if (v == Gif89.transparent)
-                {
-                    *dp++ = windowColor;
-                    continue;
-                }
-
-                color = colors[v];
-                row = xpos & 15;
-
-                if (!grey && imaging == COLOR232)
-                {
-                    if (color.grey > 0)
-                        goto grey_color1;
-
-                    cr = color.red;
-                    cg = color.green;
-                    cb = color.blue;
-
-                    r = cr & 0xC0;
-                    g = cg & 0xE0;
-                    b = cb & 0xC0;
-
-                    v = (row << 4) + col;
-
-                    if (cr - r > Magic64[v])
-                        r += 64;
-
-                    if (cg - g > Magic32[v])
-                        g += 32;
-
-                    if (cb - b > Magic64[v])
-                        b += 64;
-
-                 /* clamp error to keep color in range 0 to 255 */
-
-                    r = min(r, 255) & 0xC0;
-                    g = min(g, 255) & 0xE0;
-                    b = min(b, 255) & 0xC0;
-
-                    *dp++ = stdcmap[(r >> 6) | (g >> 3) | (b >> 1)];
-                    continue;
-                }
-
-                if (imaging == MONO)
-                {
-                    if (color.grey < Magic256[(row << 4) + col])
-                        *dp++ = greymap[0];
-                    else
-                        *dp++ = greymap[15];
-                    continue;
-                }
-
-           grey_color1:
-
-                cg  = color.grey;
-                g = cg & 0xF0;
-
-                if (cg - g > Magic16[(row << 4) + col])
-                    g += 16;
-
-                g = min(g, 0xF0);
-                *dp++ = greymap[g >> 4];
+                lz->done = TRUE;
+                return -1;
             }
 
-            if ((ypos += step) >= height)
-            {
-                if (pass++ > 0)
-                    step /= 2;
+            lz->next = 0;
+        }
 
-                ypos = step /2;
-            }
+        do
+        {
+            lz->bits |= (unsigned long)lz->block[lz->next++] << lz->nbits;
+            lz->nbits += 8;
         }
+        while (lz->nbits <= BUFBITS - 8 && lz->next < lz->count);
     }
-    else
-    {
-        dp = data;
 
-        for (ypos = 0; ypos < height; ++ypos)
-        {
-            col = ypos & 15;
+    code = lz->bits & ((1 << lz->code_size) - 1);
+    lz->bits >>= lz->code_size;
+    lz->nbits -= lz->code_size;
+    return code;
+}
 
-            for (xpos = 0; xpos < len; ++xpos)
-            {
-                if ((v = readLWZ(bp)) < 0)
-                    goto fini;
+/* decode up to n pixels into row, returns the number decoded
+   which is less than n only at the end of the image data, or
+   when the data is partial and the rest hasn't yet arrived */
 
-                if (v == Gif89.transparent)
-                {
-                    *dp++ = windowColor;
-                    continue;
-                }
+static int ReadLZW(LZW *lz, unsigned char *row, int n)
+{
+    unsigned char *p, *q, *end;
+    int i, c, code, len;
 
-                color = colors[v];
-                row = xpos & 15;
+    p = row;
+    end = row + n;
 
-                if (!grey && imaging == COLOR232)
-                {
-                    if (color.grey > 0)
-                        goto grey_color2;
+    /* start with whatever didn't fit last time */
 
-                    cr = color.red;
-                    cg = color.green;
-                    cb = color.blue;
+    if (lz->nheld > 0)
+    {
+        len = (lz->nheld < n ? lz->nheld : n);
+        memcpy(p, lz->held, len);
+        lz->held += len;
+        lz->nheld -= len;
+        p += len;
+    }
 
-                    r = cr & 0xC0;
-                    g = cg & 0xE0;
-                    b = cb & 0xC0;
+    while (p < end && !lz->finished)
+    {
+        if ((code = NextCode(lz)) < 0)
+        {
+            if (code == -1)
+                lz->finished = TRUE;
 
-                    v = (row << 4) + col;
+            break;
+        }
 
-                    if (cr - r > Magic64[v])
-                        r += 64;
+        if (code == lz->clear_code)
+        {
+            lz->code_size = lz->init_size;
+            lz->max_code = lz->clear_code + 2;
+            lz->max_code_size = 2 * lz->clear_code;
+            lz->oldcode = -1;
+            continue;
+        }
 
-                    if (cg - g > Magic32[v])
-                        g += 32;
+        if (code == lz->end_code ||
+            code > lz->max_code ||
+            (lz->oldcode < 0 && code >= lz->clear_code))
+        {
+            lz->finished = TRUE;
+            break;
+        }
 
-                    if (cb - b > Magic64[v])
-                        b += 64;
+        if (lz->oldcode < 0)
+        {
+            *p++ = lz->oldcode = code;
+            continue;
+        }
 
-                 /* clamp error to keep color in range 0 to 255 */
+        /* the code not yet in the table is the last string
+           followed by its own first char, as in KwKwK */
 
-                    r = min(r, 255) & 0xC0;
-                    g = min(g, 255) & 0xE0;
-                    b = min(b, 255) & 0xC0;
+        if (code == lz->max_code)
+        {
+            len = lz->length[lz->oldcode] + 1;
+            c = lz->oldcode;
+            i = len - 2;
+        }
+        else
+        {
+            len = lz->length[code];
+            c = code;
+            i = len - 1;
+        }
 
-                    *dp++ = stdcmap[(r >> 6) | (g >> 3) | (b >> 1)];
-                    continue;
-                }
+        q = (len <= end - p ? p : lz->string);
 
-                if (imaging == MONO)
-                {
-                    if (color.grey < Magic256[(row << 4) + col])
-                        *dp++ = greymap[0];
-                    else
-                        *dp++ = greymap[15];
-                    continue;
-                }
+        for (; i > 0; --i)
+        {
+            q[i] = lz->suffix[c];
+            c = lz->prefix[c];
+        }
 
-            grey_color2:
+        q[0] = c;
 
-                cg  = color.grey;
-                g = cg & 0xF0;
+        if (code == lz->max_code)
+            q[len-1] = c;
 
-                if (cg - g > Magic16[(row << 4) + col])
-                    g += 16;
+        if (lz->max_code < LZW_TABLE)
+        {
+            lz->prefix[lz->max_code] = lz->oldcode;
+            lz->suffix[lz->max_code] = c;
+            lz->length[lz->max_code] = lz->length[lz->oldcode] + 1;
 
-                g = min(g, 0xF0);
-                *dp++ = greymap[g >> 4];
+            if (++lz->max_code >= lz->max_code_size &&
+                    lz->max_code_size < LZW_TABLE)
+            {
+                lz->max_code_size *= 2;
+                ++lz->code_size;
             }
         }
-    }
 
- fini:
+        lz->oldcode = code;
 
-    if (readLWZ(bp) >= 0)
-        fprintf(stderr, "too much input data, ignoring extra...\n");
+        if (q == p)
+            p += len;
+        else
+        {
+            n = end - p;
+            memcpy(p, q, n);
+            p = end;
+            lz->held = q + n;
+            lz->nheld = len - n;
+        }
+    }
 
-    return data;
+    return p - row;
 }
 
-static unsigned char *ReadImage24(Block *bp, int len, int height,
-     Color colors[MAXCOLORMAPSIZE], int nColors, int interlace, int ignore)
+/* skip any data sub-blocks left after the image */
+
+static void EndLZW(LZW *lz)
 {
-    unsigned char   c;      
-    int             v;
-    int             xpos = 0, ypos = 0, pass = 0;
-    unsigned char   *dp;
-    unsigned long pixels[MAXCOLORMAPSIZE], *pp, *data24;
+    while (!lz->done)
+    {
+        if (GetDataBlock(lz->bp, lz->block) <= 0)
+            lz->done = TRUE;
+    }
+}
 
-   /* setup pixel table for faster rendering */
+/* dither color to one of the preallocated colors, v gives the
+   phase of the dither matrix as (x & 15) << 4 | (y & 15) */
 
-    dp = (unsigned char *)&(pixels[0]);
+static unsigned char DitherColor(Color *color, int grey, int v)
+{
+    int cr, cg, cb, r, g, b;
 
-    for (v = 0; v < nColors; ++v)
+    if (!grey && imaging == COLOR232 && color->grey == 0)
     {
-        if (v == Gif89.transparent)
-        {
-            *dp++ = '\0';
-            *dp++ = (windowColor >> 16) & 0xFF;
-            *dp++ = (windowColor >>  8) & 0xFF;
-            *dp++ = windowColor & 0xFF;
-            continue;
-        }
+        cr = color->red;
+        cg = color->green;
+        cb = color->blue;
 
-        *dp++ = '\0';
-        *dp++ = colors[v].red;
-        *dp++ = colors[v].green;
-        *dp++ = colors[v].blue;
-    }
+        r = cr & 0xC0;
+        g = cg & 0xE0;
+        b = cb & 0xC0;
 
-  /*
-   *  Initialize the Compression routines
-   */
+        if (cr - r > Magic64[v])
+            r += 64;
 
-    if (! ReadOK(bp,&c,1))
-    {
-        fprintf(stderr, "EOF / read error on image data\n");
-        return(NULL);
-    }
-
-    initLWZ(c);
+        if (cg - g > Magic32[v])
+            g += 32;
 
-   /*
-    *  If this is an "uninteresting picture" ignore it.
-    */
+        if (cb - b > Magic64[v])
+            b += 64;
 
-    if (ignore)
-    {
-        if (verbose)
-            fprintf(stderr, "skipping image...\n" );
+     /* clamp error to keep color in range 0 to 255 */
 
-        while (readLWZ(bp) >= 0);
+        r = min(r, 255) & 0xC0;
+        g = min(g, 255) & 0xE0;
+        b = min(b, 255) & 0xC0;
 
-        return NULL;
+        return stdcmap[(r >> 6) | (g >> 3) | (b >> 1)];
     }
 
-    data24 = (unsigned long *)malloc(len * height * sizeof(unsigned long));
+    if (imaging == MONO)
+        return (color->grey < Magic256[v] ? greymap[0] : greymap[15]);
 
-    if (data24 == NULL)
-    {
-        fprintf(stderr, "Cannot allocate space for image data\n");
-        return(NULL);
-    }
+    cg  = color->grey;
+    g = cg & 0xF0;
 
-    if (verbose)
-        fprintf(stderr, "reading %d by %d%s GIF image\n",
-                 len, height, interlace ? " interlaced" : "" );
+    if (cg - g > Magic16[v])
+        g += 16;
 
-    if (interlace)
-    {
-        int i;
-        int pass = 0, step = 8;
+    g = min(g, 0xF0);
+    return greymap[g >> 4];
+}
 
-        for (i = 0; i < height; ++i)
-        {
-            pp = &data24[len*ypos];
+/*
+   For all but the smallest images the palette is dithered once for
+   each phase of the dither matrix the image uses, into a table with
+   256 entries per phase, laid out as table[y & 15][x & 15][color].
+   Each row then needs just a table lookup per pixel, done sixteen
+   at a time so that the phase for each is a constant.
+*/
 
-            for (xpos = 0; xpos < len; ++xpos)
-            {
-                if ((v = readLWZ(bp)) < 0)
-                    goto fini;
+static unsigned char *DitherTable(int len, int height,
+     Color colors[MAXCOLORMAPSIZE], int nColors, int grey, int transparent)
+{
+    int x, y, v, nx, ny;
+    unsigned char *table, *tp;
 
-                *pp++ = pixels[i];
-            }
+    nx = min(len, 16);
+    ny = min(height, 16);
 
-            if ((ypos += step) >= height)
-            {
-                if (pass++ > 0)
-                    step /= 2;
+    if ((long)len * height <= (long)nx * ny * nColors)
+        return NULL;
 
-                ypos = step /2;
-            }
-        }
-    }
-    else
-    {
-        pp = data24;
+    if ((table = (unsigned char *)calloc(16 * 16 * 256, 1)) == NULL)
+        return NULL;
 
-        for (ypos = 0; ypos < height; ++ypos)
+    for (y = 0; y < ny; ++y)
+    {
+        for (x = 0; x < nx; ++x)
         {
-            for (xpos = 0; xpos < len; ++xpos)
-            {
-                if ((v = readLWZ(bp)) < 0)
-                    goto fini;
+            tp = table + (y << 12) + (x << 8);
 
-                *pp++ = pixels[v];
+            for (v = 0; v < nColors; ++v)
+            {
+                if (v == transparent)
+                    tp[v] = windowColor;
+                else
+                    tp[v] = DitherColor(&colors[v], grey, (x << 4) + y);
             }
+
+            if (transparent >= nColors)
+                tp[transparent] = windowColor;
         }
     }
 
- fini:
-
-    if (readLWZ(bp) >= 0)
-        fprintf(stderr, "too much input data, ignoring extra...\n");
-
-    return (unsigned char *)data24;
+    return table;
 }
 
-static int DoExtension(Block *bp, int label)
+static int DoExtension(Block *bp, int label, Gif89Ext *gif89)
 {
     static char buf[256];
     char *str;
@@ -763,12 +572,12 @@ static int DoExtension(Block *bp, int label)
         case 0xf9:              /* Graphic Control Extension */
             str = "Graphic Control Extension";
             (void) GetDataBlock(bp, (unsigned char*) buf);
-            Gif89.disposal    = (buf[0] >> 2) & 0x7;
-            Gif89.inputFlag   = (buf[0] >> 1) & 0x1;
-            Gif89.delayTime   = LM_to_uint(buf[1],buf[2]);
+            gif89->disposal    = (buf[0] >> 2) & 0x7;
+            gif89->inputFlag   = (buf[0] >> 1) & 0x1;
+            gif89->delayTime   = LM_to_uint(buf[1],buf[2]);
 
             if ((buf[0] & 0x1) != 0)
-                Gif89.transparent = (int)((unsigned char)buf[3]);
+                gif89->transparent = (int)((unsigned char)buf[3]);
 
             while (GetDataBlock(bp, (unsigned char*) buf) != 0)
                    ;
@@ -833,21 +642,97 @@ static int ReadColorMap(Block *bp, Image *image, int ncolors, Color *colors, int
     return 1;
 }
 
-unsigned char *LoadGifImage(Image *image, Block *bp, unsigned int depth)
+/*
+    An image is decoded by StartGif(), which reads the GIF header up
+    to the start of the first image's data, then ContinueGif(), which
+    decodes as much of the data as has arrived, and EndGif(). This
+    allows images to be shown progressively as they arrive over the
+    net, see image.c. When told the data is partial, ContinueGif()
+    stops at the first incomplete data sub-block to be resumed later,
+    and repeats each row of an interlaced image down to the next row
+    of the pass, so that each pass fills in detail over the last.
+*/
+
+struct gif_state
+{
+    LZW lz;
+    Color colors[MAXCOLORMAPSIZE];
+    int nColors, grey, transparent;
+    int width, height, interlace;
+    int rows;               /* rows decoded so far */
+    int xpos;               /* pixels decoded in current row */
+    int ypos, pass, step;   /* where the current row goes */
+    int done;
+    unsigned char *data;    /* the image */
+    unsigned char *table;   /* from DitherTable() or NULL */
+    unsigned char *index;   /* color indices for 24 bit rows */
+    unsigned long pixels[MAXCOLORMAPSIZE];
+};
+
+/* convert the first n color indices of the current row to pixels */
+
+static void ConvertRow(GifState *gs, int n)
+{
+    int v, k, xpos;
+    unsigned char *dp, *tp;
+    unsigned long *pp;
+
+    if (gs->index)
+    {
+        pp = (unsigned long *)gs->data + gs->width * gs->ypos;
+
+        for (xpos = 0; xpos < n; ++xpos)
+            *pp++ = gs->pixels[gs->index[xpos]];
+
+        return;
+    }
+
+    dp = gs->data + gs->width * gs->ypos;
+
+    if (gs->table)
+    {
+        tp = gs->table + ((gs->ypos & 15) << 12);
+
+        for (xpos = 0; xpos + 16 <= n; xpos += 16, dp += 16)
+        {
+            for (k = 0; k < 16; ++k)
+                dp[k] = tp[(k << 8) + dp[k]];
+        }
+
+        for (k = 0; xpos < n; ++xpos, ++k)
+            dp[k] = tp[(k << 8) + dp[k]];
+
+        return;
+    }
+
+    for (xpos = 0; xpos < n; ++xpos, ++dp)
+    {
+        v = *dp;
+
+        if (v == gs->transparent)
+            *dp = windowColor;
+        else
+            *dp = DitherColor(&gs->colors[v], gs->grey, ((xpos & 15) << 4) + (gs->ypos & 15));
+    }
+}
+
+/* read GIF header from bp up to the first image's data, setting
+   image's size and *data to where it will be decoded. Returns
+   NULL if this isn't a GIF or it is damaged. */
+
+GifState *StartGif(Image *image, Block *bp, unsigned int depth, unsigned char **data)
 {
     unsigned char   buf[16];
-    unsigned char   *data = NULL;
-    unsigned char   c;
+    unsigned char   c, *dp;
     Color           *cmap, colors[MAXCOLORMAPSIZE];
     int             useGlobalColormap;
     int             bitPixel;
-    int             imageCount = 0;
     char            version[4];
-    int             imageNumber = 1;
-    int             i;
+    int             v;
     int             greyScale = 0;
-    unsigned long pixel;
-    unsigned int w, h;
+    GifState        *gs;
+    ScreenDesc      GifScreen;
+    Gif89Ext        Gif89;
 
     verbose = FALSE;
     showComment = FALSE;
@@ -910,7 +795,7 @@ unsigned char *LoadGifImage(Image *image, Block *bp, unsigned int depth)
     if (GifScreen.AspectRatio != 0 && GifScreen.AspectRatio != 49)
         fprintf(stderr, "Warning:  non-square pixels!\n");
 
-    while (data == NULL)
+    for (;;)
     {
         if (! ReadOK(bp,&c,1))
         {
@@ -920,13 +805,8 @@ unsigned char *LoadGifImage(Image *image, Block *bp, unsigned int depth)
 
         if (c == ';')
         {         /* GIF terminator */
-
-            if (imageCount < imageNumber)
-            {
-                fprintf(stderr, "No images found in file\n");
-                return(NULL);
-            }
-            break;
+            fprintf(stderr, "No images found in file\n");
+            return(NULL);
         }
 
         if (c == '!')
@@ -938,72 +818,300 @@ unsigned char *LoadGifImage(Image *image, Block *bp, unsigned int depth)
                 return(NULL);
             }
 
-            DoExtension(bp, c);
+            DoExtension(bp, c, &Gif89);
             continue;
         }
 
-        if (c != ',')
-        {         /* Not a valid start character */
-            fprintf(stderr, "bogus character 0x%02x, ignoring\n", (int)c);
-            continue;
-        }
+        if (c == ',')
+            break;
+
+        /* Not a valid start character */
+        fprintf(stderr, "bogus character 0x%02x, ignoring\n", (int)c);
+    }
+
+    if (! ReadOK(bp,buf,9))
+    {
+        fprintf(stderr,"couldn't read left/top/width/height\n");
+        return(NULL);
+    }
 
-        ++imageCount;
+    useGlobalColormap = ! BitSet(buf[8], LOCALCOLORMAP);
 
-        if (! ReadOK(bp,buf,9))
+    bitPixel = 1<<((buf[8]&0x07)+1);
+
+    if (! useGlobalColormap)
+    {
+        if (!ReadColorMap(bp, image, bitPixel, colors, &greyScale))
         {
-            fprintf(stderr,"couldn't read left/top/width/height\n");
+            fprintf(stderr, "error reading local colormap\n");
             return(NULL);
         }
 
-        useGlobalColormap = ! BitSet(buf[8], LOCALCOLORMAP);
+        cmap = colors;
+    }
+    else
+    {
+        cmap = GifScreen.colors;
+        bitPixel = GifScreen.BitPixel;
+        greyScale = GifScreen.xGreyScale;
+    }
 
-        bitPixel = 1<<((buf[8]&0x07)+1);
+    if (! ReadOK(bp,&c,1))
+    {
+        fprintf(stderr, "EOF / read error on image data\n");
+        return(NULL);
+    }
 
-     /* Just set width/height for the imageNumber we are requesting */
+    if ((gs = (GifState *)malloc(sizeof(GifState))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate space for image data\n");
+        return(NULL);
+    }
 
-        if (imageCount == imageNumber)
-        {
-            image->width = LM_to_uint(buf[4],buf[5]);
-            image->height = LM_to_uint(buf[6],buf[7]);
-        }
+    if (!InitLZW(&gs->lz, bp, c))
+    {
+        fprintf(stderr, "bad LZW code size %d\n", c);
+        free(gs);
+        return(NULL);
+    }
 
-        if (! useGlobalColormap)
+    image->width = gs->width = LM_to_uint(buf[4],buf[5]);
+    image->height = gs->height = LM_to_uint(buf[6],buf[7]);
+    gs->interlace = BitSet(buf[8], INTERLACE);
+    gs->nColors = bitPixel;
+    gs->grey = greyScale;
+    gs->transparent = Gif89.transparent;
+    memcpy(gs->colors, cmap, sizeof(gs->colors));
+    gs->rows = gs->xpos = gs->ypos = gs->pass = 0;
+    gs->step = (gs->interlace ? 8 : 1);
+    gs->done = FALSE;
+    gs->table = gs->index = NULL;
+
+    if (depth == 24 || depth == 12)
+    {
+       /* setup pixel table for faster rendering, bad
+          data may use indices beyond the color map */
+
+        memset(gs->pixels, 0, sizeof(gs->pixels));
+        dp = (unsigned char *)&(gs->pixels[0]);
+
+        for (v = 0; v < gs->nColors; ++v)
         {
-            if (!ReadColorMap(bp, image, bitPixel, colors, &greyScale))
+            if (v == gs->transparent)
             {
-                fprintf(stderr, "error reading local colormap\n");
-                return(NULL);
+                *dp++ = '\0';
+                *dp++ = (windowColor >> 16) & 0xFF;
+                *dp++ = (windowColor >>  8) & 0xFF;
+                *dp++ = windowColor & 0xFF;
+                continue;
             }
 
-            cmap = colors;
+            *dp++ = '\0';
+            *dp++ = gs->colors[v].red;
+            *dp++ = gs->colors[v].green;
+            *dp++ = gs->colors[v].blue;
         }
-        else
+
+        gs->data = (unsigned char *)NewImageData(gs->width * gs->height * sizeof(unsigned long));
+        gs->index = (unsigned char *)malloc(gs->width);
+    }
+    else
+    {
+        gs->data = (unsigned char *)NewImageData(gs->width * gs->height);
+        gs->table = DitherTable(gs->width, gs->height, gs->colors,
+                                    gs->nColors, gs->grey, gs->transparent);
+    }
+
+    if (gs->data == NULL || ((depth == 24 || depth == 12) && gs->index == NULL))
+    {
+        fprintf(stderr, "Cannot allocate space for image data\n");
+        EndLZW(&gs->lz);
+        FreeImageData((char *)EndGif(gs));
+        return(NULL);
+    }
+
+    if (verbose)
+        fprintf(stderr, "reading %d by %d%s GIF image\n",
+                 gs->width, gs->height, gs->interlace ? " interlaced" : "" );
+
+    *data = gs->data;
+    return gs;
+}
+
+/* decode what has arrived of the image data in bp, setting
+   *top and *bottom to the range of rows changed. Returns 1
+   once no more rows will change. Call it one last time with
+   partial as 0 when the data is complete, to skip what's left */
+
+int ContinueGif(GifState *gs, Block *bp, int partial, int *top, int *bottom)
+{
+    unsigned char c, *row;
+    int n, h, size;
+
+    *top = gs->height;
+    *bottom = 0;
+
+    if (gs->done)
+        return 1;
+
+    gs->lz.bp = bp;
+    gs->lz.partial = partial;
+    size = (gs->index ? gs->width * sizeof(unsigned long) : gs->width);
+
+    while (gs->rows < gs->height)
+    {
+        if (gs->ypos >= gs->height)  /* shouldn't happen */
         {
-            cmap = GifScreen.colors;
-            bitPixel = GifScreen.BitPixel;
-            greyScale = GifScreen.xGreyScale;
+            gs->rows = gs->height;
+            break;
         }
 
-        if (depth == 24 || depth == 12)
+        /* each row is decoded into place as color indices,
+           which are then replaced by their dithered pixels */
+
+        row = (gs->index ? gs->index : gs->data + gs->width * gs->ypos);
+        n = ReadLZW(&gs->lz, row + gs->xpos, gs->width - gs->xpos);
+
+        if ((gs->xpos += n) < gs->width && !gs->lz.finished)
+            return 0;  /* the rest has yet to arrive */
+
+        ConvertRow(gs, gs->xpos);
+        h = 1;
+
+        if (partial && gs->interlace && gs->xpos == gs->width)
         {
-            data = ReadImage24(bp, LM_to_uint(buf[4],buf[5]),
-                             LM_to_uint(buf[6],buf[7]), cmap, bitPixel,
-                 BitSet(buf[8], INTERLACE), imageCount != imageNumber);
+            h = (gs->pass == 0 ? 8 : gs->step / 2);
+            h = min(h, gs->height - gs->ypos);
+
+            for (n = 1; n < h; ++n)
+                memcpy(gs->data + (gs->ypos + n) * size,
+                        gs->data + gs->ypos * size, size);
         }
-        else
+
+        *top = min(*top, gs->ypos);
+        *bottom = max(*bottom, gs->ypos + h);
+
+        if (gs->xpos < gs->width)  /* ran out of image data */
+        {
+            gs->rows = gs->height;
+            break;
+        }
+
+        gs->xpos = 0;
+        ++gs->rows;
+
+        /* on to the next pass, skipping those which have
+           no rows, as happens for images under 5 rows high */
+
+        if ((gs->ypos += gs->step) >= gs->height)
+        {
+            do
+            {
+                if (gs->pass++ > 0)
+                    gs->step /= 2;
+
+                gs->ypos = gs->step /2;
+            }
+            while (gs->ypos >= gs->height && gs->pass < 4);
+        }
+    }
+
+    if (!partial)
+    {
+        if (ReadLZW(&gs->lz, &c, 1) > 0)
+            fprintf(stderr, "too much input data, ignoring extra...\n");
+
+        EndLZW(&gs->lz);
+        gs->done = TRUE;
+    }
+
+    return 1;
+}
+
+/* returns the image data and frees the rest */
+
+unsigned char *EndGif(GifState *gs)
+{
+    unsigned char *data;
+
+    data = gs->data;
+    Free(gs->table);
+    Free(gs->index);
+    free(gs);
+    return data;
+}
+
+/*
+   Returns 1 once the GIF header and everything up to the first
+   image's data has arrived, so that StartGif() won't run short
+*/
+
+int GifReady(char *buf, long len)
+{
+    unsigned char *p;
+    long n;
+    int flags, size;
+
+    p = (unsigned char *)buf;
+    n = 13;
+
+    if (len < n)
+        return 0;
+
+    if (BitSet(p[10], LOCALCOLORMAP))
+        n += 3 * (2 << (p[10] & 0x07));
+
+    while (n < len)
+    {
+        if (p[n] == ',')
         {
-            data = ReadImage(bp, LM_to_uint(buf[4],buf[5]),
-                             LM_to_uint(buf[6],buf[7]), cmap, greyScale,
-                 BitSet(buf[8], INTERLACE), imageCount != imageNumber);
+            if (n + 10 > len)
+                return 0;
+
+            flags = p[n+9];
+            n += 10;
+
+            if (BitSet(flags, LOCALCOLORMAP))
+                n += 3 * (2 << (flags & 0x07));
+
+            return (n < len);  /* for the LZW code size */
         }
 
-        if (imageCount != imageNumber && data != NULL)
+        if (p[n] == '!')
         {
-            free(data);
-            data = NULL;
+            n += 2;
+
+            do
+            {
+                if (n >= len)
+                    return 0;
+
+                size = p[n];
+                n += 1 + size;
+            }
+            while (size != 0);
+
+            continue;
         }
+
+        if (p[n] == ';')
+            return 1;  /* no image, StartGif() will complain */
+
+        ++n;
     }
 
-    return(data);
+    return 0;
+}
+
+unsigned char *LoadGifImage(Image *image, Block *bp, unsigned int depth)
+{
+    int top, bottom;
+    unsigned char *data;
+    GifState *gs;
+
+    if ((gs = StartGif(image, bp, depth, &data)) == NULL)
+        return NULL;
+
+    ContinueGif(gs, bp, 0, &top, &bottom);
+    return EndGif(gs);
 }
@@ -0,0 +1,313 @@
+/* gifbench.c - times the GIF decoder in gif.c
+
+    gifbench [-r reps] [-d depth] [-i imaging] [-v] files...
+
+Each file is decoded reps times with LoadGifImage() and the overall
+rate given in Mpixels/s. With -v a hash of each decoded image is
+listed instead, so that the output of two builds can be compared. A
+file named synthetic:WxH is made in memory rather than read, a noisy
+gradient over a 256 color map, and synthetic:WxHi is interlaced.
+
+depth is 8 (the default) or 24, and imaging is 232, 4 or 1 as for
+InitImaging(). To compare with an earlier decoder, build against the
+gif.c of that revision:
+
+    git show <rev>:gif.c > gif_old.c
+    make gifbench GIFSRC=gif_old.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include "www.h"
+
+/* globals otherwise supplied by www for gif.c */
+
+Display *display;
+int screen;
+int depth;
+Colormap colormap;
+int imaging;
+unsigned long windowColor = 7;
+unsigned long greymap[16];
+
+extern unsigned long stdcmap[128];
+
+char *NewImageData(long size)
+{
+    return (char *)malloc(size);
+}
+
+void FreeImageData(char *data)
+{
+    free(data);
+}
+
+/* LZW encoder for synthetic images */
+
+#define MAXCODE 4096
+#define ENCHASH 5003
+
+static unsigned char *out;
+static long outlen, bits;
+static int nbits;
+
+static void PutCode(int code, int size)
+{
+    bits |= (long)code << nbits;
+    nbits += size;
+
+    while (nbits >= 8)
+    {
+        out[outlen++] = bits & 0xFF;
+        bits >>= 8;
+        nbits -= 8;
+    }
+}
+
+static long Compress(unsigned char *data, long n, unsigned char *buf)
+{
+    static int hashkey[ENCHASH], hashcode[ENCHASH];
+    int i, k, w, key, size, next;
+    long j;
+
+    out = buf;
+    outlen = bits = nbits = 0;
+    size = 9;
+    next = 258;
+    memset(hashkey, -1, sizeof(hashkey));
+    PutCode(256, size);
+    w = data[0];
+
+    for (j = 1; j < n; ++j)
+    {
+        k = data[j];
+        key = (w << 8) | k;
+
+        for (i = key % ENCHASH; hashkey[i] != -1; i = (i + 1) % ENCHASH)
+        {
+            if (hashkey[i] == key)
+                break;
+        }
+
+        if (hashkey[i] == key)
+        {
+            w = hashcode[i];
+            continue;
+        }
+
+        PutCode(w, size);
+
+        if (next < MAXCODE)
+        {
+            hashkey[i] = key;
+            hashcode[i] = next++;
+
+            if (next > (1 << size) && size < 12)
+                ++size;
+        }
+        else
+        {
+            PutCode(256, size);
+            size = 9;
+            next = 258;
+            memset(hashkey, -1, sizeof(hashkey));
+        }
+
+        w = k;
+    }
+
+    PutCode(w, size);
+    PutCode(257, size);
+
+    if (nbits > 0)
+        out[outlen++] = bits & 0xFF;
+
+    return outlen;
+}
+
+/* make GIF in buf from "WxH" or "WxHi", returns its length or 0 */
+
+static long Synthesize(char *spec, unsigned char *buf)
+{
+    int w, h, x, y, r, g, interlace, pass, step;
+    long n, len, i;
+    unsigned char *p, *data, *lzw;
+    char c;
+
+    interlace = 0;
+
+    if (sscanf(spec, "%dx%d%c", &w, &h, &c) == 3 && c == 'i')
+        interlace = 1;
+    else if (sscanf(spec, "%dx%d", &w, &h) != 2)
+        return 0;
+
+    data = (unsigned char *)malloc((long)w * h);
+    lzw = (unsigned char *)malloc((long)w * h * 2 + 16);
+    srand(w + h);
+
+    /* rows in the order they are stored */
+
+    for (p = data, pass = 0, step = (interlace ? 8 : 1), y = 0; pass < 4;)
+    {
+        for (; y < h; y += step)
+        {
+            for (x = 0; x < w; ++x)
+                *p++ = ((x * 255) / w + rand() % 7 + ((y * 7) / h) * 32) & 0xFF;
+        }
+
+        if (!interlace)
+            break;
+
+        y = (pass == 0 ? 4 : step / 4);
+
+        if (pass++ > 0)
+            step /= 2;
+    }
+
+    n = Compress(data, (long)w * h, lzw);
+
+    p = buf;
+    memcpy(p, "GIF89a", 6); p += 6;
+    *p++ = w & 0xFF; *p++ = w >> 8;
+    *p++ = h & 0xFF; *p++ = h >> 8;
+    *p++ = 0xF7; *p++ = 0; *p++ = 0;
+
+    for (r = 0; r < 16; ++r)
+    {
+        for (g = 0; g < 16; ++g)
+        {
+            *p++ = r * 36;
+            *p++ = g * 40;
+            *p++ = r * g;
+        }
+    }
+
+    *p++ = ',';
+    memset(p, 0, 4); p += 4;
+    *p++ = w & 0xFF; *p++ = w >> 8;
+    *p++ = h & 0xFF; *p++ = h >> 8;
+    *p++ = (interlace ? 0x40 : 0);
+    *p++ = 8;
+
+    for (i = 0; i < n; i += len)
+    {
+        len = (n - i < 255 ? n - i : 255);
+        *p++ = len;
+        memcpy(p, lzw + i, len);
+        p += len;
+    }
+
+    *p++ = 0;
+    *p++ = ';';
+
+    free(data);
+    free(lzw);
+    return p - buf;
+}
+
+int main(int argc, char **argv)
+{
+    int i, k, reps, list;
+    long size, n, j, pixels;
+    unsigned long hash;
+    clock_t t, t0;
+    unsigned char *data, *buf;
+    FILE *fp;
+    Block block;
+    Image image;
+
+    reps = 10;
+    depth = 8;
+    imaging = COLOR232;
+    list = 0;
+
+    for (k = 1; k < argc && argv[k][0] == '-'; ++k)
+    {
+        if (strcmp(argv[k], "-v") == 0)
+            list = 1;
+        else if (k + 1 < argc && strcmp(argv[k], "-r") == 0)
+            reps = atoi(argv[++k]);
+        else if (k + 1 < argc && strcmp(argv[k], "-d") == 0)
+            depth = atoi(argv[++k]);
+        else if (k + 1 < argc && strcmp(argv[k], "-i") == 0)
+            imaging = atoi(argv[++k]);
+        else
+            break;
+    }
+
+    if (k == argc)
+    {
+        fprintf(stderr, "usage: gifbench [-r reps] [-d depth] [-i imaging] [-v] files...\n");
+        return 1;
+    }
+
+    for (i = 0; i < 128; ++i)
+        stdcmap[i] = i;
+
+    for (i = 0; i < 16; ++i)
+        greymap[i] = 128 + i;
+
+    if (list)
+        reps = 1;
+
+    buf = (unsigned char *)malloc(1 << 24);
+    pixels = 0;
+    t = 0;
+
+    for (; k < argc; ++k)
+    {
+        if (strncmp(argv[k], "synthetic:", 10) == 0)
+            size = Synthesize(argv[k] + 10, buf);
+        else if ((fp = fopen(argv[k], "r")) != NULL)
+        {
+            size = fread(buf, 1, 1 << 24, fp);
+            fclose(fp);
+        }
+        else
+            size = 0;
+
+        if (size == 0)
+        {
+            fprintf(stderr, "gifbench: can't load %s\n", argv[k]);
+            continue;
+        }
+
+        for (i = 0; i < reps; ++i)
+        {
+            block.buffer = (char *)buf;
+            block.next = 0;
+            block.size = size;
+            memset(&image, 0, sizeof(image));
+
+            t0 = clock();
+            data = LoadGifImage(&image, &block, depth);
+            t += clock() - t0;
+
+            if (data == NULL)
+                break;
+
+            pixels += (long)image.width * image.height;
+
+            if (list)
+            {
+                n = (long)image.width * image.height * (depth == 24 ? sizeof(long) : 1);
+
+                for (hash = 5381, j = 0; j < n; ++j)
+                    hash = hash * 33 + data[j];
+
+                printf("%s %lx\n", argv[k], hash);
+            }
+
+            free(data);
+        }
+    }
+
+    if (!list && t > 0)
+        printf("%ld pixels in %.3f s, %.1f Mpixels/s\n", pixels,
+            (double)t / CLOCKS_PER_SEC, pixels / 1e6 / ((double)t / CLOCKS_PER_SEC));
+
+    return 0;
+}
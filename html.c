@@ -6,6 +6,7 @@ and dealing with hypertext jumps by recognising which buttons are clicked.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
@@ -18,6 +19,7 @@ extern int screen;
 extern Window win;
 extern GC disp_gc, gc_fill;
 extern Cursor hourglass;
+extern int Streaming;
 extern int UsePaper;
 
 extern int debug;  /* controls display of errors */
@@ -49,6 +51,7 @@ extern char *buffer;            /* the start of the document buffer */
 extern long PixelOffset;        /* the pixel offset to top of window */
 extern int hdrlen;              /* MIME header length at start of buffer */
 extern long buf_height;
+extern char *LayoutEnd;        /* where lazy layout stopped */
 extern long lineHeight;
 extern long chDescent;
 extern int buf_width;
@@ -73,6 +76,7 @@ extern Field *focus;
 extern int font;  /* index into Fonts[] array */
 int preformatted;
 XRectangle displayRect; /* clipping limits for painting html */
+long PaintRequests;     /* X requests issued by PaintFrame() */
 
 long IdOffset;      /* offset for targetId */
 char *targetptr;    /* for toggling view between HTML/TEXT views */
@@ -168,6 +172,18 @@ char *CopyLine(char *str, int len)
 }
 
 
+/* get document for display, showing it as it arrives */
+
+static char *StreamDocument(char *name, char *who, int where)
+{
+    char *q;
+
+    Streaming = 1;
+    q = GetDocument(name, who, where);
+    Streaming = 0;
+    return q;
+}
+
 void OpenDoc(char *name, char *who, int where)
 {
     char *p, *q;
@@ -211,7 +227,9 @@ void OpenDoc(char *name, char *who, int where)
 
             PixelOffset = 0;
             targetId = name+1;
+            LayoutEnd = NULL;
             buf_height = ParseHTML(&buf_width);
+            EndCacheBatch();  /* as the layout is complete */
 
             if (IdOffset > 0)
             {
@@ -235,10 +253,11 @@ void OpenDoc(char *name, char *who, int where)
             if (!IsIndex)
                 Announce(CurrentDoc.url);
         }
-        else if ((q = GetDocument(name, who, where)) && *q)
+        else if ((q = StreamDocument(name, who, where)) && *q)
         {
             if (NewDoc.type == TEXTDOCUMENT || NewDoc.type == HTMLDOCUMENT)
             {
+                EndPartialBuffer(1);
                 CurrentDoc.offset = PixelOffset;
                 PushDoc(CurrentDoc.offset);
 
@@ -252,8 +271,9 @@ void OpenDoc(char *name, char *who, int where)
             }
             else
             {
+                EndPartialBuffer(0);
                 DisplayExtDocument(q+NewDoc.hdrlen, NewDoc.length-NewDoc.hdrlen, NewDoc.type, NewDoc.path);
-                free(q);
+                FreeDocBuffer(&NewDoc);
             }
 
             RestoreStatusString();
@@ -262,7 +282,10 @@ void OpenDoc(char *name, char *who, int where)
             DisplayDoc(WinLeft, WinTop, WinWidth, WinHeight);
         }
         else
+        {
+            EndPartialBuffer(0);
             SetStatusString(NULL);  /* to refresh status display */
+        }
     }
 
     XUndefineCursor(display, win);
@@ -290,6 +313,10 @@ void ReloadDoc(char *name, char *who)
 
         OpenURL = SaveFile = FindStr = 0;
 
+        /* make sure we get a fresh copy */
+
+        ForgetDoc(name);
+
         /* kludge to cope with href="#id" */
 
         if (*name == '#' && document == HTMLDOCUMENT)
@@ -311,7 +338,9 @@ void ReloadDoc(char *name, char *who)
 
             PixelOffset = 0;
             targetId = name+1;
+            LayoutEnd = NULL;
             buf_height = ParseHTML(&buf_width);
+            EndCacheBatch();  /* as the layout is complete */
 
             if (IdOffset > 0)
             {
@@ -335,10 +364,11 @@ void ReloadDoc(char *name, char *who)
             if (!IsIndex)
                 Announce(CurrentDoc.url);
         }
-        else if ((q = GetDocument(name, who, REMOTE)) && *q)
+        else if ((q = StreamDocument(name, who, REMOTE)) && *q)
         {
             if (NewDoc.type == TEXTDOCUMENT || NewDoc.type == HTMLDOCUMENT)
             {
+                EndPartialBuffer(1);
                 CurrentDoc.offset = PixelOffset;
                 SetBanner(CurrentDoc.url);
 
@@ -350,8 +380,9 @@ void ReloadDoc(char *name, char *who)
             }
             else
             {
+                EndPartialBuffer(0);
                 DisplayExtDocument(q+NewDoc.hdrlen, NewDoc.length-NewDoc.hdrlen, NewDoc.type, NewDoc.path);
-                free(q);
+                FreeDocBuffer(&NewDoc);
             }
 
             RestoreStatusString();
@@ -360,7 +391,10 @@ void ReloadDoc(char *name, char *who)
             DisplayDoc(WinLeft, WinTop, WinWidth, WinHeight);
         }
         else
+        {
+            EndPartialBuffer(0);
             SetStatusString(NULL);  /* to refresh status display */
+        }
     }
 
     XUndefineCursor(display, win);
@@ -396,21 +430,226 @@ char *TitleText(char *buf)
 Frame *FrameForward(Frame *frame, long top);
 Frame *FrameBackward(Frame *frame, long top);
 
+/*
+    To avoid searching from the current position all the way to
+    a distant one, e.g. when dragging the slider, the objects in
+    the background frame are indexed by IndexPaint() after each
+    layout. Every CHECKSTEP objects a checkpoint is noted with the
+    greatest pixel offset reached by any object before it. Seeking
+    to h starts from the last checkpoint that nothing before it
+    reaches beyond h, as then the search from there finds the same
+    position and frames as one from the start of the document.
+*/
+
+#define CHECKSTEP   32
+
+static long *CheckEnd;    /* pixel offset reached before checkpoint */
+static long *CheckPos;    /* checkpoint's position in paint buffer */
+static int nChecks, CheckMax;
+
+/* skip element of text line whose tag has just been read */
+
+static Byte *SkipElement(int tag, Byte *p)
+{
+    int len;
+
+    switch (tag & 0xF)
+    {
+        case RULE:
+            p += RULEFLEN - 1;
+            break;
+
+        case BULLET:
+            p += BULLETFLEN - 1;
+            break;
+
+        case STRING:
+            p += STRINGFLEN - 1;
+            break;
+
+        case SEQTEXT:
+            ++p; ++p;  /* skip over x position */
+            len = *p++;
+            p += len;
+            break;
+
+        case IMAGE:
+            p += IMAGEFLEN - 1;
+            break;
+
+        case INPUT:
+            p += INPUTFLEN - 1;
+            break;
+
+        default:
+            fprintf(stderr, "Unexpected tag: %d\n", tag);
+            exit(1);
+    }
+
+    return p;
+}
+
+/* skip elements of text line at p, just past its header */
+
+static Byte *SkipTextLine(Byte *p)
+{
+    int tag;
+
+    while ((tag = *p++) != '\0')
+        p = SkipElement(tag, p);
+
+    return p + SIZELEN;  /* skip over textline size param */
+}
+
+/* called by ParseHTML() once the background frame is set up,
+   the checkpoints before from are kept as the paint stream is
+   unchanged up to there, see ResumeHTML() */
+
+void IndexPaint(long from)
+{
+    long offset, height, reached;
+    unsigned int c1, c2, length;
+    int tag, n;
+    Byte *p, *p2, *obj;
+
+    while (nChecks > 0 && CheckPos[nChecks - 1] >= from)
+        --nChecks;
+
+    /* carry on from the last checkpoint kept */
+
+    if (nChecks > 0)
+    {
+        --nChecks;
+        reached = CheckEnd[nChecks];
+        p = paint + CheckPos[nChecks];
+    }
+    else
+    {
+        reached = 0;
+        p = paint + FRAMESTLEN;
+    }
+
+    n = 0;
+    p2 = paint + FRAMESTLEN + background.length;
+
+    while (p < p2)
+    {
+        obj = p;
+        tag = *p++;
+
+        if (tag == END_FRAME)
+        {
+            p += FRAMENDLEN - 1;
+            continue;
+        }
+
+        if (n-- == 0)
+        {
+            if (nChecks == CheckMax)
+            {
+                CheckMax = (CheckMax ? 2 * CheckMax : 256);
+                CheckEnd = (long *)realloc(CheckEnd, CheckMax * sizeof(long));
+                CheckPos = (long *)realloc(CheckPos, CheckMax * sizeof(long));
+
+                if (!CheckEnd || !CheckPos)
+                {
+                    fprintf(stderr, "Panic: can't allocate paint index\n");
+                    exit(1);
+                }
+            }
+
+            CheckEnd[nChecks] = reached;
+            CheckPos[nChecks] = obj - paint;
+            ++nChecks;
+            n = CHECKSTEP - 1;
+        }
+
+        c1 = *p++; c2 = *p++; offset = c1 | c2<<8;
+        c1 = *p++; c2 = *p++; offset |= (c1 | c2<<8) << 16;
+
+        if (tag == BEGIN_FRAME)
+        {
+            p += 4;  /* skip over indent, width */
+            c1 = *p++; c2 = *p++; height = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
+            p += 2;  /* skip over style, border */
+            c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
+            p += length + SIZELEN;
+        }
+        else if (tag == TEXTLINE)
+        {
+            p += 4; /* skip over baseline, indent */
+            c1 = *p++; c2 = *p++; height = c1 | c2<<8;
+            p = SkipTextLine(p);
+        }
+        else
+        {
+            fprintf(stderr, "Unexpected tag: %d\n", tag);
+            exit(1);
+        }
+
+        if (offset + height > reached)
+            reached = offset + height;
+    }
+}
+
+/* find paint position from which to seek forwards to h */
+
+static Byte *SeekPaint(long h)
+{
+    int lo, hi, mid;
+
+    if (nChecks == 0)
+        return paint + FRAMESTLEN;
+
+    lo = 0;
+    hi = nChecks - 1;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1)/2;
+
+        if (CheckEnd[mid] <= h)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return paint + CheckPos[lo];
+}
+
 long DeltaHTMLPosition(long h)
 {
-    long offset, TopOffset, delta;
-    Byte *p, *q;
-    int tag, c1, c2, k;
-    Frame *frame;
+    long delta;
+    Byte *p;
 
     if (h > PixelOffset)  /* search forwards */
+    {
+        p = SeekPaint(h);
+
+        if (p > background.top)
+        {
+            FreeFrames(background.child);
+            background.child = NULL;
+            background.top = p;
+        }
+
         FrameForward(&background, h);
+    }
     else if (h == 0) /* shortcut to start */
     {
         FreeFrames(background.child);
         background.child = NULL;
         background.top = paint + FRAMESTLEN;
     }
+    else if (PixelOffset - h > WinHeight) /* distant so seek forwards */
+    {
+        FreeFrames(background.child);
+        background.child = NULL;
+        background.top = SeekPaint(h);
+        FrameForward(&background, h);
+    }
     else  /* search backwards */
         FrameBackward(&background, h);
 
@@ -427,15 +666,12 @@ long DeltaHTMLPosition(long h)
   from the peer list if it (and therefore they) finish before top.
   This is implemented by returning the frame if it is needed otherwise
   returning NULL
-
-  Question: what happens when top is the bottom of the buffer?
-            can this ever occur in practice, e.g. with a null file?
 */
 
 Frame *FrameForward(Frame *frame, long top)
 {
     long offset, height;
-    unsigned int c1, c2, width, length, len;
+    unsigned int c1, c2, width, length;
     int tag, indent, style, border;
     unsigned char *p, *p2, *obj;
     Frame *peer, *child, *last;
@@ -511,6 +747,7 @@ Frame *FrameForward(Frame *frame, long top)
             c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
             style = *p++; border = *p++;
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
             if (offset + height > top)
             {
@@ -539,7 +776,7 @@ Frame *FrameForward(Frame *frame, long top)
                 last = child;
             }
 
-            p += length+2; /* to skip over frame's contents */
+            p += length + SIZELEN; /* to skip over frame's contents */
             continue;
         }
 
@@ -547,7 +784,7 @@ Frame *FrameForward(Frame *frame, long top)
 
         if (tag == END_FRAME)
         {
-            p += 4;
+            p += FRAMENDLEN - 1;
             continue;
         }
 
@@ -581,44 +818,14 @@ Frame *FrameForward(Frame *frame, long top)
 
         /* skip elements in text line to reach next object */
 
-        while ((tag = *p++) != '\0')
-        {
-            switch (tag & 0xF)
-            {
-                case RULE:
-                    p += RULEFLEN - 1;
-                    break;
-
-                case BULLET:
-                    p += BULLETFLEN - 1;
-                    break;
-
-                case STRING:
-                    p += STRINGFLEN - 1;
-                    break;
+        p = SkipTextLine(p);
+    }
 
-                case SEQTEXT:
-                    ++p; ++p;  /* skip over x position */
-                    len = *p++;
-                    p += len;
-                    break;
+ /* if all of the frame lies above top, bar any children
+    intersecting it, then there is nothing left to paint */
 
-                case IMAGE:
-                    p += IMAGEFLEN - 1;
-                    break;
-
-                case INPUT:
-                    p += INPUTFLEN - 1;
-                    break;
-
-                default:
-                    fprintf(stderr, "Unexpected tag: %d\n", tag);
-                    exit(1);
-            }
-        }
-
-        ++p; ++p;  /* skip over textline size param */
-    }
+    if (p >= p2)
+        frame->top = p2;
 
     return frame;
 }
@@ -637,7 +844,7 @@ Frame *FrameBackward(Frame *frame, long top)
     long offset, height;
     unsigned int c1, c2, width, length, len;
     int tag, indent, style, border, k;
-    unsigned char *p, *p2, *obj;
+    unsigned char *p, *p2, *obj, *begin;
     Frame *peer, *child;
 
     if (!frame)
@@ -677,7 +884,8 @@ Frame *FrameBackward(Frame *frame, long top)
     while (p > p2)
     {
         /* pop field size into k */
-        c2 = *--p; c1 = *--p; k = c1 | c2<<8;
+        c2 = *--p; c1 = *--p; k = (c1 | c2<<8) << 16;
+        c2 = *--p; c1 = *--p; k |= c1 | c2<<8;
 
         p -= k;   /* p points to start of previous object */
 
@@ -697,7 +905,8 @@ Frame *FrameBackward(Frame *frame, long top)
         if (tag == END_FRAME)
         {
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
-            p = obj - length;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
+            p = begin = obj - length;
 
          /* p now points to BEGIN_FRAME tag */
 
@@ -724,7 +933,7 @@ Frame *FrameBackward(Frame *frame, long top)
             c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
             style = *p++; border = *p++;
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
-            ++p; ++p; /* skip size param */
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
             if (offset + height > top)
             {
@@ -735,8 +944,8 @@ Frame *FrameBackward(Frame *frame, long top)
                 child->indent = indent;
                 child->width = width;
                 child->height = height;
-                child->info = obj - paint;
-                child->top = p + length;
+                child->info = begin - paint;
+                child->top = p + length;  /* end of frame's contents */
                 child->length = length;
                 child->style = style;
                 child->border = border;
@@ -744,7 +953,7 @@ Frame *FrameBackward(Frame *frame, long top)
 
              /* and insert new child in front of current children */
 
-                child->child = frame->child;
+                child->next = frame->child;
                 frame->child = child;
             }
 
@@ -842,6 +1051,7 @@ Byte *WhichFrameObject(int event, int x, int y, Byte *p1, Byte *p2,
             c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
             style = *p++; border = *p++;
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
          /* call self to find target object in this frame */
 
@@ -851,13 +1061,13 @@ Byte *WhichFrameObject(int event, int x, int y, Byte *p1, Byte *p2,
             if (q)
                 return q;
 
-            p += length+2; /* to skip over frame's contents */
+            p += length + SIZELEN; /* to skip over frame's contents */
             continue;
         }
 
         if (tag == END_FRAME)
         {
-            p += 4;
+            p += FRAMENDLEN - 1;
             continue;
         }
 
@@ -982,7 +1192,7 @@ Byte *WhichFrameObject(int event, int x, int y, Byte *p1, Byte *p2,
             }
         }
 
-        ++p; ++p;  /* skip final frame length field */
+        p += SIZELEN;  /* skip final frame length field */
     }
 
     return NULL;
@@ -1072,17 +1282,18 @@ void DrawFrameAnchor(int up, Byte *start, Byte *end)
             c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
             style = *p++; border = *p++;
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
          /* call self to draw anchors in this frame */
 
             DrawFrameAnchor(up, p, p + length);
-            p += length+2; /* to skip over frame's contents */
+            p += length + SIZELEN; /* to skip over frame's contents */
             continue;
         }
 
         if (tag == END_FRAME)
         {
-            p += 4;
+            p += FRAMENDLEN - 1;
             continue;
         }
 
@@ -1198,7 +1409,7 @@ void DrawFrameAnchor(int up, Byte *start, Byte *end)
             }
         }
 
-        ++p; ++p;  /* skip final frame length field */
+        p += SIZELEN;  /* skip final frame length field */
     }
 
     XFlush(display);
@@ -1243,17 +1454,18 @@ char *TopStrSelf(Byte *start, Byte *end)
             c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
             style = *p++; border = *p++;
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
             if ((s = TopStrSelf(p, p + length)))
                 return s;
 
-            p += length+2; /* to skip over frame's contents */
+            p += length + SIZELEN; /* to skip over frame's contents */
             continue;
         }
 
         if (tag == END_FRAME)
         {
-            p += 4;
+            p += FRAMENDLEN - 1;
             continue;
         }
 
@@ -1316,7 +1528,7 @@ char *TopStrSelf(Byte *start, Byte *end)
             }
         }
 
-        ++p; ++p;  /* skip final frame length field */
+        p += SIZELEN;  /* skip final frame length field */
     }
 
     return NULL;
@@ -1362,14 +1574,12 @@ void FreeFrames(Frame *frame)
 {
     Frame *peer;
 
-    if (frame)
+    while (frame)
     {
         FreeFrames(frame->child);
-
-        for (peer = frame->next; peer; peer = peer->next)
-             FreeFrames(peer);
-
+        peer = frame->next;
         free(frame);
+        frame = peer;
     }
 }
 
@@ -1422,12 +1632,163 @@ void DisplayHTML(int x, int y, unsigned int w, unsigned int h)
 
  /* and paint all frames intersecting top of window */
 
+    PaintRequests = NextRequest(display);
     PaintSelf(&background, y, h);
+    PaintRequests = NextRequest(display) - PaintRequests;
+
+    if (debug)
+        fprintf(stderr, "painted %d x %d in %ld X requests\n", w, h, PaintRequests);
 
     if (focus && focus->type == OPTIONLIST && focus->flags & CHECKED)
         PaintDropDown(disp_gc, focus);
 }
 
+/* add window area of rows top to bottom of pixmap where shown
+   by paint objects from p to p_end into the rectangle r */
+
+static void ImageArea(Byte *p, Byte *p_end, Pixmap pixmap, int top, int bottom, XRectangle *r)
+{
+    unsigned int tag, c1, c2, width, height;
+    int x1, y1, y2, yb, xi, x, y;
+    long offset, depth, length, str;
+
+    while (p < p_end)
+    {
+        tag = *p++;
+
+        if (tag == END_FRAME)
+        {
+            p += FRAMENDLEN - 1;
+            continue;
+        }
+
+        c1 = *p++; c2 = *p++; offset = c1 | c2<<8;
+        c1 = *p++; c2 = *p++; offset |= (c1 | c2<<8) << 16;
+
+        /* we are done if object starts after bottom of window */
+
+        y1 = WinTop + (offset - PixelOffset);
+
+        if (y1 >= WinBottom)
+            break;
+
+        if (tag == BEGIN_FRAME)
+        {
+            p += 4;  /* skip over indent, width */
+            c1 = *p++; c2 = *p++; depth = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; depth |= (c1 | c2<<8) << 16;
+            p += 2;  /* skip over style, border */
+            c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
+
+            /* frames ending above the window can be skipped */
+
+            if (y1 + depth > WinTop)
+                ImageArea(p, p + length, pixmap, top, bottom, r);
+
+            p += length + SIZELEN;
+            continue;
+        }
+
+        c1 = *p++; c2 = *p++; yb = y1 + (c1 | c2<<8);
+        c1 = *p++; c2 = *p++; xi = (c1 | c2<<8);
+        p += 2;  /* skip over height */
+
+        while ((tag = *p++) != '\0')
+        {
+            if ((tag & 0xF) != IMAGE)
+            {
+                p = SkipElement(tag, p);
+                continue;
+            }
+
+            c1 = *p++; c2 = *p++; y2 = yb - (c1 | c2<<8);
+            c1 = *p++; c2 = *p++; x1 = xi + (c1 | c2<<8) - PixelIndent;
+            c1 = *p++; c2 = *p++; width = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; height = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; str = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; str |= (c1 | c2<<8) << 16;
+            p += 4;  /* skip past buffer pointer */
+
+            if ((Pixmap)str != pixmap)
+                continue;
+
+            if (tag & ISMAP)
+            {
+                width -= 8;
+                x1 += 4;
+                y2 += 4;
+            }
+
+            y = y2 + top;
+            height = bottom - top;
+
+            if (r->width == 0)
+            {
+                r->x = x1;
+                r->y = y;
+                r->width = width;
+                r->height = height;
+                continue;
+            }
+
+            /* union with the area found so far */
+
+            x = (x1 < r->x ? x1 : r->x);
+            width = (x1 + (int)width > r->x + r->width ?
+                        x1 + width : r->x + r->width) - x;
+            y2 = (y < r->y ? y : r->y);
+            height = (y + (int)height > r->y + r->height ?
+                        y + height : r->y + r->height) - y2;
+            r->x = x;
+            r->y = y2;
+            r->width = width;
+            r->height = height;
+        }
+
+        p += SIZELEN;
+    }
+}
+
+/* repaint the part of the window showing rows top to bottom of
+   pixmap, which has just been filled in by CollectImages() */
+
+void RepaintImage(Pixmap pixmap, int top, int bottom)
+{
+    XRectangle r;
+    int x2, y2;
+
+    if (document != HTMLDOCUMENT || !paint || top >= bottom)
+        return;
+
+    r.width = 0;
+    ImageArea(SeekPaint(PixelOffset), paint + FRAMESTLEN + background.length,
+                pixmap, top, bottom, &r);
+
+    if (r.width == 0)
+        return;
+
+    /* clip to the window */
+
+    x2 = r.x + r.width;
+    y2 = r.y + r.height;
+
+    if (r.x < WinLeft)
+        r.x = WinLeft;
+
+    if (r.y < WinTop)
+        r.y = WinTop;
+
+    if (x2 > WinRight)
+        x2 = WinRight;
+
+    if (y2 > (int)WinBottom)
+        y2 = WinBottom;
+
+    if (x2 > r.x && y2 > r.y)
+        DisplayDoc(r.x, r.y, x2 - r.x, y2 - r.y);
+}
+
 /* paint children then self - first called for background frame */
 void PaintSelf(Frame *frame, int y, unsigned int h)
 {
@@ -1466,6 +1827,147 @@ void PaintPeers(Frame *frame, int y, unsigned int h)
     }
 }
 
+/*
+    Drawing each string and rectangle on a line with a request of
+    its own, and switching the GC's font and colour back and forth
+    between them, makes for a great deal of X traffic. Instead the
+    strings on a line sharing a font and colour are collected into
+    a single XDrawText(), and its rectangles into one XFillRectangles()
+    per colour, which are sent when the line is done. PaintRequests
+    counts the X requests issued, including those for images and
+    fields, from Xlib's request numbers, and is reported when
+    debugging.
+*/
+
+#define MAXITEMS    64      /* strings per XDrawText() */
+#define ITEMCHARS   2048    /* room for their chars */
+#define MAXRECTS    64      /* rectangles per colour */
+
+#define R_TEXT      0       /* index into rects[] by colour */
+#define R_STRIKE    1
+#define R_TOP       2
+#define R_BOTTOM    3
+#define R_COLORS    4
+
+static XTextItem items[MAXITEMS];
+static char itemChars[ITEMCHARS];
+static int nItems, nChars, itemFont, itemX, itemY, itemEnd;
+static unsigned long itemColor;
+static XRectangle rects[R_COLORS][MAXRECTS];
+static int nRects[R_COLORS];
+
+static void FlushText(void)
+{
+    if (nItems == 0)
+        return;
+
+    if (font != itemFont)
+    {
+        font = itemFont;
+        SetFont(disp_gc, font);
+    }
+
+    if (itemColor != textColor)
+        XSetForeground(display, disp_gc, itemColor);
+
+    XDrawText(display, win, disp_gc, itemX, itemY, items, nItems);
+
+    if (itemColor != textColor)
+        XSetForeground(display, disp_gc, textColor);
+
+    nItems = nChars = 0;
+}
+
+/* add len chars at s to be drawn at x, y */
+
+static void AddText(int fnt, unsigned long color, int x, int y, char *s, int len)
+{
+    if (nItems > 0 && (fnt != itemFont || color != itemColor || y != itemY))
+        FlushText();
+
+    if (nItems == MAXITEMS || nChars + len > ITEMCHARS)
+        FlushText();
+
+    if (nItems == 0)
+    {
+        itemFont = fnt;
+        itemColor = color;
+        itemX = itemEnd = x;
+        itemY = y;
+    }
+
+    memcpy(itemChars + nChars, s, len);
+    items[nItems].chars = itemChars + nChars;
+    items[nItems].nchars = len;
+    items[nItems].delta = x - itemEnd;
+    items[nItems].font = None;
+    ++nItems;
+    nChars += len;
+    itemEnd = x + WIDTH(fnt, s, len);
+}
+
+static void FlushRects(void)
+{
+    int i, changed;
+    unsigned long color;
+
+    changed = 0;
+
+    for (i = 0; i < R_COLORS; ++i)
+    {
+        if (nRects[i] == 0)
+            continue;
+
+        if (i != R_TEXT)
+        {
+            color = (i == R_STRIKE ? strikeColor :
+                        i == R_TOP ? windowTopShadow : windowBottomShadow);
+            XSetForeground(display, disp_gc, color);
+            changed = 1;
+        }
+
+        XFillRectangles(display, win, disp_gc, rects[i], nRects[i]);
+        nRects[i] = 0;
+    }
+
+    if (changed)
+        XSetForeground(display, disp_gc, textColor);
+}
+
+static void AddRect(int i, int x, int y, unsigned int w, unsigned int h)
+{
+    XRectangle *r;
+
+    if (nRects[i] == MAXRECTS)
+        FlushRects();
+
+    r = &rects[i][nRects[i]++];
+    r->x = x;
+    r->y = y;
+    r->width = w;
+    r->height = h;
+}
+
+/* as DrawHButtonUp() */
+
+static void AddHButtonUp(int x, int y, int w, int h)
+{
+    --x; ++y; ++w;  /* adjust drawing position */
+
+    AddRect(R_TOP, x, y, w, 1);
+    AddRect(R_TOP, x, y, 1, h-1);
+    AddRect(R_BOTTOM, x+1, y+h-1, w-1, 1);
+    AddRect(R_BOTTOM, x+w-1, y+1, 1, h-2);
+}
+
+/* send whatever is waiting to be drawn */
+
+static void FlushLine(void)
+{
+    FlushText();
+    FlushRects();
+}
+
 /*
     p, p_end point to paint buffer while x,y,w,h define region to paint
 
@@ -1512,6 +2014,7 @@ void PaintFrame(unsigned char *p, unsigned char *p_end, int y, unsigned int h)
             c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
             style = *p++; border = *p++;
             c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+            c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
             if (border)
                 DrawBorder(border, x1-PixelIndent, y1, width, height);
@@ -1519,14 +2022,14 @@ void PaintFrame(unsigned char *p, unsigned char *p_end, int y, unsigned int h)
          /* call self to paint this frame */
 
             PaintFrame(p, p + length, y, h);
-            p += length+2; /* to skip over frame's contents */
+            p += length + SIZELEN; /* to skip over frame's contents */
             continue;
         }
 
         /* skip end of frame marker */
         if (tag == END_FRAME)
         {
-            p += 4;  /* skip start/size params */
+            p += FRAMENDLEN - 1;  /* skip start/size params */
             continue;
         }
 
@@ -1557,28 +2060,18 @@ void PaintFrame(unsigned char *p, unsigned char *p_end, int y, unsigned int h)
                 case RULE:
                     c1 = *p++; c2 = *p++; x1 = xi + (c1 | c2<<8);
                     c1 = *p++; c2 = *p++; x2 = c1 | c2<<8;
-                    XSetForeground(display, disp_gc, windowBottomShadow);
-                    XFillRectangle(display, win, disp_gc, x1-PixelIndent, yb, x2-x1, 1);
-                    XSetForeground(display, disp_gc, windowTopShadow);
-                    XFillRectangle(display, win, disp_gc, x1-PixelIndent, yb+1, x2-x1, 1);
-                    XSetForeground(display, disp_gc, textColor);
+                    AddRect(R_BOTTOM, x1-PixelIndent, yb, x2-x1, 1);
+                    AddRect(R_TOP, x1-PixelIndent, yb+1, x2-x1, 1);
                     break;
 
                 case BULLET:
                     c1 = *p++; c2 = *p++; x1 = xi + (c1 | c2<<8);
                     c1 = *p++; c2 = *p++; depth = (c1 | c2<<8);
-                    fnt = (tag & 0xF0) >> 4;
-
-                    if (font != fnt)
-                    {
-                        font = fnt;
-                        SetFont(disp_gc, font);
-                    }
 
                     if (depth > 0)
-                        XFillRectangle(display, win, disp_gc, x1-PixelIndent, yb-BSIZE, BSIZE, 2);
+                        AddRect(R_TEXT, x1-PixelIndent, yb-BSIZE, BSIZE, 2);
                     else
-                        XFillRectangle(display, win, disp_gc, x1-PixelIndent, yb-BSIZE, BSIZE, BSIZE);
+                        AddRect(R_TEXT, x1-PixelIndent, yb-BSIZE, BSIZE, BSIZE);
                     break;
 
                 case STRING:
@@ -1593,46 +2086,33 @@ void PaintFrame(unsigned char *p, unsigned char *p_end, int y, unsigned int h)
                     s = CopyLine((char *)str, len);
                     fnt = emph & 0xF;
 
-                    if (font != fnt)
-                    {
-                        font = fnt;
-                        SetFont(disp_gc, font);
-                    }
-
-                    if (emph & EMPH_HIGHLIGHT)
-                    {
-                        XSetForeground(display,disp_gc, labelColor);
-                        XDrawString(display, win, disp_gc, x1-PixelIndent, yb, s, len);
-                        XSetForeground(display,disp_gc, textColor);
-                    }
-                    else
-                        XDrawString(display, win, disp_gc, x1-PixelIndent, yb, s, len);
+                    AddText(fnt, (emph & EMPH_HIGHLIGHT ? labelColor : textColor),
+                            x1-PixelIndent, yb, s, len);
 
                     if (emph & EMPH_ANCHOR)
                     {
-                        y2 = yb - ASCENT(font) - 1;
-                        DrawHButtonUp(x1-PixelIndent, y2, width, LineSpacing[fnt]);
+                        y2 = yb - ASCENT(fnt) - 1;
+                        AddHButtonUp(x1-PixelIndent, y2, width, LineSpacing[fnt]);
                     }
 
                     if (emph & EMPH_UNDERLINE)
                     {
-                        y2 = yb + DESCENT(font);
-                        XFillRectangle(display, win, disp_gc, x1+1-PixelIndent, y2, width-2, 1);
+                        y2 = yb + DESCENT(fnt);
+                        AddRect(R_TEXT, x1+1-PixelIndent, y2, width-2, 1);
                     }
 
                     if (emph & EMPH_STRIKE)
                     {
-                        y2 = yb - ASCENT(font)/3;
-                        XSetForeground(display,disp_gc, strikeColor);
-                        XFillRectangle(display, win, disp_gc, x1-PixelIndent, y2, width, 1);
-                        XSetForeground(display,disp_gc, textColor);
+                        y2 = yb - ASCENT(fnt)/3;
+                        AddRect(R_STRIKE, x1-PixelIndent, y2, width, 1);
                     }
                     break;
 
                 case SEQTEXT:
                     c1 = *p++; c2 = *p++; x1 = xi + (c1 | c2<<8);  /* here */
                     len = *p++;
-                    XDrawString(display, win, disp_gc, x1-PixelIndent, yb, (char *)p, len);
+                    AddText((nItems ? itemFont : font), textColor,
+                            x1-PixelIndent, yb, (char *)p, len);
                     p += len;
                     break;
 
@@ -1651,6 +2131,7 @@ void PaintFrame(unsigned char *p, unsigned char *p_end, int y, unsigned int h)
                     if (y2 + height < y)
                         continue;
 
+                    FlushLine();
                     x1 -= PixelIndent;
 
                     if (tag & ISMAP)
@@ -1671,12 +2152,15 @@ void PaintFrame(unsigned char *p, unsigned char *p_end, int y, unsigned int h)
                 case INPUT:
                     c1 = *p++; c2 = *p++; str = c1 | c2<<8;
                     c1 = *p++; c2 = *p++; str |= (c1 | c2<<8) << 16;
+                    FlushLine();
                     PaintField(disp_gc, yb, (Field *)str);
                     break;
             }
         }
 
-        ++p; ++p;  /* skip size param to start of next object */
+        FlushLine();
+
+        p += SIZELEN;  /* skip size param to start of next object */
     }
 }
 
@@ -1726,13 +2210,20 @@ int WindowButtonDown(int x, int y)
     anchor_start = anchor_end = 0;
     tag = 0;
 
+    /* fields and anchors redraw themselves via backing */
+
+    BeginPaint();
     clicked_element = WhichObject(BUTTONDOWN, x, y, &tag, &anchor_start, &anchor_end, &dx, &dy);
 
     if (tag == TAG_ANCHOR || tag == TAG_IMG)
-    {
         DrawAnchor(&background, 0);
+
+    EndPaint();
+    Damage(WinLeft, WinTop, WinWidth, WinHeight);
+    ShowDamage();
+
+    if (tag == TAG_ANCHOR || tag == TAG_IMG)
         return WINDOW;
-    }
 
     if (tag == TAG_INPUT || TAG_SELECT)
         return WINDOW;
@@ -1747,10 +2238,15 @@ void WindowButtonUp(int shifted, int px, int py)
     char *start, *end, *href, *name, *link, buf[16];
     int tag, hreflen, namelen, align, ismap, dx, dy;
 
+    BeginPaint();
+
     if (anchor_start && anchor_end)
         DrawAnchor(&background, 1);
 
     object = WhichObject(BUTTONUP, px, py, &tag, &start, &end, &dx, &dy);
+    EndPaint();
+    Damage(WinLeft, WinTop, WinWidth, WinHeight);
+    ShowDamage();
 
     if ((tag == TAG_ANCHOR || tag == TAG_IMG) &&
                 start == anchor_start && end == anchor_end)
@@ -0,0 +1,68 @@
+/* htmltags.c - the tag table used by the browser
+
+This is kept apart from parsehtml.c so that tagbench can time
+LookupTag() with the same table the browser uses.
+*/
+
+#include <stdio.h>
+#include <X11/Xlib.h>
+#include "www.h"
+
+struct tag HTMLTags[] =
+{
+    {"a",           TAG_ANCHOR,     EN_TEXT},
+    {"added",       TAG_ADDED,      EN_TEXT},
+    {"address",     TAG_ADDRESS,    EN_BLOCK},
+    {"abstract",    TAG_ABSTRACT,   EN_BLOCK},
+    {"b",           TAG_BOLD,       EN_TEXT},
+    {"br",          TAG_BR,         EN_TEXT},
+    {"body",        TAG_BODY,       EN_MAIN},
+    {"blockquote",  TAG_QUOTE,      EN_BLOCK},
+    {"code",        TAG_CODE,       EN_TEXT},
+    {"cite",        TAG_CITE,       EN_TEXT},
+    {"dfn",         TAG_DFN,        EN_TEXT},
+    {"dl",          TAG_DL,         EN_LIST},
+    {"dt",          TAG_DT,         EL_DEFLIST},
+    {"dd",          TAG_DD,         EL_DEFLIST},
+    {"em",          TAG_EM,         EN_TEXT},
+    {"fig",         TAG_FIG,        EN_TEXT},
+    {"head",        TAG_HEAD,       EN_SETUP},
+    {"h1",          TAG_H1,         EN_HEADER},
+    {"h2",          TAG_H2,         EN_HEADER},
+    {"h3",          TAG_H3,         EN_HEADER},
+    {"h4",          TAG_H4,         EN_HEADER},
+    {"h5",          TAG_H5,         EN_HEADER},
+    {"h6",          TAG_H6,         EN_HEADER},
+    {"hr",          TAG_HR,         EN_BLOCK},
+    {"i",           TAG_ITALIC,     EN_TEXT},
+    {"img",         TAG_IMG,        EN_TEXT},
+    {"input",       TAG_INPUT,      EN_TEXT},
+    {"isindex",     TAG_ISINDEX,    EN_SETUP},
+    {"kbd",         TAG_KBD,        EN_TEXT},
+    {"li",          TAG_LI,         EN_LIST},
+    {"math",        TAG_MATH,       EN_TEXT},
+    {"margin",      TAG_MARGIN,     EN_TEXT},
+    {"ol",          TAG_OL,         EN_LIST},
+    {"option",      TAG_OPTION,     EN_TEXT},  /* kludge for error recovery */
+    {"p",           TAG_P,          EN_BLOCK},
+    {"pre",         TAG_PRE,        EN_BLOCK},
+    {"q",           TAG_Q,          EN_TEXT},
+    {"quote",       TAG_QUOTE,      EN_BLOCK},
+    {"removed",     TAG_REMOVED,    EN_TEXT},
+    {"s",           TAG_STRIKE,     EN_TEXT},
+    {"samp",        TAG_SAMP,       EN_TEXT},
+    {"strong",      TAG_STRONG,     EN_TEXT},
+    {"select",      TAG_SELECT,     EN_TEXT},
+    {"title",       TAG_TITLE,      EN_SETUP},
+    {"tt",          TAG_TT,         EN_TEXT},
+    {"tr",          TAG_TR,         EN_TABLE},
+    {"th",          TAG_TH,         EN_TABLE},
+    {"td",          TAG_TD,         EN_TABLE},
+    {"table",       TAG_TABLE,      EN_BLOCK},
+    {"textarea",    TAG_TEXTAREA,   EN_TEXT},
+    {"u",           TAG_UNDERLINE,  EN_TEXT},
+    {"ul",          TAG_UL,         EN_LIST},
+    {"var",         TAG_VAR,        EN_TEXT},
+    {"xmp",         TAG_PRE,        EN_BLOCK},
+    {NULL,          UNKNOWN,        EN_UNKNOWN}
+};
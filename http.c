@@ -17,10 +17,13 @@
 #include <sys/socket.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 
 extern int debug;
 extern int UseHTTP2;
@@ -28,6 +31,8 @@ extern int AbortFlag;
 extern int Authorize;
 extern char *gateway;
 extern char *user;
+extern int KeepAlive;
+extern int Interrupted;
 
 #define TEXTDOCUMENT    0
 #define HTMLDOCUMENT    1
@@ -599,21 +604,39 @@ char *HTRQrequestString(Doc *doc, int *len, char *who)
         sprintf(buf+n, " HTTP/1.1\r\n%n", &dn);
         n += dn;
 
+        /* needed by HTTP/1.1 servers, the connection is kept
+           open by default and reused for subsequent requests */
+
+        if (doc->port == HTTP_PORT)
+            sprintf(buf+n, "Host: %s\r\n%n", doc->host, &dn);
+        else
+            sprintf(buf+n, "Host: %s:%d\r\n%n", doc->host, doc->port, &dn);
+
+        n += dn;
+
+        /* ask for the document only if changed since our copy */
+
+        if (doc->validate)
+        {
+            sprintf(buf+n, "If-Modified-Since: %s\r\n%n", HTTPDate(doc->validate), &dn);
+            n += dn;
+        }
+
         if (who)
 	{
-           // sprintf(buf+n, "Authorization: user %s\r\n\r\n%n", who, &dn);
+           // sprintf(buf+n, "Authorization: user %s\r\n%n", who, &dn);
             //n += dn;
         }
         else if (user)
 	{
-            //sprintf(buf+n, "Authorization: user %s\r\n\r\n%n", user, &dn);
+            //sprintf(buf+n, "Authorization: user %s\r\n%n", user, &dn);
             //n += dn;
         }
-        else
-	{
-            sprintf(buf+n, "\r\n\r\n%n", &dn);
-            n += dn;
-        }
+
+        /* blank line terminates request header */
+
+        sprintf(buf+n, "\r\n%n", &dn);
+        n += dn;
     }
 
     *len = n;
@@ -703,6 +726,264 @@ int HeaderLength(char *buf, int *type)
     return 0;
 }
 
+static char *months[12] =
+{
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/*
+   Convert HTTP date to seconds since 1970, returns 0 if not understood.
+   Accepts RFC 1123, RFC 850 and asctime formats:
+
+        Sun, 06 Nov 1994 08:49:37 GMT
+        Sunday, 06-Nov-94 08:49:37 GMT
+        Sun Nov  6 08:49:37 1994
+*/
+
+long ParseHTTPDate(char *s)
+{
+    int day, mon, year, hour, min, sec;
+    long days;
+    char *p, name[4];
+
+    while (*s == ' ')
+        ++s;
+
+    for (p = s; *p && *p != ',' && *p != ' '; ++p);
+
+    if (*p == ',')
+    {
+        if (sscanf(p+1, "%d %3s %d %d:%d:%d", &day, name, &year, &hour, &min, &sec) != 6 &&
+            sscanf(p+1, "%d-%3s-%d %d:%d:%d", &day, name, &year, &hour, &min, &sec) != 6)
+            return 0;
+    }
+    else if (sscanf(p, "%3s %d %d:%d:%d %d", name, &day, &hour, &min, &sec, &year) != 6)
+        return 0;
+
+    for (mon = 0; mon < 12; ++mon)
+    {
+        if (strncasecmp(name, months[mon], 3) == 0)
+            break;
+    }
+
+    if (mon == 12)
+        return 0;
+
+    if (year < 70)
+        year += 2000;
+    else if (year < 100)
+        year += 1900;
+
+    /* days since 1970 counting years from March */
+
+    mon += 1;
+
+    if (mon <= 2)
+    {
+        year -= 1;
+        mon += 12;
+    }
+
+    days = 365L*year + year/4 - year/100 + year/400 + (153*(mon - 3) + 2)/5 + day - 719469L;
+
+    return days * 86400L + hour * 3600L + min * 60L + sec;
+}
+
+/* format time as RFC 1123 date for HTTP headers */
+
+char *HTTPDate(long t)
+{
+    static char buf[32];
+    time_t tt;
+
+    tt = t;
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&tt));
+    return buf;
+}
+
+/* note Date, Expires and Last-Modified from doc's HTTP header */
+
+void HeaderDates(Doc *doc)
+{
+    char *p, *end;
+
+    doc->date = doc->expires = doc->lastmod = 0;
+
+    if (doc->buffer == NULL || doc->hdrlen == 0)
+        return;
+
+    end = doc->buffer + doc->hdrlen;
+
+    for (p = doc->buffer; p && p < end; p = strchr(p, '\n'))
+    {
+        ++p;
+
+        if (strncasecmp(p, "date:", 5) == 0)
+            doc->date = ParseHTTPDate(p+5);
+        else if (strncasecmp(p, "expires:", 8) == 0)
+            doc->expires = ParseHTTPDate(p+8);
+        else if (strncasecmp(p, "last-modified:", 14) == 0)
+            doc->lastmod = ParseHTTPDate(p+14);
+    }
+}
+
+/* fall back on cached copy set aside for revalidation */
+
+static char *UseCachedCopy(Doc *cached)
+{
+    if (cached->buffer == NULL)
+        return NULL;
+
+    FreeDocBuffer(&NewDoc);
+    NewDoc.buffer = cached->buffer;
+    NewDoc.mapped = cached->mapped;
+    NewDoc.length = cached->length;
+    NewDoc.hdrlen = cached->hdrlen;
+    NewDoc.type = cached->type;
+    NewDoc.date = cached->date;
+    NewDoc.expires = cached->expires;
+    NewDoc.lastmod = cached->lastmod;
+    NewDoc.validate = 0;
+
+    cached->buffer = NULL;
+    cached->mapped = 0;
+    RememberDoc();
+    return NewDoc.buffer;
+}
+
+/* open new connection to NewDoc.host, retrying on HTTP_PORT
+   for servers which have moved from the OLD_PORT. Returns -1
+   on failure after any warnings */
+
+static int OpenConnection(void)
+{
+    int s, vg;
+
+    s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (s == -1)
+    {
+        ShowAbortButton(0);
+        Warn("Couldn't create a socket for %s!\n", NewDoc.host);
+        return -1;
+    }
+
+    Announce("Connecting to %s on port %d", NewDoc.host, NewDoc.port);
+
+    vg = 0;
+
+    if (!Connect(s, NewDoc.host, NewDoc.port, &vg))
+    {
+        if (NewDoc.port != OLD_PORT)
+        {
+            if (!Authorize)
+                ShowAbortButton(0);
+
+            return -1;
+        }
+
+        Announce("Retrying %s on port %d", NewDoc.host, HTTP_PORT);
+
+        s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        if (s == -1)
+        {
+            ShowAbortButton(0);
+            Warn("Couldn't create a socket for %s!\n", NewDoc.host);
+            return -1;
+        }
+
+        if (!Connect(s, NewDoc.host, HTTP_PORT, &vg))
+        {
+            if (!Authorize)
+                ShowAbortButton(0);
+
+            return -1;
+        }
+
+        NewDoc.port = HTTP_PORT;
+        NewDoc.url = UnivRefLoc(&NewDoc);
+    }
+
+    return s;
+}
+
+/*
+   Start retrieving href in the background, named by href for
+   FetchedDocument(). Only used for HTTP servers reachable without
+   the gateway, returns 0 if href should be got with GetDocument()
+*/
+
+int PrefetchDocument(char *href)
+{
+    int len, started;
+    char *request;
+
+    if (!ParseReference(href, REMOTE))
+        return 0;
+
+    started = 0;
+
+    if (NewDoc.where == REMOTE && NewDoc.protocol == HTTP && !IsMyName(NewDoc.host))
+    {
+        request = HTRQrequestString(&NewDoc, &len, NULL);
+        started = StartFetch(NewDoc.host, NewDoc.port, request, len, href);
+    }
+
+    FreeDoc(&NewDoc);
+    return started;
+}
+
+/* complete retrieval of href started by PrefetchDocument()
+   given the server's response in buf, which is then owned
+   by NewDoc. Returns NULL unless the document was found */
+
+char *FetchedDocument(char *href, char *buf, int len)
+{
+    int n;
+    char *p;
+
+    if (!ParseReference(href, REMOTE))
+    {
+        free(buf);
+        return NULL;
+    }
+
+    n = 0;
+
+    if (strncmp(buf, "HTTP/", 5) == 0 && (p = strchr(buf, ' ')))
+        sscanf(p+1, "%d", &n);
+
+    if (n != 200)
+    {
+        free(buf);
+        FreeDoc(&NewDoc);
+        return NULL;
+    }
+
+    /* sets NewDoc.cache to file for saving data in shared cache */
+
+    if ((p = GetCachedDoc()))
+    {
+        free(buf);
+        return p;
+    }
+
+    NewDoc.buffer = buf;
+    NewDoc.length = len;
+    NewDoc.hdrlen = HeaderLength(buf, &NewDoc.type);
+    HeaderDates(&NewDoc);
+
+    if (!NewDoc.date)
+        NewDoc.date = time(NULL);
+
+    NewDocumentType();
+    RegisterDoc(NewDoc.buffer);
+    RememberDoc();
+    return NewDoc.buffer;
+}
+
 /* Get specified href according to where parameter:
 
         a)  LOCAL defaults to direct file access
@@ -717,11 +998,13 @@ int HeaderLength(char *buf, int *type)
 
 char *GetDocument(char *href, char *who, int where)
 {
-    int s, n, hlen, len, vg;
+    int s, n, hlen, len, reused;
     long cp;
     char *p, *request, *buf;
+    Doc cached;
 
     NewDoc.length = 0;
+    cached.buffer = NULL;
 
     /* parse href to unpack fields and and create absolute URL */
 
@@ -738,12 +1021,44 @@ char *GetDocument(char *href, char *who, int where)
     else
         who = RetrieveNamePW();
 
-    /* next check if document is in cache - if not
-       if sets NewDoc.cache to suitable filename
-       to store retrieved data in shared cache */
+    /* recently viewed documents are held in memory, and only
+       HTTP documents can be revalidated if no longer fresh */
+
+    if ((buf = RecallDoc()))
+    {
+        if (NewDoc.protocol != HTTP || IsFresh(&NewDoc))
+            return buf;
+    }
+    else if (NewDoc.where == REMOTE && (buf = GetCachedDoc()))
+    {
+        /* found in shared cache - if not GetCachedDoc()
+           sets NewDoc.cache to suitable filename to
+           store retrieved data in shared cache */
+
+        if (IsFresh(&NewDoc))
+        {
+            RememberDoc();
+            return buf;
+        }
+    }
 
-    if (NewDoc.where == REMOTE && (buf = GetCachedDoc()))
-        return buf;
+    if (buf)
+    {
+        /* set cached copy aside and ask server if it has changed */
+
+        cached.buffer = NewDoc.buffer;
+        cached.mapped = NewDoc.mapped;
+        cached.length = NewDoc.length;
+        cached.hdrlen = NewDoc.hdrlen;
+        cached.type = NewDoc.type;
+        cached.date = NewDoc.date;
+        cached.expires = NewDoc.expires;
+        cached.lastmod = NewDoc.lastmod;
+
+        NewDoc.buffer = NULL;
+        NewDoc.mapped = 0;
+        NewDoc.validate = (NewDoc.lastmod ? NewDoc.lastmod : NewDoc.date);
+    }
 
     ShowAbortButton(1);
 
@@ -767,71 +1082,76 @@ char *GetDocument(char *href, char *who, int where)
         return GetFile(NewDoc.path);
     }
 
-    /* create a socket */
-
-    s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    /* reuse idle connection to this server if there is one */
 
-    if (s == -1)
-    {
-        ShowAbortButton(0);
-        Warn("Couldn't create a socket for %s!\n", NewDoc.host);
-        return NULL;
-    }
-
-    Announce("Connecting to %s on port %d", NewDoc.host, NewDoc.port);
+    if ((s = TakeConnection(NewDoc.host, NewDoc.port)) != -1)
+        reused = 1;
+    else if ((s = OpenConnection()) == -1)
+        return UseCachedCopy(&cached);
+    else
+        reused = 0;
 
-    vg = 0;
+    /* the server may have closed a reused connection just as
+       we sent the request, in which case retry with a new one,
+       but not if the user aborted or the wait timed out */
 
-    if (!Connect(s, NewDoc.host, NewDoc.port, &vg))
+    for (;;)
     {
-        if (NewDoc.port != OLD_PORT)
-        {
-            if (!Authorize)
-                ShowAbortButton(0);
+        /* set up request string: "GET http://fred.hp.com/hypertext/pub/junk.html" */
 
-            return NULL;
-        }
+        request = HTRQrequestString(&NewDoc, &len, who);
 
-        Announce("Retrying %s on port %d", NewDoc.host, HTTP_PORT);
+        Announce(TextLine(request));
 
-        s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        /* and send it to server */
 
-        if (s == -1)
+        if (XPSend(s, request, len, 0) != len)
         {
+            if (reused && !Interrupted)
+                goto retry;
+
             ShowAbortButton(0);
-            Warn("Couldn't create a socket for %s!\n", NewDoc.host);
-            return NULL;
+            Warn("Couldn't make connection with %s on port %d!\n", NewDoc.host, NewDoc.port);
+            return UseCachedCopy(&cached);
         }
 
-        if (!Connect(s, NewDoc.host, HTTP_PORT, &vg))
-        {
-            if (!Authorize)
-                ShowAbortButton(0);
+        NewDoc.buffer = GetData(s, &len);
 
-            return NULL;
-        }
+        if (!reused || len > 0)
+            break;
 
-        NewDoc.port = HTTP_PORT;
-        NewDoc.url = UnivRefLoc(&NewDoc);
-    }
+        /* retry only if the peer closed before sending anything */
 
-    /* set up request string: "GET http://fred.hp.com/hypertext/pub/junk.html" */
+        if (NewDoc.buffer)
+        {
+            close(s);
+            free(NewDoc.buffer);
+            NewDoc.buffer = NULL;
+        }
+        else if (!Interrupted && errno == ECONNRESET)
+            close(s);
+        else
+            break;
 
-    request = HTRQrequestString(&NewDoc, &len, who);
+    retry:
+        reused = 0;
 
-    Announce(TextLine(request));
+        if ((s = OpenConnection()) == -1)
+            return UseCachedCopy(&cached);
+    }
 
-    /* and send it to server */
+    /* keep connection open if server allows it, a connection made
+       via the gateway is relayed to NewDoc.host until either end
+       closes it and so is kept under that host and port too */
 
-    if (XPSend(s, request, len, 0) != len)
+    if (NewDoc.buffer)
     {
-        ShowAbortButton(0);
-        Warn("Couldn't make connection with %s on port %d!\n", NewDoc.host, NewDoc.port);
-        return NULL;
+        if (KeepAlive)
+            KeepConnection(s, NewDoc.host, NewDoc.port);
+        else
+            close(s);
     }
 
-    NewDoc.buffer = GetData(s, &len);
-
     if (debug)
         printf("received a total of %d bytes\n", len);
 
@@ -840,12 +1160,16 @@ char *GetDocument(char *href, char *who, int where)
         ShowAbortButton(0);
         Beep();
         SetStatusString(NULL);
-        return NULL;
+        return UseCachedCopy(&cached);
     }
 
     if (len == 0)
     {
         ShowAbortButton(0);
+
+        if (cached.buffer)
+            return UseCachedCopy(&cached);
+
         Warn("No data available for %s", NewDoc.url);
         FreeDoc(&NewDoc);
         return NULL;
@@ -860,13 +1184,39 @@ char *GetDocument(char *href, char *who, int where)
         if (n == 401)
         {
             Beep();
+            FreeDocBuffer(&cached);
             GetAuthorization(REMOTE, NewDoc.url);
             return NULL;
         }
+        else if (n == 304 && cached.buffer)
+        {
+            /* not modified - note new Date and Expires, and use our copy */
+
+            ShowAbortButton(0);
+            NewDoc.hdrlen = HeaderLength(NewDoc.buffer, &n);
+            HeaderDates(&NewDoc);
+            cached.date = (NewDoc.date ? NewDoc.date : time(NULL));
+            cached.expires = NewDoc.expires;
+
+            if (NewDoc.lastmod)
+                cached.lastmod = NewDoc.lastmod;
+
+            buf = UseCachedCopy(&cached);
+
+            if (NewDoc.cache)  /* NULL for some memory copies */
+                RegisterCacheEntry();
+
+            Announce(NewDoc.url);
+            return buf;
+        }
         else if (n != 200)
             Beep();
 
         NewDoc.hdrlen = HeaderLength(NewDoc.buffer, &NewDoc.type);
+        HeaderDates(&NewDoc);
+
+        if (!NewDoc.date)
+            NewDoc.date = time(NULL);
     }
     else if (strncasecmp(NewDoc.buffer, "<plaintext>", 11) == 0)
     {  /* strip <PLAINTEXT>/r/n tag at start of text files */
@@ -886,12 +1236,17 @@ char *GetDocument(char *href, char *who, int where)
 
     ShowAbortButton(0);
 
+    /* release cached copy before its file is overwritten */
+
+    FreeDocBuffer(&cached);
+
   /* buffer and length will alter if file is decompressed */
 
     NewDoc.length = len;
     NewDocumentType();  /* determine document type */
 
     RegisterDoc(NewDoc.buffer);
+    RememberDoc();
     Announce(NewDoc.url);
     return NewDoc.buffer;
 }
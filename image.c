@@ -5,6 +5,13 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
+#include <X11/extensions/XShm.h>
+#include <X11/Xmd.h>
+#include <X11/extensions/shmproto.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/time.h>
 #include <string.h>
 #include <ctype.h>
 #include "www.h"
@@ -15,7 +22,9 @@ extern Window win;
 extern unsigned long labelColor, textColor, statusColor, strikeColor,
             transparent, windowColor, windowBottomShadow, windowShadow;
 extern int depth;
+extern int debug;
 extern int IsIndex;
+extern int Streaming;
 extern Doc NewDoc, CurrentDoc;
 
 extern Pixmap default_pixmap;
@@ -28,6 +37,9 @@ extern int Magic64[256];
 
 extern GC disp_gc;
 extern unsigned int win_width, win_height;
+extern int sbar_width;
+extern int statusHeight;
+extern int ToolBarHeight;
 
 Pixmap smile, frown;
 int imaging; /* set to COLOR888, COLOR232, GREY4 or MONO */
@@ -289,7 +301,7 @@ unsigned char *CreateBackground(unsigned int width, unsigned int height, unsigne
     else
         return NULL;
 
-    p = data = (unsigned char *)malloc(size);
+    p = data = (unsigned char *)NewImageData(size);
 
     if (data == NULL)
         return NULL;
@@ -420,12 +432,14 @@ char *LoadXpmImage(Image *image, unsigned int depth)
     unsigned int width, height;
     unsigned long pixel, *pixdata;
     unsigned char *data, *p;
-    char *name;
+    char *name, *file;
     Color *colors, color;
     FILE *fp;
     XColor xcolor;
 
-    if ((fp = fopen(image->url, "r")) == NULL)
+    file = (NewDoc.where == LOCAL ? NewDoc.path : image->url);
+
+    if ((fp = fopen(file, "r")) == NULL)
     {
         printf("Can't load image: %s", image->url);
         return NULL;
@@ -478,7 +492,7 @@ char *LoadXpmImage(Image *image, unsigned int depth)
 
     if (depth == 8)
     {
-        p = data = malloc(size);
+        p = data = (unsigned char *)NewImageData(size);
 
         for (i = 0; i < height; ++i)
         {
@@ -564,7 +578,7 @@ char *LoadXpmImage(Image *image, unsigned int depth)
     }
     else  /* depth == 24 */
     {
-        p = data = malloc(size * 4);
+        p = data = (unsigned char *)NewImageData(size * 4);
 
         for (i = 0; i < height; ++i)
         {
@@ -695,8 +709,212 @@ Pixmap LoadXbmImage(Image *image, unsigned int depth)
     return pixmap;
 }
 
-Image *DefaultImage(Image *image)
+/*
+   Loaded images are kept from one document to the next, in a hash
+   table keyed by absolute url, so that going back to a page or on
+   to another with the same icons doesn't fetch and decode them all
+   again. The table is bounded by an estimate of the memory held by
+   the X server for their pixmaps: when it is exceeded, the least
+   recently used images not on the current document's images list
+   are released. Placeholders are only kept for the document that
+   asked for them, so that failed images are tried again later.
+*/
+
+#define IMAGEHASHSIZE   256         /* must be a power of 2 */
+#define MAXIMAGEBYTES   (4L << 20)  /* for images not in use */
+
+static Image *imagehash[IMAGEHASHSIZE];
+static Image *newest, *oldest;      /* least recently used order */
+
+static unsigned ImageHash(char *url)
+{
+    unsigned hashval;
+
+    for (hashval = 0; *url != '\0'; url++)
+        hashval = *url + 31*hashval;
+
+    return hashval & (IMAGEHASHSIZE - 1);
+}
+
+static Image *LookupImage(char *url)
+{
+    Image *image;
+
+    for (image = imagehash[ImageHash(url)]; image != NULL; image = image->chain)
+    {
+        if (strcmp(image->url, url) == 0)
+            break;
+    }
+
+    return image;
+}
+
+/* estimate of server memory held by image */
+
+static long ImageBytes(Image *image)
 {
+    if (image->pixmap == default_pixmap)
+        return 0;
+
+    return (long)image->width * image->height * (depth > 16 ? 4 : depth > 8 ? 2 : 1);
+}
+
+/* mark image as most recently used and add it to the
+   current document's images list if not already there */
+
+static Image *UseImage(Image *image)
+{
+    if (image->cached && image != newest)
+    {
+        image->newer->older = image->older;
+
+        if (image->older)
+            image->older->newer = image->newer;
+        else
+            oldest = image->newer;
+
+        image->newer = NULL;
+        image->older = newest;
+        newest->newer = image;
+        newest = image;
+    }
+
+    if (!image->used)
+    {
+        image->used = 1;
+        image->next = images;
+        images = image;
+    }
+
+    return image;
+}
+
+/* returns a new image for the malloc'ed url, which
+   is entered in the hash table if cache is set */
+
+static Image *NewImage(char *url, int cache)
+{
+    Image *image;
+    unsigned hashval;
+
+    image = (Image *)malloc(sizeof(Image));
+    image->url = url;
+    image->pixmap = default_pixmap;
+    image->width = default_pixmap_width;
+    image->height = default_pixmap_height;
+    image->pixels = NULL;
+    image->npixels = 0;
+    image->used = 0;
+    image->cached = cache;
+    image->pending = 0;
+    image->stale = 0;
+    image->chain = image->newer = image->older = NULL;
+
+    if (cache)
+    {
+        hashval = ImageHash(url);
+        image->chain = imagehash[hashval];
+        imagehash[hashval] = image;
+
+        image->older = newest;
+
+        if (newest)
+            newest->newer = image;
+        else
+            oldest = image;
+
+        newest = image;
+    }
+
+    return image;
+}
+
+/* remove image from the hash table and free it along with its
+   pixmap and colors, unless they belong to a previous display.
+   The caller takes care of the images list */
+
+static void DropImage(Image *image, int cloned)
+{
+    Image **ipp;
+
+    if (image->cached)
+    {
+        for (ipp = &imagehash[ImageHash(image->url)]; *ipp != image; ipp = &(*ipp)->chain);
+
+        *ipp = image->chain;
+
+        if (image->newer)
+            image->newer->older = image->older;
+        else
+            newest = image->older;
+
+        if (image->older)
+            image->older->newer = image->newer;
+        else
+            oldest = image->newer;
+    }
+
+    if (!cloned && image->npixels > 0)
+        XFreeColors(display, colormap, image->pixels, image->npixels, 0);
+
+    if (!cloned && image->pixmap != default_pixmap)
+        XFreePixmap(display, image->pixmap);
+
+    if (!cloned && image->stale)
+        XFreePixmap(display, image->stale);
+
+    if (image->npixels > 0)
+        free(image->pixels);
+
+    free(image->url);
+    free(image);
+}
+
+/* release the least recently used images not in use
+   until those remaining fit within MAXIMAGEBYTES */
+
+static void TrimImages(void)
+{
+    long bytes;
+    Image *image, *newer;
+
+    for (bytes = 0, image = oldest; image != NULL; image = image->newer)
+    {
+        if (!image->used)
+            bytes += ImageBytes(image);
+    }
+
+    for (image = oldest; image != NULL && bytes > MAXIMAGEBYTES; image = newer)
+    {
+        newer = image->newer;
+
+        if (!image->used)
+        {
+            bytes -= ImageBytes(image);
+            DropImage(image, 0);
+        }
+    }
+}
+
+/* the layout may still show the stand-in pixmap of an image
+   which is still arriving, so it is kept until LayoutImages() */
+
+static int relayout;  /* set when an image's size has changed */
+
+static void DropStandIn(Image *image)
+{
+    if (image->pending)
+    {
+        image->stale = image->pixmap;
+        image->pending = 0;
+        relayout = 1;
+    }
+}
+
+static void UseDefaultPixmap(Image *image)
+{
+    DropStandIn(image);
+
     if (image->npixels > 0)
     {
         XFreeColors(display, colormap, image->pixels, image->npixels, 0);
@@ -708,72 +926,314 @@ Image *DefaultImage(Image *image)
     image->pixmap = default_pixmap;
     image->width = default_pixmap_width;
     image->height = default_pixmap_height;
-    image->next = images;
-    images = image;
+}
 
-    return image;
+Image *DefaultImage(Image *image)
+{
+    UseDefaultPixmap(image);
+    return UseImage(image);
 }
 
-Image *GetImage(char *href, int hreflen)
+/* give an image which is still arriving a copy of the default
+   pixmap of its own, so that if the image turns out to be the
+   same size it can be filled in without laying out again */
+
+static Image *PendingImage(Image *image)
 {
-    XGCValues values;
-    unsigned int width, height;
     Pixmap pixmap;
-    XImage *ximage;
-    GC drawGC;
-    char *data;
-    Image *image;
-    Block block;
-    int tag;
+    GC gc;
 
-    /* check if designated image is already loaded */
+    UseDefaultPixmap(image);
 
-    for (image = images; image != NULL; image = image->next)
+    if ((pixmap = XCreatePixmap(display, win, image->width, image->height, depth)) != 0)
     {
-        if (strlen(image->url) == hreflen && strncmp(href, image->url, hreflen) == 0)
-            return image;
+        gc = XCreateGC(display, pixmap, 0, 0);
+        XCopyArea(display, default_pixmap, pixmap, gc,
+                    0, 0, image->width, image->height, 0, 0);
+        XFreeGC(display, gc);
+        image->pixmap = pixmap;
+        image->pending = 1;
     }
 
-    image = (Image *)malloc(sizeof(Image));
-    image->url = (char *)malloc(hreflen+1);
-    memcpy(image->url, href, hreflen);
-    image->url[hreflen] = '\0';
-    image->npixels = 0;
+    return UseImage(image);
+}
 
-    /* otherwise we need to load image from cache or remote server */
+/*
+   Image data is sent to the X server with PutImage(). For a local
+   display, the data of large images is decoded straight into a
+   segment of memory shared with the server using the MIT-SHM
+   extension, see NewImageData(), and XShmPutImage() then just tells
+   the server where to find it rather than the data being written
+   down the socket. When an image's data is freed its segment is kept
+   for the next one, as attaching a fresh segment costs a round trip
+   and both sides then have to fault in its pages. The server may not
+   have read the segment by the time it is reused, so XSync() is
+   called then unless the request putting it is known to be done.
+   The server can't attach segments if it is on another machine, and
+   if the first attempt fails, or the extension is missing, the data
+   is malloc'ed and XPutImage() used instead, as it is for small
+   images. With debug set, each upload is timed.
+*/
+
+#define SHMMIN   65536  /* smaller images aren't worth a segment */
+#define SHMSPARE 4      /* freed segments kept for reuse */
+
+typedef struct segment_struct
+    {
+        struct segment_struct *next;
+        XShmSegmentInfo info;
+        long size;
+        unsigned long request;  /* last XShmPutImage() from it */
+        int attached;           /* to the current display */
+    } Segment;
+
+static Segment *segments;       /* those holding image data */
+static Segment *spare;          /* those kept for reuse */
+static int nspare;
+static int shm = -1;            /* -1 untried, 0 unavailable, 1 usable */
+static int shmopcode;           /* major opcode of MIT-SHM requests */
+static int shmfailed;           /* set by ShmError() */
+static XErrorHandler xerror;    /* handler ShmError() stands in for */
+
+/* catches the failure of XShmAttach(), passing on other errors */
+
+static int ShmError(Display *dpy, XErrorEvent *event)
+{
+    if (event->request_code == shmopcode && event->minor_code == X_ShmAttach)
+    {
+        shmfailed = 1;
+        return 0;
+    }
 
-    block.buffer = GetDocument(image->url, NULL, REMOTE);
+    return (*xerror)(dpy, event);
+}
+
+/* returns a new segment of size bytes attached by the server, or NULL */
+
+static Segment *NewSegment(long size)
+{
+    Segment *seg;
+    int event, error;
 
-    if (block.buffer == NULL)
+    if (shm == -1)
+        shm = (XShmQueryExtension(display) &&
+               XQueryExtension(display, "MIT-SHM", &shmopcode, &event, &error));
+
+    if (!shm || (seg = (Segment *)malloc(sizeof(Segment))) == NULL)
+        return NULL;
+
+    if ((seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|0600)) == -1)
     {
-        Warn("Failed to load image data: %s", image->url);
-        return DefaultImage(image);
+        free(seg);
+        return NULL;
+    }
+
+    seg->info.shmaddr = (char *)shmat(seg->info.shmid, 0, 0);
+    seg->info.readOnly = True;
+
+    if (seg->info.shmaddr == (char *)-1)
+    {
+        shmctl(seg->info.shmid, IPC_RMID, 0);
+        free(seg);
+        return NULL;
+    }
+
+    shmfailed = 0;
+    xerror = XSetErrorHandler(ShmError);
+    XShmAttach(display, &seg->info);
+    XSync(display, False);
+    XSetErrorHandler(xerror);
+
+    /* the segment goes once both have detached from it */
+
+    shmctl(seg->info.shmid, IPC_RMID, 0);
+
+    if (shmfailed)
+    {
+        shm = 0;  /* give up on shared memory */
+        shmdt(seg->info.shmaddr);
+        free(seg);
+        return NULL;
+    }
+
+    seg->size = size;
+    seg->request = 0;
+    seg->attached = 1;
+    return seg;
+}
+
+static void FreeSegment(Segment *seg)
+{
+    if (seg->attached)
+        XShmDetach(display, &seg->info);
+
+    shmdt(seg->info.shmaddr);
+    free(seg);
+}
+
+/* returns size bytes for an image's data, to be released
+   by FreeImageData() or DestroyImage(), or NULL on failure */
+
+char *NewImageData(long size)
+{
+    Segment *seg, **psg, **best;
+
+    if (size < SHMMIN)
+        return (char *)malloc(size);
+
+    /* reuse the smallest spare segment that is big enough */
+
+    best = NULL;
+
+    for (psg = &spare; (seg = *psg) != NULL; psg = &seg->next)
+    {
+        if (seg->size >= size && (!best || seg->size < (*best)->size))
+            best = psg;
+    }
+
+    if (best)
+    {
+        seg = *best;
+        *best = seg->next;
+        --nspare;
+
+        if (LastKnownRequestProcessed(display) < seg->request)
+            XSync(display, False);
+    }
+    else if ((seg = NewSegment(size)) == NULL)
+        return (char *)malloc(size);
+
+    seg->next = segments;
+    segments = seg;
+    return seg->info.shmaddr;
+}
+
+void FreeImageData(char *data)
+{
+    Segment *seg, **psg;
+
+    for (psg = &segments; (seg = *psg) != NULL; psg = &seg->next)
+    {
+        if (seg->info.shmaddr == data)
+        {
+            *psg = seg->next;
+
+            if (seg->attached && nspare < SHMSPARE)
+            {
+                seg->next = spare;
+                spare = seg;
+                ++nspare;
+            }
+            else
+                FreeSegment(seg);
+
+            return;
+        }
+    }
+
+    free(data);
+}
+
+/* as XDestroyImage() which would free() the data itself */
+
+void DestroyImage(XImage *ximage)
+{
+    FreeImageData(ximage->data);
+    ximage->data = NULL;
+    XDestroyImage(ximage);
+}
+
+/* put rows y to y+height-1 of ximage into the same rows of d */
+
+void PutImage(Drawable d, GC gc, XImage *ximage, int y, unsigned int height)
+{
+    Segment *seg;
+    struct timeval t0, t1;
+
+    if (debug)
+        gettimeofday(&t0, NULL);
+
+    for (seg = segments; seg != NULL && seg->info.shmaddr != ximage->data; seg = seg->next);
+
+    if (seg && seg->attached)
+    {
+        seg->request = NextRequest(display);
+        ximage->obdata = (char *)&seg->info;
+        XShmPutImage(display, d, gc, ximage, 0, y, 0, y, ximage->width, height, False);
+        ximage->obdata = NULL;  /* else XDestroyImage() frees it */
+    }
+    else
+        XPutImage(display, d, gc, ximage, 0, y, 0, y, ximage->width, height);
+
+    if (debug)
+    {
+        XSync(display, False);
+        gettimeofday(&t1, NULL);
+        fprintf(stderr, "%s %dx%d image in %ld uS\n",
+            (seg && seg->attached ? "XShmPutImage" : "XPutImage"), ximage->width, height,
+            (t1.tv_sec - t0.tv_sec) * 1000000L + t1.tv_usec - t0.tv_usec);
+    }
+}
+
+/* after connecting afresh to the display, which has yet to attach
+   the segments, the images still using them are put with XPutImage() */
+
+void ResetPutImage(void)
+{
+    Segment *seg;
+
+    for (seg = segments; seg != NULL; seg = seg->next)
+        seg->attached = 0;
+
+    while ((seg = spare) != NULL)
+    {
+        spare = seg->next;
+        seg->attached = 0;
+        FreeSegment(seg);
     }
 
+    nspare = 0;
+    shm = -1;
+}
+
+/* create image's pixmap from the data in NewDoc which is then
+   released, returns 0 on failure after reporting it */
+
+static int MakeImagePixmap(Image *image)
+{
+    unsigned int width, height;
+    Pixmap pixmap;
+    XImage *ximage;
+    GC drawGC;
+    char *data;
+    Block block;
+    int len;
+
+    block.buffer = NewDoc.buffer;
     block.next = NewDoc.hdrlen;
     block.size = NewDoc.length;
-    NewDoc.buffer = NULL;
-    FreeDoc(&NewDoc);
+    len = strlen(image->url);
 
     Announce("Processing image %s...", image->url);
 
-    if (strncasecmp(image->url + hreflen - 4, ".gif", 4) == 0)
+    if (len >= 4 && strncasecmp(image->url + len - 4, ".gif", 4) == 0)
     {
         if ((data = (char *)LoadGifImage(image, &block, depth)) == NULL)
         {
             Warn("Failed to load GIF image: %s", image->url);
-            free(block.buffer);
-            return DefaultImage(image);
+            FreeDoc(&NewDoc);
+            return 0;
         }
     }
     else if ((data = LoadXpmImage(image, depth)) == NULL)
     {
         Warn("Failed to load XPM image: %s", image->url);
-        free(block.buffer);
-        return DefaultImage(image);
+        FreeDoc(&NewDoc);
+        return 0;
     }
 
-    free(block.buffer);
+    FreeDoc(&NewDoc);  /* releases block.buffer */
+
     width = image->width;
     height = image->height;
 
@@ -782,28 +1242,93 @@ Image *GetImage(char *href, int hreflen)
              width, height, (depth == 24 ? 32 : 8), 0)) == 0)
     {
         Warn("Failed to create XImage: %s", image->url);
-        free(data);
-        return DefaultImage(image);
+        FreeImageData(data);
+        return 0;
     }
 
-    if ((pixmap = XCreatePixmap(display, win, width, height, depth)) == 0)
+    /* an image the size of its stand-in is put in place of it */
+
+    if (image->pending && width == default_pixmap_width && height == default_pixmap_height)
+        pixmap = image->pixmap;
+    else if ((pixmap = XCreatePixmap(display, win, width, height, depth)) == 0)
     {
         Warn("Failed to create Pixmap: %s", image->url);
-        XDestroyImage(ximage); /* also free's image data */
-        return DefaultImage(image);
+        DestroyImage(ximage);
+        return 0;
     }
 
     drawGC = XCreateGC(display, pixmap, 0, 0);
     XSetFunction(display, drawGC, GXcopy);
-    XPutImage(display, pixmap, drawGC, ximage, 0, 0, 0, 0, width, height);
+    PutImage(pixmap, drawGC, ximage, 0, height);
     XFreeGC(display, drawGC);
-    XDestroyImage(ximage);  /* also free's image data */
+    DestroyImage(ximage);
+
+    if (pixmap == image->pixmap)
+    {
+        image->pending = 0;
+        RepaintImage(pixmap, 0, height);
+    }
+    else
+        DropStandIn(image);
 
     image->pixmap = pixmap;
     image->width = width;
     image->height = height;
-    image->next = images;
-    images = image;
+    return 1;
+}
+
+Image *GetImage(char *href, int hreflen)
+{
+    Image *image;
+    char *url, *p;
+
+    url = (char *)malloc(hreflen+1);
+    memcpy(url, href, hreflen);
+    url[hreflen] = '\0';
+
+    /* use placeholder while showing the document as it arrives,
+       as NewDoc is in use and the document will be laid out again */
+
+    if (Streaming)
+        return DefaultImage(NewImage(url, 0));
+
+    /* check if designated image is already loaded */
+
+    if ((p = ParseReference(url, REMOTE)) == NULL)
+    {
+        Warn("Failed to load image data: %s", url);
+        return DefaultImage(NewImage(url, 0));
+    }
+
+    p = strdup(p);
+    free(url);
+    url = p;
+
+    if ((image = LookupImage(url)) != NULL)
+    {
+        free(url);
+        return UseImage(image);
+    }
+
+    image = NewImage(url, 1);
+
+    /* use placeholder if still arriving, see CollectImages() */
+
+    if (FetchPending(image->url))
+        return PendingImage(image);
+
+    /* otherwise we need to load image from cache or remote server */
+
+    if (GetDocument(image->url, NULL, REMOTE) == NULL)
+    {
+        Warn("Failed to load image data: %s", image->url);
+        return DefaultImage(image);
+    }
+
+    if (!MakeImagePixmap(image))
+        return DefaultImage(image);
+
+    UseImage(image);
 
     if (!IsIndex)
         Announce(CurrentDoc.url);
@@ -811,29 +1336,437 @@ Image *GetImage(char *href, int hreflen)
     return image;
 }
 
+/*
+   GIF images are shown as they arrive: once the header of one has
+   been received, its pixmap is created at full size and the rows
+   decoded so far are put into it on each call to CollectImages(),
+   with each pass of an interlaced image filling in detail over the
+   last. Only the part of the window showing the new rows is then
+   painted again. The document is only laid out again if the image
+   isn't the size of the stand-in pixmap given it by GetImage(). The
+   decoder's state is kept on the progress list until the transfer
+   is complete.
+*/
+
+typedef struct progress_struct
+        {
+            struct progress_struct *next;
+            Image *image;
+            GifState *gif;      /* NULL if not a GIF after all */
+            XImage *ximage;     /* over the decoded image data */
+            GC gc;
+            Block block;        /* body received so far */
+        } Progress;
+
+static Progress *progress;
+
+static Progress *FindProgress(char *href)
+{
+    Progress *pp;
+
+    for (pp = progress; pp != NULL; pp = pp->next)
+    {
+        if (strcmp(pp->image->url, href) == 0)
+            break;
+    }
+
+    return pp;
+}
+
+static void EndProgress(Progress *pp, int cloned)
+{
+    Progress **ppp;
+
+    for (ppp = &progress; *ppp != pp; ppp = &(*ppp)->next);
+
+    *ppp = pp->next;
+
+    if (pp->gif)
+    {
+        pp->ximage->data = NULL;  /* free'd by EndGif() */
+        XDestroyImage(pp->ximage);
+
+        if (!cloned)
+            XFreeGC(display, pp->gc);
+
+        FreeImageData((char *)EndGif(pp->gif));
+    }
+
+    free(pp);
+}
+
+/* start showing image if enough of it has arrived */
+
+static void StartProgress(Image *image)
+{
+    int len;
+    unsigned int width, height;
+    char *buf, *data;
+    Pixmap pixmap;
+    Progress *pp;
+
+    len = strlen(image->url);
+
+    if (len < 4 || strncasecmp(image->url + len - 4, ".gif", 4) != 0)
+        return;
+
+    if (!PeekFetch(image->url, &buf, &len) || !GifReady(buf, len))
+        return;
+
+    if ((pp = (Progress *)malloc(sizeof(Progress))) == NULL)
+        return;
+
+    pp->next = progress;
+    pp->image = image;
+    pp->block.buffer = buf;
+    pp->block.next = 0;
+    pp->block.size = len;
+    progress = pp;
+
+    /* the stand-in is kept until CollectImages() if this fails */
+
+    width = image->width;
+    height = image->height;
+
+    if ((pp->gif = StartGif(image, &pp->block, depth, (unsigned char **)&data)) == NULL)
+    {
+        image->width = width;
+        image->height = height;
+        return;
+    }
+
+    pp->ximage = XCreateImage(display, DefaultVisual(display, screen),
+             depth, ZPixmap, 0, data,
+             image->width, image->height, (depth == 24 ? 32 : 8), 0);
+
+    if (image->width == width && image->height == height)
+        pixmap = image->pixmap;
+    else
+        pixmap = XCreatePixmap(display, win, image->width, image->height, depth);
+
+    if (pp->ximage == 0 || pixmap == 0)
+    {
+        if (pp->ximage)
+        {
+            pp->ximage->data = NULL;
+            XDestroyImage(pp->ximage);
+        }
+
+        FreeImageData((char *)EndGif(pp->gif));
+        pp->gif = NULL;
+        image->width = width;
+        image->height = height;
+        return;
+    }
+
+    pp->gc = XCreateGC(display, pixmap, 0, 0);
+    XSetFunction(display, pp->gc, GXcopy);
+    XSetForeground(display, pp->gc, windowColor);
+    XFillRectangle(display, pixmap, pp->gc, 0, 0, image->width, image->height);
+
+    if (pixmap == image->pixmap)
+    {
+        image->pending = 0;
+        RepaintImage(pixmap, 0, image->height);
+    }
+    else
+    {
+        DropStandIn(image);
+        image->pixmap = pixmap;
+    }
+}
+
+/* decode what has arrived and repaint where the rows added are
+   shown, which they aren't if the image's size has changed and
+   the document has yet to be laid out again */
+
+static void ContinueProgress(Progress *pp, int partial)
+{
+    int top, bottom;
+
+    ContinueGif(pp->gif, &pp->block, partial, &top, &bottom);
+
+    if (top >= bottom)
+        return;
+
+    PutImage(pp->image->pixmap, pp->gc, pp->ximage, top, bottom - top);
+    RepaintImage(pp->image->pixmap, top, bottom);
+}
+
+/* show more of the images still arriving, see above */
+
+static void ShowProgress(void)
+{
+    int len;
+    char *buf;
+    Image *image;
+    Progress *pp;
+
+    for (image = images; image != NULL; image = image->next)
+    {
+        if (image->pending && !FindProgress(image->url))
+            StartProgress(image);
+    }
+
+    for (pp = progress; pp != NULL; pp = pp->next)
+    {
+        /* the fetch buffer moves as it grows */
+
+        if (pp->gif && PeekFetch(pp->image->url, &buf, &len))
+        {
+            pp->block.buffer = buf;
+            pp->block.size = len;
+            ContinueProgress(pp, 1);
+        }
+    }
+}
+
+/*
+   Lay out the document again once images have changed size, then
+   free the stand-ins which the old layout showed. While further
+   images are still arriving, this is done at most once every
+   LAYOUTDELAY mS rather than as each arrives.
+*/
+
+#define LAYOUTDELAY 1000
+
+static void LayoutImages(void)
+{
+    static struct timeval last;
+    struct timeval now;
+    Image *image;
+
+    if (!relayout)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    if (Fetching() && (now.tv_sec - last.tv_sec) * 1000 +
+                (now.tv_usec - last.tv_usec) / 1000 < LAYOUTDELAY)
+        return;
+
+    last = now;
+    relayout = 0;
+    DisplaySizeChanged(0);
+    DisplayScrollBar();
+    DisplayDoc(WinLeft, WinTop, WinWidth, WinHeight);
+
+    for (image = images; image != NULL; image = image->next)
+    {
+        if (image->stale)
+        {
+            XFreePixmap(display, image->stale);
+            image->stale = 0;
+        }
+    }
+
+    if (!IsIndex)
+        Announce(CurrentDoc.url);
+}
+
+/*
+   Decode images which have arrived since ResolveImages() started
+   them and layout the document again if their sizes differ from
+   the stand-ins. Called when idle, as the layout and NewDoc must
+   not be disturbed while another document is being retrieved.
+*/
+
+void CollectImages(void)
+{
+    int len;
+    char *href, *buf;
+    Image *image;
+    Progress *pp;
+
+    ShowProgress();
+
+    while (TakeFetched(&href, &buf, &len))
+    {
+        /* finish off images already being shown */
+
+        if ((pp = FindProgress(href)) != NULL && pp->gif)
+        {
+            if (buf)
+                buf = FetchedDocument(href, buf, len);
+            else
+                buf = GetDocument(href, NULL, REMOTE);
+
+            if (buf)
+            {
+                pp->block.buffer = NewDoc.buffer + NewDoc.hdrlen;
+                pp->block.size = NewDoc.length - NewDoc.hdrlen;
+                ContinueProgress(pp, 0);
+                FreeDoc(&NewDoc);
+            }
+
+            EndProgress(pp, 0);
+            free(href);
+            continue;
+        }
+
+        if (pp)
+            EndProgress(pp, 0);
+
+        if ((image = LookupImage(href)) == NULL ||
+                !image->pending)  /* no longer wanted */
+        {
+            Free(buf);
+            free(href);
+            continue;
+        }
+
+        /* try again directly if the transfer failed */
+
+        if (buf)
+            buf = FetchedDocument(href, buf, len);
+        else
+            buf = GetDocument(href, NULL, REMOTE);
+
+        if (!buf || !MakeImagePixmap(image))
+            UseDefaultPixmap(image);
+
+        free(href);
+    }
+
+    LayoutImages();
+}
+
+/*
+   Scan HTML document for <img> and <fig> src attributes and resolve
+   their absolute urls with the cache server in one batched exchange,
+   before layout calls GetImage() for each in turn. Images which
+   aren't cached are then all requested at once, so that layout can
+   proceed with placeholders while they arrive.
+*/
+
+#define MAXPREFETCH 256
+
+void ResolveImages(char *buf)
+{
+    int c, n, i, len;
+    char *p, *q, *url, *urls[MAXPREFETCH], href[512];
+
+    n = 0;
+
+    for (p = buf; n < MAXPREFETCH && (p = strchr(p, '<')) != NULL;)
+    {
+        ++p;
+
+        if (!(strncasecmp(p, "img", 3) == 0 || strncasecmp(p, "fig", 3) == 0)
+                || !IsWhite(p[3]))
+            continue;
+
+        /* look for src attribute before end of tag */
+
+        for (p += 3; (c = *p) && c != '>'; ++p)
+        {
+            if (IsWhite(c) && strncasecmp(p+1, "src", 3) == 0)
+            {
+                for (p += 4; IsWhite(*p); ++p);
+
+                if (*p == '=')
+                    break;
+            }
+        }
+
+        if (*p != '=')
+            continue;
+
+        for (++p; IsWhite(*p); ++p);
+
+        if (*p == '"' || *p == '\'')
+        {
+            c = *p++;
+
+            for (q = p; *q && *q != c; ++q);
+        }
+        else
+        {
+            for (q = p; *q && *q != '>' && !IsWhite(*q); ++q);
+        }
+
+        len = q - p;
+
+        if (len == 0 || len >= sizeof(href))
+            continue;
+
+        memcpy(href, p, len);
+        href[len] = '\0';
+
+        /* expand to absolute url as GetDocument() would,
+           skipping images kept from earlier documents */
+
+        if ((url = ParseReference(href, REMOTE)) == NULL ||
+                NewDoc.where != REMOTE || LookupImage(url))
+            continue;
+
+        for (i = 0; i < n; ++i)
+        {
+            if (strcmp(urls[i], url) == 0)
+                break;
+        }
+
+        if (i == n)
+            urls[n++] = strdup(url);
+    }
+
+    FreeDoc(&NewDoc);
+    BeginCacheBatch(urls, n);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (!IsCached(urls[i]))
+            PrefetchDocument(urls[i]);
+
+        free(urls[i]);
+    }
+}
+
+/* release the current document's images, which are kept for
+   later documents unless they failed or were still arriving.
+   When cloned, the pixmaps and colors belong to the display of
+   the parent process, so all are forgotten without freeing them */
+
 void FreeImages(int cloned)
 {
     Image *im;
 
-    while (images)
+    CancelFetches();  /* images still arriving */
+
+    while (progress)
     {
-        /* deallocate colors */
+        im = progress->image;
+        EndProgress(progress, cloned);
 
-        if (!cloned && images->npixels > 0)
-            XFreeColors(display, colormap, images->pixels, images->npixels, 0);
+        if (!cloned && im->pixmap != default_pixmap)
+            XFreePixmap(display, im->pixmap);
 
-        /* free pixmap and image structure */
+        im->pixmap = default_pixmap;  /* incomplete */
+        im->pending = 0;
+    }
 
-        if (!cloned && images->pixmap != default_pixmap)
-            XFreePixmap(display, images->pixmap);
+    relayout = 0;
 
+    while (images)
+    {
         im = images;
         images = im->next;
-        free(im->url);
+        im->used = 0;
+
+        if (!cloned && im->stale)
+            XFreePixmap(display, im->stale);
+
+        im->stale = 0;
 
-        if (im->npixels > 0)
-            free(im->pixels);
+        if (cloned || im->pixmap == default_pixmap || im->pending)
+            DropImage(im, cloned);
+    }
 
-        free(im);
+    if (cloned)
+    {
+        while (oldest)
+            DropImage(oldest, cloned);
     }
+    else
+        TrimImages();
 }
@@ -15,14 +15,21 @@ as it would limit revisions to the paint stream to the region changed.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/mman.h>
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+#define SSE2_SCAN
+#include <emmintrin.h>
+#endif
 #include "www.h"
 
 #define LBUFSIZE 1024
+#define PAINTRESERVE (64L << 20)  /* address space set aside for paint */
 
 extern Display *display;
 extern int screen;
@@ -73,6 +80,7 @@ extern XFontStruct *Fonts[FONTS];
 extern int LineSpacing[FONTS], BaseLine[FONTS], StrikeLine[FONTS];
 extern int ListIndent1, ListIndent2;
 extern Frame background;
+extern char *LayoutEnd;         /* where lazy layout stopped */
 
 char *bufptr;  /* parse position in the HTML buffer */
 char *lastbufptr;  /* keep track of last position to store delta's */
@@ -89,6 +97,7 @@ int below;            /* below baseline */
 int error;            /* set by parser */
 int prepass;          /* true during table prepass */
 int html_width;       /* tracks maximum width */
+int layout_width;     /* window width the paint stream was laid out for */
 int min_width, max_width; /* table cell width */
 int list_indent;
 
@@ -100,6 +109,7 @@ static int TokenClass, TokenValue, Token;
 static char *EntityValue;
 
 unsigned int ui_n;
+unsigned long ul_n;
 int baseline;       /* from top of line */
 long TermTop, TermBottom;
 
@@ -107,6 +117,7 @@ long PixOffset;     /* current offset from start of document */
 long PrevOffset;    /* keep track for saving delta's */
 long LastLIoffset;  /* kludge for <LI><LI> line spacing */
 long ViewOffset;    /* for toggling between HTML/TEXT views */
+long LastBlock;     /* start of last top level block in body */
 
 extern long IdOffset;      /* offset for targetId */
 extern char *targetptr;    /* for toggling view between HTML/TEXT views */
@@ -117,6 +128,7 @@ int HTMLInit = 0;
 Image *start_figure, *figure;
 long figEnd;
 Form *form;
+extern Form *forms;
 
 char *LastBufPtr, *StartOfLine, *StartOfWord; /* in HTML document */
 static int LineLen, LineWidth, WordStart, WordWidth;
@@ -126,20 +138,81 @@ static char *Ones[] = {"i", "ii", "iii", "iv", "v", "vi", "vii", "viii", "ix"};
 static char *Tens[] = {"x", "xx", "xxx", "xl", "l", "lx", "lxx", "lxxx", "xc"};
 static char *Hundreds[] = {"c", "cc", "ccc", "cd", "d", "dc", "dcc", "dccc", "cm"};
 
+static int paintmapped;  /* true if paint buffer was reserved by mmap */
+
 /* push 16 bit value onto paint buffer */
 
 #define PushValue(p, value) ui_n = (unsigned int)value; *p++ = ui_n & 0xFF; *p++ = (ui_n >> 8) & 0xFF
 
+/* push 32 bit value onto paint buffer */
+
+#define PushLong(p, value) ul_n = (unsigned long)value; PushValue(p, ul_n & 0xFFFF); PushValue(p, (ul_n >> 16) & 0xFFFF)
+
+/*
+ The paint buffer is reserved as one large region of address space
+ so that it never moves as it grows, and the system only commits the
+ pages as they are touched. This keeps pointers into the buffer,
+ e.g. TopObject and frame->top, valid while a document is laid out
+ and avoids copying the stream each time it doubles. If the region
+ can't be reserved or the document outgrows it, we fall back to
+ doubling a buffer on the heap.
+*/
+
+static void NewPaint(void)
+{
+#ifdef MAP_ANON
+    paint = (Byte *)mmap(NULL, PAINTRESERVE, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANON, -1, 0);
+
+    if (paint != (Byte *)MAP_FAILED)
+    {
+        paintbufsize = PAINTRESERVE;
+        paintmapped = 1;
+        return;
+    }
+#endif
+
+    paintbufsize = 8192;
+    paint = (Byte *)malloc(paintbufsize);
+
+    if (paint == NULL)
+    {
+        fprintf(stderr, "Panic: can't allocate paint buffer\n");
+        exit(1);
+    }
+}
+
 /* expand paint stream to fit len bytes */
 
 Byte *MakeRoom(int len)
 {
     Byte *p;
+    long size;
 
     if (paintlen > paintbufsize - len)
     {
-        paintbufsize = paintbufsize << 1;
-        paint = (Byte *)realloc(paint, paintbufsize);
+        for (size = (long)paintbufsize << 1; paintlen > size - len; size <<= 1);
+
+        if (paintmapped)
+        {
+            if ((p = (Byte *)malloc(size)) != NULL)
+            {
+                memcpy(p, paint, paintlen);
+                munmap((char *)paint, paintbufsize);
+                paintmapped = 0;
+            }
+        }
+        else
+            p = (Byte *)realloc(paint, size);
+
+        if (p == NULL)
+        {
+            fprintf(stderr, "Panic: can't grow paint buffer to %ld bytes\n", size);
+            exit(1);
+        }
+
+        paint = p;
+        paintbufsize = size;
     }
 
     p = paint + paintlen;
@@ -218,6 +291,7 @@ void ShowFrame(int n)
         c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
         style = *p++; border = *p++;
         c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+        c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
         printf("[%d] Frame:\n", obj-paint);
         printf("  offset = %ld\n", offset);
@@ -229,9 +303,10 @@ void ShowFrame(int n)
         /* check size field is ok */
         p += length;     /* skip over frame contents */
         c1 = *p++; c2 = *p++; size = c1 | c2<<8;
+        c1 = *p++; c2 = *p++; size |= (c1 | c2<<8) << 16;
 
-        if (p - 2 - size != obj)
-            printf("**** bad size field found %d when %d expected\n", size, p-2-obj);
+        if (p - SIZELEN - size != obj)
+            printf("**** bad size field found %d when %d expected\n", size, p-SIZELEN-obj);
     }
     else
         printf("Not start of frame %d\n", *obj);
@@ -263,19 +338,23 @@ void ShowPaint(int npaint, int nobjs)
                 c1 = *p++; c2 = *p++; height |= (c1 | c2<<8) << 16;
                 style = *p++; border = *p++;
                 c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+                c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
 
                 printf("[%d] Frame:offset = %ld, indent = %d, height = %ld\n", obj-paint, offset, indent, height);
 
                 /* check size field is ok */
                 p += length;     /* skip over frame contents */
                 c1 = *p++; c2 = *p++; size = c1 | c2<<8;
-                if (p - 2 - size != obj)
-                      printf("**** bad size field found %d when %d expected\n", size, p-2-obj);
+                c1 = *p++; c2 = *p++; size |= (c1 | c2<<8) << 16;
+                if (p - SIZELEN - size != obj)
+                      printf("**** bad size field found %d when %d expected\n", size, p-SIZELEN-obj);
                 break;
 
             case END_FRAME:
                 c1 = *p++; c2 = *p++; length = c1 | c2<<8;
+                c1 = *p++; c2 = *p++; length |= (c1 | c2<<8) << 16;
                 c1 = *p++; c2 = *p++; size = c1 | c2<<8;
+                c1 = *p++; c2 = *p++; size |= (c1 | c2<<8) << 16;
                 p = obj - length;
 
                 if (*p++ != BEGIN_FRAME)
@@ -338,6 +417,7 @@ void ShowPaint(int npaint, int nobjs)
                 }
 
                 c1 = *p++; c2 = *p++; size = c1 | c2<<8;
+                c1 = *p++; c2 = *p++; size |= (c1 | c2<<8) << 16;
                 printf("[%d] TextLine offset = %ld, indent = %d, height = %ld\n", obj-paint, offset, indent, height);
 #if 0
                 printf("  offset = %ld\n", offset);
@@ -369,7 +449,7 @@ void PrintBeginFrame(Frame *frame)
         PushValue(p, 0);        /* subsequently filled in with height(2) */
         *p++ = frame->style;    /* frame's background style */
         *p++ = frame->border;   /* frame's border style */
-        PushValue(p, 0);        /* subsequently filled in with length */
+        PushLong(p, 0);         /* subsequently filled in with length */
     }
 }
 
@@ -386,12 +466,12 @@ void PrintFrameLength(Frame *frame)
 
      /* write the length field in frame's header */
         p = paint + frame->info + 15;
-        PushValue(p, frame->length);
+        PushLong(p, frame->length);
 
      /* write the size field after frame's contents */
-        p = MakeRoom(2);
+        p = MakeRoom(SIZELEN);
         len = p - paint - frame->info;
-        PushValue(p, len);
+        PushLong(p, len);
     }
 }
 
@@ -406,8 +486,8 @@ void PrintEndFrame(Frame *frame)
         p = MakeRoom(FRAMENDLEN);
         len = p - (paint + frame->info);
         *p++ = END_FRAME;
-        PushValue(p, len);
-        PushValue(p, FRAMENDLEN-2);
+        PushLong(p, len);
+        PushLong(p, FRAMENDLEN-SIZELEN);
     }
 }
 
@@ -644,13 +724,13 @@ void EndOfLine(int indent)
             paint[paintStartLine + 9] = (height & 0xFF);
             paint[paintStartLine + 10] = (height >> 8) & 0xFF;
 
-            p = MakeRoom(3);
+            p = MakeRoom(1 + SIZELEN);
             *p++ = '\0';  /* push end of elements marker */
 
             /* and write frame length */
 
             n = p - paint - paintStartLine;
-            PushValue(p, n);
+            PushLong(p, n);
         }
 
         PixOffset += above + below;
@@ -866,8 +946,8 @@ void WrapIfNeeded(Frame **frames, int align, int emph, int font, int WrapLeftMar
 
     LineBuf[LineLen] = '\0';  /* debug*/
     WordLen = LineLen - WordStart;
-    WordWidth = XTextWidth(Fonts[font], LineBuf+WordStart, WordLen);
-    space = XTextWidth(Fonts[font], " ", 1);    /* width of a space char */
+    WordWidth = WIDTH(font, LineBuf+WordStart, WordLen);
+    space = CHWIDTH(font);    /* width of a space char */
     line = LineSpacing[font];                   /* height of a line */
 
     if (WordWidth > min_width)      /* for tables */
@@ -946,7 +1026,7 @@ void FlushLine(int linebreak, Frame **frames, int align, int emph, int font, int
     if (preformatted)
     {
         WordLen = LineLen - WordStart;
-        LineWidth = XTextWidth(Fonts[font], LineBuf+WordStart, WordLen);
+        LineWidth = WIDTH(font, LineBuf+WordStart, WordLen);
     }
     else if (LineLen > 0)
         WrapIfNeeded(frames, align, emph, font, WrapLeftMargin, WrapRightMargin);
@@ -1030,8 +1110,9 @@ void SwallowAttributes(void)
 
 int RecogniseTag(void)
 {
-    int c, len;
+    int len;
     char *s;
+    struct tag *tp;
 
     s = bufptr;
 
@@ -1051,363 +1132,11 @@ int RecogniseTag(void)
     TagLen = s - bufptr;        /* how far to next char after tag name */
     len = TagLen - EndTag - 1;  /* number of chars in tag name itself */
     s -= len;
-    c = tolower(*s);
 
-    if (isalpha(c))
+    if (len > 0 && (tp = LookupTag(s, len)))
     {
-        if (c == 'a')
-        {
-            if (len == 1 && strncasecmp(s, "a", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_ANCHOR;
-            }
-
-            if (len == 5 && strncasecmp(s, "added", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_ADDED;
-            }
-
-            if (len == 7 && strncasecmp(s, "address", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_ADDRESS;
-            }
-
-            if (len == 8 && strncasecmp(s, "abstract", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_ABSTRACT;
-            }
-        }
-        else if (c == 'b')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_BOLD;
-            }
-
-            if (len == 2 && strncasecmp(s, "br", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_BR;
-            }
-
-            if (len == 4 && strncasecmp(s, "body", len) == 0)
-            {
-                TokenClass = EN_MAIN;
-                return TAG_BODY;
-            }
-
-            if (len == 10 && strncasecmp(s, "blockquote", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_QUOTE;
-            }
-        }
-        else if (c == 'c')
-        {
-            if (len == 4)
-            {
-                if (strncasecmp(s, "code", len) == 0)
-                {
-                    TokenClass = EN_TEXT;
-                    return TAG_CODE;
-                }
-
-                if (strncasecmp(s, "cite", len) == 0)
-                {
-                    TokenClass = EN_TEXT;
-                    return TAG_CITE;
-                }
-            }
-        }
-        else if (c == 'd')
-        {
-            if (len == 3 && strncasecmp(s, "dfn", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_DFN;
-            }
-
-            if (len != 2)
-                return 0;
-
-            if (strncasecmp(s, "dl", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_DL;
-            }
-
-            if (strncasecmp(s, "dt", len) == 0)
-            {
-                TokenClass = EL_DEFLIST;
-                return TAG_DT;
-            }
-
-            if (strncasecmp(s, "dd", len) == 0)
-            {
-                TokenClass = EL_DEFLIST;
-                return TAG_DD;
-            }
-        }
-        else if (c == 'e')
-        {
-            if (len == 2 && strncasecmp(s, "em", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_EM;
-            }
-        }
-        else if (c == 'f')
-        {
-            if (len == 3 && strncasecmp(s, "fig", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_FIG;
-            }
-        }
-        else if (c == 'h')
-        {
-            if (len == 4 && strncasecmp(s, "head", len) == 0)
-            {
-                TokenClass = EN_SETUP;
-                return TAG_HEAD;
-            }
-
-            if (len != 2)
-                return 0;
-
-            TokenClass = EN_HEADER;
-            c = tolower(s[1]);
-
-            switch (c)
-            {
-                case '1':
-                    return TAG_H1;
-                case '2':
-                    return TAG_H2;
-                case '3':
-                    return TAG_H3;
-                case '4':
-                    return TAG_H4;
-                case '5':
-                    return TAG_H5;
-                case '6':
-                    return TAG_H6;
-                case 'r':
-                    TokenClass = EN_BLOCK;
-                    return TAG_HR;
-            }
-        }
-        else if (c == 'i')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_ITALIC;
-            }
-
-            if (len == 3 && strncasecmp(s, "img", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_IMG;
-            }
-
-            if (len == 5 && strncasecmp(s, "input", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_INPUT;
-            }
-
-            if (len == 7 && strncasecmp(s, "isindex", len) == 0)
-            {
-                TokenClass = EN_SETUP;
-                return TAG_ISINDEX;
-            }
-        }
-        else if (c == 'k')
-        {
-            if (len == 3 && strncasecmp(s, "kbd", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_KBD;
-            }
-        }
-        else if (c == 'l')
-        {
-            if (len == 2 && strncasecmp(s, "li", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_LI;
-            }
-        }
-        else if (c == 'm')
-        {
-            if (len == 4 && strncasecmp(s, "math", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_MATH;
-            }
-
-            if (len == 6 && strncasecmp(s, "margin", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_MARGIN;
-            }
-        }
-        else if (c == 'o')
-        {
-            if (len == 2 && strncasecmp(s, "ol", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_OL;
-            }
-
-            if (len == 6 && strncasecmp(s, "option", len) == 0)
-            {
-                TokenClass = EN_TEXT;  /* kludge for error recovery */
-                return TAG_OPTION;
-            }
-        }
-        else if (c == 'p')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_P;
-            }
-
-            if (len == 3 && strncasecmp(s, "pre", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_PRE;
-            }
-        }
-        else if (c == 'q')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_Q;
-            }
-
-            if (len == 5 && strncasecmp(s, "quote", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_QUOTE;
-            }
-        }
-        else if (c == 'r')
-        {
-            if (len == 7 && strncasecmp(s, "removed", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_REMOVED;
-            }
-        }
-        else if (c == 's')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_STRIKE;
-            }
-
-            if (len == 4 && strncasecmp(s, "samp", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_SAMP;
-            }
-
-            if (len == 6 && strncasecmp(s, "strong", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_STRONG;
-            }
-
-            if (len == 6 && strncasecmp(s, "select", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_SELECT;
-            }
-        }
-        else if (c == 't')
-        {
-            if (len == 5 && strncasecmp(s, "title", len) == 0)
-            {
-                TokenClass = EN_SETUP;
-                return TAG_TITLE;
-            }
-
-            if (len == 2 && strncasecmp(s, "tt", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_TT;
-            }
-
-            if (len == 2 && strncasecmp(s, "tr", len) == 0)
-            {
-                TokenClass = EN_TABLE;
-                return TAG_TR;
-            }
-
-            if (len == 2 && strncasecmp(s, "th", len) == 0)
-            {
-                TokenClass = EN_TABLE;
-                return TAG_TH;
-            }
-
-            if (len == 2 && strncasecmp(s, "td", len) == 0)
-            {
-                TokenClass = EN_TABLE;
-                return TAG_TD;
-            }
-
-            if (len == 5 && strncasecmp(s, "table", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_TABLE;
-            }
-
-            if (len == 8 && strncasecmp(s, "textarea", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_TEXTAREA;
-            }
-        }
-        else if (c == 'u')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_UNDERLINE;
-            }
-
-            if (len == 2 && strncasecmp(s, "ul", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_UL;
-            }
-        }
-        else if (c == 'v')
-        {
-            if (len == 3 && strncasecmp(s, "var", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_VAR;
-            }
-        }
-        else if (c == 'x')
-        {
-            if (len == 3 && strncasecmp(s, "xmp", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_PRE;
-            }
-        }
+        TokenClass = tp->class;
+        return tp->code;
     }
 
     TokenClass = EN_UNKNOWN;
@@ -1485,6 +1214,84 @@ int GetToken(void)
     return Token;
 }
 
+/*
+ Returns pointer to first char at or after s that GetToken() would
+ not return as an ordinary PCDATA char, i.e. '<', '&', whitespace,
+ control chars, chars with the top bit set or the terminating null.
+ When compiled with optimisation for SSE2 this tests 16 chars at a
+ time, stepping a char at a time near the end of a page so as never
+ to read into an unmapped page beyond the end of the buffer. The
+ intrinsics are much slower than the plain loop without -O.
+*/
+
+#define PlainChar(c) ((unsigned char)((c) - 0x21) <= 0x5E && (c) != '<' && (c) != '&')
+
+static char *ScanText(char *s)
+{
+#ifdef SSE2_SCAN
+    int mask;
+    __m128i v, space, lt, amp;
+
+    space = _mm_set1_epi8(0x21);
+    lt = _mm_set1_epi8('<');
+    amp = _mm_set1_epi8('&');
+
+    for (;;)
+    {
+        if (((unsigned long)s & 4095) > 4096 - 16)
+        {
+            if (!PlainChar(*s))
+                return s;
+
+            ++s;
+            continue;
+        }
+
+        v = _mm_loadu_si128((__m128i *)s);
+
+     /* signed compare catches both controls and top bit set */
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space),
+                   _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp))));
+
+        if (mask)
+            return s + __builtin_ctz(mask);
+
+        s += 16;
+    }
+#else
+    while (PlainChar(*s))
+        ++s;
+
+    return s;
+#endif
+}
+
+/*
+ Called after GetToken() returns PCDATA to append it to LineBuf
+ together with the rest of the run of plain text that follows,
+ thereby avoiding a call to GetToken() for each char in a word.
+ As before, text which doesn't fit in LineBuf is discarded.
+*/
+
+static void CopyText(void)
+{
+    int n;
+    char *s;
+
+    if (LineLen < LBUFSIZE - 1)
+        LineBuf[LineLen++] = TokenValue;
+
+    s = ScanText(bufptr);
+    n = s - bufptr;
+
+    if (n > LBUFSIZE - 1 - LineLen)
+        n = LBUFSIZE - 1 - LineLen;
+
+    memcpy(LineBuf + LineLen, bufptr, n);
+    LineLen += n;
+    bufptr = s;
+}
+
 void ParseTitle(int implied, Frame **frames)
 {
     if (EndTag)
@@ -1535,8 +1342,7 @@ void ParseTitle(int implied, Frame **frames)
             break;
         }
 
-        if (LineLen < LBUFSIZE - 1)
-            LineBuf[LineLen++] = TokenValue;
+        CopyText();
     }    
 
     LineBuf[LineLen] = '\0';
@@ -1659,7 +1465,10 @@ char *ParseValue(int *len)
         c = *bufptr;
 
         if (c == '\0')
+        {
+            *len = 0;   /* as value was cut short */
             return 0;
+        }
 
         if (delim)
         {
@@ -1828,13 +1637,15 @@ ParseTextAreaAttrs(int *type, char **name, int *nlen,
 
         if (n == 4 && strncasecmp(attr, "rows", n) == 0)
         {
-            sscanf(attrval, "%d", rows);
+            if (attrval)
+                sscanf(attrval, "%d", rows);
             continue;
         }
 
         if (n == 4 && strncasecmp(attr, "cols", n) == 0)
         {
-            sscanf(attrval, "%d", cols);
+            if (attrval)
+                sscanf(attrval, "%d", cols);
             continue;
         }
 
@@ -1916,7 +1727,8 @@ ParseInputAttrs(int *type, char **name, int *nlen,
 
         if (n == 4 && strncasecmp(attr, "size", n) == 0)
         {
-            sscanf(attrval, "%d", size);
+            if (attrval)
+                sscanf(attrval, "%d", size);
             continue;
         }
 
@@ -1968,13 +1780,15 @@ ParseCellAttrs(int *rowspan, int *colspan, int *align, int *nowrap)
 
         if (n == 7 && strncasecmp(attr, "rowspan", n) == 0)
         {
-            sscanf(attrval, "%d", rowspan);
+            if (attrval)
+                sscanf(attrval, "%d", rowspan);
             continue;
         }
 
         if (n == 7 && strncasecmp(attr, "colspan", n) == 0)
         {
-            sscanf(attrval, "%d", colspan);
+            if (attrval)
+                sscanf(attrval, "%d", colspan);
             continue;
         }
 
@@ -2107,8 +1921,7 @@ void ParseOption(int implied, Frame **frames, Field *field, int font)
 
         if (Token == PCDATA)
         {
-            if (LineLen < LBUFSIZE - 1)
-                LineBuf[LineLen++] = TokenValue;
+            CopyText();
 
             continue;
         }
@@ -2239,7 +2052,7 @@ void ParseEmph(Frame **frames, int align, int emph, int font, int left, int righ
         case TAG_MARGIN:
             SwallowAttributes();
             font = IDX_H2FONT;
-            indent = XTextWidth(Fonts[IDX_NORMALFONT], "mmm", 3);
+            indent = WIDTH(IDX_NORMALFONT, "mmm", 3);
             left += indent;
             right -= indent;
 
@@ -2484,7 +2297,7 @@ void ParseEmph(Frame **frames, int align, int emph, int font, int left, int righ
     if (ThisToken == TAG_Q)
     {
             PrintSeqText(frames, IDX_NORMALFONT, "\253");  /* open quote char  */
-            Here += XTextWidth(Fonts[IDX_NORMALFONT], "\253", 1);
+            Here += WIDTH(IDX_NORMALFONT, "\253", 1);
     }
 
     for (;;)
@@ -2555,8 +2368,7 @@ void ParseEmph(Frame **frames, int align, int emph, int font, int left, int righ
 
         /* must be PCDATA */
 
-        if (LineLen < LBUFSIZE - 1)
-            LineBuf[LineLen++] = TokenValue;
+        CopyText();
     }    
 
     LineBuf[LineLen] = '\0';
@@ -2565,7 +2377,7 @@ void ParseEmph(Frame **frames, int align, int emph, int font, int left, int righ
     if (ThisToken == TAG_Q)
     {
         PrintSeqText(frames, IDX_NORMALFONT, "\273");  /* close quote char  */
-        Here += XTextWidth(Fonts[IDX_NORMALFONT], "\273", 1);
+        Here += WIDTH(IDX_NORMALFONT, "\273", 1);
     }
 
     if (ThisToken == TAG_MARGIN)
@@ -2684,8 +2496,7 @@ void ParseHeader(Frame **frames, int align, int left, int right)
 
         /* must be PCDATA */
 
-        if (LineLen < LBUFSIZE - 1)
-            LineBuf[LineLen++] = TokenValue;
+        CopyText();
     }    
 
     LineBuf[LineLen] = '\0';
@@ -2781,8 +2592,7 @@ void ParsePara(int implied, Frame **frames, int align, int font, int left, int r
 
         /* must be PCDATA */
 
-        if (LineLen < LBUFSIZE - 1)
-            LineBuf[LineLen++] = TokenValue;
+        CopyText();
     }    
 
     LineBuf[LineLen] = '\0';
@@ -2845,6 +2655,7 @@ void ItemNumber(char *buf, int depth, int n)
 void ParseUL(int implied, Frame **frames, int depth, int align, int left, int right);
 void ParseOL(int implied, Frame **frames, int depth, int align, int left, int right);
 void ParseDL(int implied, Frame **frames, int left, int align, int right);
+void ParseTable(int implied, Frame **frames, int left, int right);
 
 void ParseLI(int implied, Frame **frames, int depth, int seq, int align, int left, int right)
 {
@@ -2858,7 +2669,7 @@ void ParseLI(int implied, Frame **frames, int depth, int seq, int align, int lef
         return;
     }
 
-    indent = XTextWidth(Fonts[IDX_NORMALFONT], "mmm", 3);
+    indent = WIDTH(IDX_NORMALFONT, "mmm", 3);
     y = PixOffset;
 
     if (!implied)
@@ -2871,7 +2682,7 @@ void ParseLI(int implied, Frame **frames, int depth, int seq, int align, int lef
         ItemNumber(buf, depth++, seq);
         PrintSeqText(frames, IDX_NORMALFONT, buf);
 
-        w = XTextWidth(Fonts[IDX_NORMALFONT], buf, strlen(buf));
+        w = WIDTH(IDX_NORMALFONT, buf, strlen(buf));
 
         if (w + indent/3 > indent - 4)
             indent = 4 + w + indent/3;
@@ -3202,8 +3013,7 @@ void ParseDT(int implied, Frame **frames, int align, int left, int right)
 
         /* must be PCDATA */
 
-        if (LineLen < LBUFSIZE - 1)
-            LineBuf[LineLen++] = TokenValue;
+        CopyText();
     }    
 
     LineBuf[LineLen] = '\0';
@@ -3351,7 +3161,7 @@ void ParseDL(int implied, Frame **frames, int align, int left, int right)
         SwallowAttributes();
 
     LastToken = TAG_DL;
-    indent = XTextWidth(Fonts[IDX_NORMALFONT], "mm", 2);
+    indent = WIDTH(IDX_NORMALFONT, "mm", 2);
 
     for (;;)
     {
@@ -3581,8 +3391,7 @@ void ParsePRE(int implied, Frame **frames, int left, int right)
             continue;
         }
 #endif
-        if (LineLen < LBUFSIZE - 1)
-            LineBuf[LineLen++] = TokenValue;
+        CopyText();
     }    
 
     LineBuf[LineLen] = '\0';
@@ -3590,21 +3399,138 @@ void ParsePRE(int implied, Frame **frames, int left, int right)
     preformatted = 0;
 }
 
+/*
+ Tables are parsed twice, first to measure the min/max widths of
+ each column and then to lay out the cells. A table nested in a
+ cell is measured along with the enclosing table, and its column
+ widths are noted so that when the enclosing table is laid out
+ the nested one can go straight to its second pass. Otherwise each
+ level of nesting would double the work.
+*/
+
+typedef struct measured_struct
+    {
+        struct measured_struct *next;
+        char *start;            /* where table starts in document */
+        ColumnWidth *widths;    /* its measured column widths */
+    } Measured;
+
+#define MHASHSIZE 64
+
+static Measured *measured[MHASHSIZE];
+static int TableDepth;
+
+static ColumnWidth *NewWidths(int m)
+{
+    ColumnWidth *widths;
+
+    widths = (ColumnWidth *)calloc(m + 1, sizeof(ColumnWidth));
+
+    if (widths == NULL)
+    {
+        fprintf(stderr, "Panic: can't allocate table column widths\n");
+        exit(1);
+    }
+
+    COLS(widths) = 0;               /* current number of columns */
+    MAXCOLS(widths) = m;            /* space currently allocated */
+    return widths;
+}
+
+/* grow array to m columns, zeroing the new elements */
+
+static ColumnWidth *GrowWidths(ColumnWidth *widths, int m)
+{
+    int i;
+
+    i = MAXCOLS(widths);
+    widths = (ColumnWidth *)realloc(widths, (m + 1) * sizeof(ColumnWidth));
+
+    if (widths == NULL)
+    {
+        fprintf(stderr, "Panic: can't grow table to %d columns\n", m);
+        exit(1);
+    }
+
+    memset(widths + i + 1, 0, (m - i) * sizeof(ColumnWidth));
+    MAXCOLS(widths) = m;
+    return widths;
+}
+
+static void NoteMeasured(char *start, ColumnWidth *widths)
+{
+    Measured *mp;
+    int n;
+
+    n = ((unsigned long)start >> 2) % MHASHSIZE;
+    mp = (Measured *)malloc(sizeof(Measured));
+
+    if (mp == NULL)
+        return;
+
+    mp->start = start;
+    mp->widths = NewWidths(MAXCOLS(widths));
+    memcpy(mp->widths, widths, (MAXCOLS(widths) + 1) * sizeof(ColumnWidth));
+    mp->next = measured[n];
+    measured[n] = mp;
+}
+
+static ColumnWidth *FindMeasured(char *start)
+{
+    Measured *mp;
+    ColumnWidth *widths;
+    int i;
+
+    for (mp = measured[((unsigned long)start >> 2) % MHASHSIZE]; mp; mp = mp->next)
+    {
+        if (mp->start == start)
+        {
+            widths = NewWidths(MAXCOLS(mp->widths));
+            memcpy(widths, mp->widths, (MAXCOLS(widths) + 1) * sizeof(ColumnWidth));
+
+            for (i = 0; i <= MAXCOLS(widths); ++i)
+                widths[i].rows = 0;
+
+            return widths;
+        }
+    }
+
+    return NULL;
+}
+
+static void FreeMeasured(void)
+{
+    Measured *mp;
+    int i;
+
+    for (i = 0; i < MHASHSIZE; ++i)
+    {
+        while ((mp = measured[i]) != NULL)
+        {
+            measured[i] = mp->next;
+            free(mp->widths);
+            free(mp);
+        }
+    }
+}
+
 /* tag is TAG_TH or TAG_TD, col is column number starting from 1 upwards, returns cell height */
 long ParseTableCell(int implied, Frame **frames, int row, Frame **cells,
-          int border, ColumnWidth *widths, int *pcol, int tag, int left, int right)
+          int border, ColumnWidth **pwidths, int *pcol, int tag, int left, int right)
 {
     int align, nowrap, col, rowspan, colspan, m, prev_width, font;
     long cellTop, cellHeight;
     Frame *frame, *newframes;
+    ColumnWidth *widths;
 
     if (EndTag)
     {
         SwallowAttributes();
-        return;
+        return 0;
     }
 
     newframes = NULL;
+    widths = *pwidths;
     col = *pcol;
 
     align = ALIGN_CENTER;
@@ -3722,6 +3648,12 @@ long ParseTableCell(int implied, Frame **frames, int row, Frame **cells,
             continue;
         }
 
+        if (Token == TAG_TABLE && !EndTag)
+        {
+            ParseTable(0, &newframes, left, right);
+            continue;
+        }
+
      /* unexpected tag so terminate element */
 
         UnGetToken();
@@ -3738,16 +3670,8 @@ long ParseTableCell(int implied, Frame **frames, int row, Frame **cells,
         while (col + colspan - 1> m)
            m = m << 1;
 
-        widths = (ColumnWidth *)realloc(widths, (m + 1) * sizeof(ColumnWidth));
-        MAXCOLS(widths) = m;
-
-        while (m >= col)   /* zero widths for newly allocated elements */
-        {
-            widths[m].min = 0;
-            widths[m].max = 0;
-            widths[m].rows = 0;
-            --m;
-        }
+        widths = GrowWidths(widths, m);
+        *pwidths = widths;
     }
 
     if (html_width > left)
@@ -3817,11 +3741,12 @@ void DummyCell(Frame **frames, int row, Frame **cells,
 }
 
 void ParseTableRow(int implied, Frame **frames, int row,
-        Frame **cells, int border, ColumnWidth *widths, int left, int right)
+        Frame **cells, int border, ColumnWidth **pwidths, int left, int right)
 {
     int cols = 1;
     long rowTop, rowHeight, cellHeight;
     char *row_bufptr;
+    ColumnWidth *widths;
 
     if (EndTag)
     {
@@ -3839,9 +3764,10 @@ void ParseTableRow(int implied, Frame **frames, int row,
     for (;;)
     {
         PixOffset = rowTop;
+        widths = *pwidths;  /* may be moved when cells are added */
 
         /* if this cell spans more than one row */
-        if (widths[cols].rows > 0)
+        if (cols <= MAXCOLS(widths) && widths[cols].rows > 0)
         {
             widths[cols].rows -= 1;  /* decrement span count */
 
@@ -3877,7 +3803,7 @@ void ParseTableRow(int implied, Frame **frames, int row,
 
         if (Token == TAG_TH)
         {
-            cellHeight = ParseTableCell(0, frames, row, cells, border, widths, &cols, TAG_TH, left, right);
+            cellHeight = ParseTableCell(0, frames, row, cells, border, pwidths, &cols, TAG_TH, left, right);
 
             if (cellHeight > rowHeight)
                 rowHeight = cellHeight;
@@ -3886,7 +3812,7 @@ void ParseTableRow(int implied, Frame **frames, int row,
 
         if (Token == TAG_TD)
         {
-            cellHeight = ParseTableCell(0, frames, row, cells, border, widths, &cols, TAG_TD, left, right);
+            cellHeight = ParseTableCell(0, frames, row, cells, border, pwidths, &cols, TAG_TD, left, right);
 
             if (cellHeight > rowHeight)
                 rowHeight = cellHeight;
@@ -3909,7 +3835,7 @@ void ParseTableRow(int implied, Frame **frames, int row,
             }
 
             UnGetToken();
-            cellHeight = ParseTableCell(1, frames, row, cells, border, widths, &cols, TAG_TD, left, right);
+            cellHeight = ParseTableCell(1, frames, row, cells, border, pwidths, &cols, TAG_TD, left, right);
 
             if (cellHeight > rowHeight)
                 rowHeight = cellHeight;
@@ -3922,6 +3848,8 @@ void ParseTableRow(int implied, Frame **frames, int row,
         break;
     }    
 
+    widths = *pwidths;
+
     if (!prepass && cols <= COLS(widths))
         DummyCell(frames, row, cells, border, widths, cols);
 
@@ -3934,6 +3862,7 @@ void ParseTableRow(int implied, Frame **frames, int row,
 void ParseTable(int implied, Frame **frames, int left, int right)
 {
     int row, cols, border, i, w, W, x, min, max, spare, prev_width;
+    int nested, cell_min, cell_indent;
     long table_offset;
     char *table_bufptr;
     Frame *cells;
@@ -3952,25 +3881,23 @@ void ParseTable(int implied, Frame **frames, int left, int right)
     prev_width = html_width;
     Here = left;
 
-    widths = (ColumnWidth *)malloc((NCOLS + 1) * sizeof(ColumnWidth));
+ /* nested tables save enclosing cell's measurements */
 
-    COLS(widths) = 0;               /* current number of columns */
-    MAXCOLS(widths) = NCOLS;        /* space currently allocated */
-    widths[0].rows = 0;
+    nested = prepass;
+    cell_min = min_width;
+    cell_indent = list_indent;
+    ++TableDepth;
 
-    for (i = NCOLS; i > 0; --i)     /* zero widths for allocated elements */
-    {
-        widths[i].min = 0;
-        widths[i].max = 0;
-        widths[i].rows = 0;
-    }
-
-    prepass = 1;
     table_bufptr = bufptr;          /* note parse position for second pass */
     table_offset = PixOffset;
 
- draw_table:
+    if (!prepass && (widths = FindMeasured(table_bufptr)) != NULL)
+        goto assign_widths;         /* measured with enclosing table */
 
+    widths = NewWidths(NCOLS);
+    prepass = 1;
+
+ draw_table:
     row = 0;
     cells = NULL;
 
@@ -3999,7 +3926,7 @@ void ParseTable(int implied, Frame **frames, int left, int right)
         if (Token == TAG_TR)
         {
             ++row;
-            ParseTableRow(0, frames, row, &cells, border, widths, left, right);
+            ParseTableRow(0, frames, row, &cells, border, &widths, left, right);
             continue;
         }
 
@@ -4014,7 +3941,7 @@ void ParseTable(int implied, Frame **frames, int left, int right)
 
             UnGetToken();
             ++row;
-            ParseTableRow(1, frames, row, &cells, border, widths, left, right);
+            ParseTableRow(1, frames, row, &cells, border, &widths, left, right);
             continue;
         }
 
@@ -4026,6 +3953,14 @@ void ParseTable(int implied, Frame **frames, int left, int right)
 
     if (prepass)   /* assign actual column widths */
     {
+        if (nested)  /* enclosing table is being measured */
+        {
+            NoteMeasured(table_bufptr, widths);
+            goto measured;
+        }
+
+ assign_widths:
+
         for (i = 1, min = 3, max = 3, W = 0; i <= COLS(widths); ++i)
         {
             min += 7 + widths[i].min;
@@ -4079,18 +4014,101 @@ void ParseTable(int implied, Frame **frames, int left, int right)
         goto draw_table;
     }
 
+ measured:
+
+    if (nested)  /* table's widths count towards enclosing cell's */
+    {
+        for (i = 1, min = 3, max = 3; i <= COLS(widths); ++i)
+        {
+            min += 7 + widths[i].min;
+            max += 7 + widths[i].max;
+        }
+
+        min_width = (min > cell_min ? min : cell_min);
+        list_indent = cell_indent;
+    }
+
     free(widths);   /* free column widths */
     Here = left;
     PixOffset += LineSpacing[IDX_H1FONT]/2;
 
+    if (--TableDepth == 0)
+        FreeMeasured();
+
  /* restore previous value of html_width as needed */
     w = left + max;
     html_width = (w < prev_width ? prev_width : w);
 }
 
+/*
+   Large documents are laid out a slice at a time, see LayoutPart()
+   in display.c, with the buffer cut short by a '\0' at the end of
+   each slice. The parser's state at the start of each top level
+   block of the body is noted, so that ResumeHTML() can discard the
+   paint stream from the start of the last block reached, which was
+   cut short, and carry on from there rather than parse the whole
+   document again. Blocks can't be resumed from while a line, frame
+   or figure is unfinished, in which case an earlier one is used.
+   Nor can those at or beyond the cut, as a tag cut short by the
+   '\0' is read on past it and the layout that follows is wrong.
+*/
+
+#define MAXRESUMEFORMS  8
+
+static struct
+{
+    int valid;
+    char *bufptr;
+    long offset;                /* PixOffset */
+    long paintlen;
+    int html_width, Here, font, preformatted, error, IsIndex;
+    long figEnd, LastLIoffset;
+    Form *form;
+    int nforms;
+    Form *forms[MAXRESUMEFORMS];
+    int fields[MAXRESUMEFORMS]; /* field counts of forms */
+} resume;
+
+static void SaveResume(char *start, Frame *frames)
+{
+    int n;
+    Form *fp;
+
+    if (frames || paintStartLine >= 0 || figure || start_figure || prepass)
+        return;
+
+    if (LayoutEnd && start >= LayoutEnd)
+        return;
+
+    for (n = 0, fp = forms; fp != NULL; fp = fp->next, ++n)
+    {
+        if (n == MAXRESUMEFORMS)
+            return;
+
+        resume.forms[n] = fp;
+        resume.fields[n] = fp->i;
+    }
+
+    resume.nforms = n;
+    resume.bufptr = start;
+    resume.offset = PixOffset;
+    resume.paintlen = paintlen;
+    resume.html_width = html_width;
+    resume.Here = Here;
+    resume.font = font;
+    resume.preformatted = preformatted;
+    resume.error = error;
+    resume.IsIndex = IsIndex;
+    resume.figEnd = figEnd;
+    resume.LastLIoffset = LastLIoffset;
+    resume.form = form;
+    resume.valid = 1;
+}
+
 void ParseBody(int implied, Frame **frames, int left, int right)
 {
     int indent, margin;
+    char *start;
 
     if (EndTag)
     {
@@ -4098,15 +4116,23 @@ void ParseBody(int implied, Frame **frames, int left, int right)
         return;
     }
 
-    indent = margin = XTextWidth(Fonts[IDX_NORMALFONT], "mmm", 2);
+    indent = margin = WIDTH(IDX_NORMALFONT, "mmm", 2);
 
     if (!implied)
         SwallowAttributes();
 
     for (;;)
     {
+        start = bufptr;
+
         while (GetToken() == WHITESPACE);
 
+        if (Token != ENDDATA)
+        {
+            LastBlock = PixOffset;
+            SaveResume(start, *frames);
+        }
+
         if (Token == TAG_BODY && EndTag)
         {
             SwallowAttributes();
@@ -4275,28 +4301,69 @@ void ParseBody(int implied, Frame **frames, int left, int right)
     }
 }
 
+/* finish off the layout begun by ParseHTML() or ResumeHTML(),
+   where the paint stream before from is as it was last time */
+
+static long EndHTML(Frame **frames, int *width, long from)
+{
+    Byte *p;
+
+    EndOfLine(0);  /* in case a line was left open where the buffer was cut */
+    FlushFrames(1, frames); /* flush remaining end of frames */
+    *width = html_width;
+
+ /* initialise background frame */
+
+    background.next = NULL;
+    background.child = NULL;
+    background.top = paint + FRAMESTLEN;
+    background.offset = 0;
+    background.indent = 0;
+    background.height = PixOffset;
+    background.width = html_width;
+    background.info = 0;
+    background.length = paintlen - FRAMESTLEN;
+    background.style = 0;
+    background.border = 0;
+
+ /* and fill in begin frame object at start of paint buffer */
+
+    p = paint;
+    *p++ = BEGIN_FRAME;
+    PushValue(p, background.offset & 0xFFFF);
+    PushValue(p, (background.offset >> 16) & 0xFFFF);
+    PushValue(p, background.indent);
+    PushValue(p, background.width);
+    PushLong(p, background.height);
+    *p++ = background.style;
+    *p++ = background.border;
+    PushLong(p, background.length);
+
+    TopObject = paint;   /* obsolete */
+    IndexPaint(from);    /* for seeking, see html.c */
+
+    return PixOffset;
+}
+
 long ParseHTML(int *width)
 {
     int c, WordLen;
-    Byte *p;
     Frame *frames;
 
-    PixOffset = 0;
+    PixOffset = LastBlock = 0;
     LastBufPtr = bufptr = buffer+hdrlen;
     error = prepass = preformatted = 0;
     paintlen = 0;
     IsIndex = 0;
     start_figure = figure = 0;
-    html_width = WinWidth;
+    html_width = layout_width = WinWidth;
     font = paintStartLine = -1;
     frames = NULL;
     form = NULL;
+    resume.valid = 0;
 
     if (paintbufsize == 0)
-    {
-        paintbufsize = 8192;
-        paint = (Byte *)malloc(paintbufsize);
-    }
+        NewPaint();
 
  /* Reserve space for background's begin frame object
     which is needed to simply display and scrolling routines */
@@ -4334,37 +4401,44 @@ long ParseHTML(int *width)
         ParseBody(1, &frames, MININDENT, MAXMARGIN);
     }
 
-    FlushFrames(1, &frames); /* flush remaining end of frames */
-    *width = html_width;
-
- /* initialise background frame */
-
-    background.next = NULL;
-    background.child = NULL;
-    background.top = paint + FRAMESTLEN;
-    background.offset = 0;
-    background.indent = 0;
-    background.height = PixOffset;
-    background.width = html_width;
-    background.info = 0;
-    background.length = paintlen - FRAMESTLEN;
-    background.style = 0;
-    background.border = 0;
+    return EndHTML(&frames, width, 0);
+}
 
- /* and fill in begin frame object at start of paint buffer */
+/* carry on laying out the document given by the last ParseHTML()
+   from where it or the last ResumeHTML() stopped, see above. The
+   caller sets new_form to 0 so that fields are reused by number */
 
-    p = paint;
-    *p++ = BEGIN_FRAME;
-    PushValue(p, background.offset & 0xFFFF);
-    PushValue(p, (background.offset >> 16) & 0xFFFF);
-    PushValue(p, background.indent);
-    PushValue(p, background.width);
-    PushValue(p, background.height);
-    *p++ = background.style;
-    *p++ = background.border;
-    PushValue(p, background.length);
+long ResumeHTML(int *width)
+{
+    int i;
+    long from;
+    Frame *frames;
 
-    TopObject = paint;   /* obsolete */
+    if (!resume.valid)
+        return ParseHTML(width);
+
+    LastBufPtr = bufptr = resume.bufptr;
+    PixOffset = LastBlock = resume.offset;
+    paintlen = from = resume.paintlen;
+    html_width = resume.html_width;
+    Here = resume.Here;
+    font = resume.font;
+    preformatted = resume.preformatted;
+    error = resume.error;
+    IsIndex = resume.IsIndex;
+    figEnd = resume.figEnd;
+    LastLIoffset = resume.LastLIoffset;
+    form = resume.form;
+
+    for (i = 0; i < resume.nforms; ++i)
+        resume.forms[i]->i = resume.fields[i];
+
+    paintStartLine = -1;
+    start_figure = figure = 0;
+    prepass = 0;
+    EndTag = 0;
+    frames = NULL;
 
-    return PixOffset;
+    ParseBody(1, &frames, MININDENT, MAXMARGIN);
+    return EndHTML(&frames, width, from);
 }
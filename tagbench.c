@@ -0,0 +1,163 @@
+/* tagbench.c - times the tag lookup in tags.c
+
+    tagbench [-r reps] [-c] [-v] files...
+
+The tag names are picked out of the files as RecogniseTag() does, and
+each is then looked up reps times with LookupTag() and the overall
+rate given in millions of tags/s. With -c the names are instead found
+by testing them with strncasecmp() against each tag starting with the
+same letter in turn, as the cascade of if statements that RecogniseTag()
+used before tags.c did. With -v the number of tags and a sum of the
+codes found is given, so that the two methods can be compared.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include "www.h"
+
+extern struct tag HTMLTags[];
+
+static struct tag *letters[26][32];  /* tags by first letter for -c */
+
+static void InitLetters(void)
+{
+    int i, n;
+    struct tag *tp;
+
+    for (tp = HTMLTags; tp->name; ++tp)
+    {
+        i = tp->name[0] - 'a';
+
+        for (n = 0; letters[i][n]; ++n);
+
+        letters[i][n] = tp;
+    }
+}
+
+static struct tag *ScanTag(char *s, int len)
+{
+    struct tag **tpp;
+    int c;
+
+    c = tolower(*s) - 'a';
+
+    if (c < 0 || c >= 26)
+        return NULL;
+
+    for (tpp = letters[c]; *tpp; ++tpp)
+    {
+        if ((*tpp)->len == len && strncasecmp(s, (*tpp)->name, len) == 0)
+            return *tpp;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i, k, reps, cascade, list, len, ntags, maxtags;
+    long size, sum, found;
+    char *buf, *s, **names;
+    int *lens;
+    struct tag *tp;
+    clock_t t, t0;
+    FILE *fp;
+
+    reps = 100;
+    cascade = list = 0;
+
+    for (k = 1; k < argc && argv[k][0] == '-'; ++k)
+    {
+        if (strcmp(argv[k], "-v") == 0)
+            list = 1;
+        else if (strcmp(argv[k], "-c") == 0)
+            cascade = 1;
+        else if (k + 1 < argc && strcmp(argv[k], "-r") == 0)
+            reps = atoi(argv[++k]);
+        else
+            break;
+    }
+
+    if (k == argc)
+    {
+        fprintf(stderr, "usage: tagbench [-r reps] [-c] [-v] files...\n");
+        return 1;
+    }
+
+    InitTags(HTMLTags);
+    InitLetters();
+
+    if (list)
+        reps = 1;
+
+    buf = malloc(1 << 24);
+    maxtags = 1 << 20;
+    names = (char **)malloc(maxtags * sizeof(char *));
+    lens = (int *)malloc(maxtags * sizeof(int));
+    ntags = 0;
+
+    /* collect the tag names, the files are kept in buf */
+
+    for (s = buf; k < argc; ++k)
+    {
+        if ((fp = fopen(argv[k], "r")) == NULL)
+        {
+            fprintf(stderr, "tagbench: can't load %s\n", argv[k]);
+            continue;
+        }
+
+        size = fread(s, 1, buf + (1 << 24) - s - 1, fp);
+        fclose(fp);
+        s[size] = '\0';
+
+        for (; *s; ++s)
+        {
+            if (*s != '<' || ntags == maxtags)
+                continue;
+
+            if (s[1] == '/')
+                ++s;
+
+            for (len = 0; isalnum(s[1 + len]); ++len);
+
+            if (len > 0)
+            {
+                names[ntags] = s + 1;
+                lens[ntags++] = len;
+            }
+        }
+
+        ++s;
+    }
+
+    sum = found = 0;
+    t0 = clock();
+
+    for (k = 0; k < reps; ++k)
+    {
+        for (i = 0; i < ntags; ++i)
+        {
+            tp = (cascade ? ScanTag(names[i], lens[i]) : LookupTag(names[i], lens[i]));
+
+            if (tp)
+            {
+                sum += tp->code;
+                ++found;
+            }
+        }
+    }
+
+    t = clock() - t0;
+
+    if (list)
+        printf("%d tags, %ld known, code sum %ld\n", ntags, found, sum);
+    else if (t > 0)
+        printf("%ld tags in %.3f s, %.1f million tags/s\n", (long)ntags * reps,
+            (double)t / CLOCKS_PER_SEC, ntags * (double)reps / 1e6 / ((double)t / CLOCKS_PER_SEC));
+
+    return 0;
+}
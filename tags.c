@@ -0,0 +1,66 @@
+/* recognize HTML tag names
+
+The parser calls RecogniseTag() for every '<' in a document, so
+rather than testing the name against each known tag in turn, the
+tag table is installed in a small hash table on startup and a tag
+is found with a single hash of its name. The hash folds case, and
+names in the table are held in lower case so the same folding
+suffices to compare the name with its entry.
+
+The table is passed in by the caller, as tidy and the browser
+recognize slightly different sets of tags.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tags.h"
+
+#define TAGHASHSIZE 128     /* must be a power of 2 */
+
+static struct tag *hashtab[TAGHASHSIZE];
+
+/* hash on length, first and last chars after the manner of gperf,
+   tag names are letters and digits so c|0x20 folds case */
+
+static unsigned hash(char *s, int len)
+{
+    return (len + 9*(s[0] | 0x20) + 5*(s[len-1] | 0x20)) & (TAGHASHSIZE - 1);
+}
+
+/* returns the table entry for the len chars at s or NULL if unknown */
+
+struct tag *LookupTag(char *s, int len)
+{
+    int i;
+    struct tag *tp;
+
+    for (tp = hashtab[hash(s, len)]; tp != NULL; tp = tp->next)
+    {
+        if (tp->len != len)
+            continue;
+
+        for (i = 0; i < len && (s[i] | 0x20) == tp->name[i]; ++i);
+
+        if (i == len)
+            return tp;
+    }
+
+    return NULL;
+}
+
+/* install tags from table terminated by an entry with a null name */
+
+void InitTags(struct tag *tags)
+{
+    struct tag *tp;
+    unsigned hashval;
+
+    for (tp = tags; tp->name; ++tp)
+    {
+        tp->len = strlen(tp->name);
+        hashval = hash(tp->name, tp->len);
+        tp->next = hashtab[hashval];
+        hashtab[hashval] = tp;
+    }
+}
@@ -0,0 +1,13 @@
+/* tags.h - tag tables shared by the browser and tidy, see tags.c */
+
+struct tag
+{
+    char *name;
+    int code;
+    int class;
+    int len;
+    struct tag *next;
+};
+
+struct tag *LookupTag(char *s, int len);
+void InitTags(struct tag *tags);
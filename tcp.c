@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/time.h> /* @@@ */
+#include <time.h>
 
 #define TEXTDOCUMENT    0
 #define HTMLDOCUMENT    1
@@ -35,13 +36,16 @@ extern int OpenSubnet;
 extern char *gateway;
 extern int gatewayport;
 extern Doc NewDoc;
+extern Display *display;
+extern int Streaming;
 
 /**** globals for UDP ****/
 
 #define ADDRNOTFOUND    0xffffffff  /* value returned for an unknown host */
 #define RETRIES 5   /* number of times to retry before giving up */
 
-#define RBUFSIZE 1024  /* max size of receive packets */
+#define RBUFSIZE 8192  /* max size of receive packets */
+#define SBUFSIZE 1024  /* max size of request packets accepted by server */
 
 int cache_s = -1;      /* socket descriptor */
 
@@ -59,9 +63,67 @@ static struct sockaddr_in server;       /* address info */
 static struct hostent *hp;              /* other host info */
 
 int BrokenPipe;
+int Interrupted;                 /* last wait was aborted or timed out */
 char *gatewayUser;               /* username:password for gateway */
 
-#define TIMEOUT 3000            /* 5 minutes */
+/**** pool of idle keep-alive connections ****/
+
+#define MAXIDLE     8           /* max idle connections kept open */
+
+static struct
+{
+    int skt;
+    int port;
+    char *host;                 /* NULL for an empty slot */
+    long used;                  /* for discarding least recently used */
+} idle[MAXIDLE];
+
+static long idleseq = 0;
+
+int KeepAlive;                  /* set by GetData if server keeps circuit open */
+
+/* how far an HTTP response has been delimited */
+
+typedef struct
+{
+    int hdrlen;                 /* 0 until end of header is seen */
+    int clen;                   /* Content-Length or -1 if none */
+    int chunked;                /* chunked transfer encoding */
+    int keep;                   /* server will keep circuit open */
+    int cpos;                   /* offset of next chunk-size line */
+    int dpos;                   /* end of decoded chunk data */
+} Framing;
+
+/**** transfers multiplexed by ServiceFetches() ****/
+
+#define MAXFETCH    16          /* max transfers in progress at once */
+
+#define FETCH_IDLE      0
+#define FETCH_CONNECT   1
+#define FETCH_SEND      2
+#define FETCH_RECV      3
+#define FETCH_DONE      4
+
+static struct
+{
+    int state;
+    int skt;
+    int port;
+    int reused;                 /* skt came from the idle pool */
+    char *host;
+    struct in_addr addr;        /* of host, see LookupHost() */
+    char *key;                  /* caller's name for transfer */
+    char *request;
+    int reqlen, sent;
+    char *buffer;               /* NULL once a transfer has failed */
+    int size, len;
+    Framing framing;
+} fetch[MAXFETCH];
+
+static int WatchFetches(fd_set *readfds, fd_set *writefds, int max);
+static void AdvanceFetches(fd_set *readfds, fd_set *writefds);
+
+#define TIMEOUT 300             /* seconds i.e. 5 minutes */
 #define MASK(f)     (1 << f)
 
 /* pause for delay milliseconds */
@@ -187,209 +249,353 @@ int QueryCacheServer(char *command, char **response)
     return buflen;
 }
 
-/* Connect, Send and Recv routines that poll X events */
+/*
+   Send a batch of n lines to the cache server with the given method,
+   e.g. MFIND or MREGISTER, packing as many lines into each datagram
+   as the server will accept. If replies is non-NULL, then replies[i]
+   is set to a malloc'ed copy of the server's reply line for lines[i],
+   or NULL if no reply was obtained. Returns number of lines answered.
+*/
 
-int XPConnect(int skt, struct sockaddr *server)
+int QueryCacheBatch(char *method, char **lines, int n, char **replies)
 {
-    struct timeval timer;
-    int n, ntime;
-    fd_set writefds;
-    fd_set exceptfds;
+    int i, j, k, len, m, count;
+    char command[SBUFSIZE], *response, *p, *q;
 
-    AbortFlag = 0;
+    count = 0;
 
-    /* set socket to non-blocking i/o */
-    n = 1;
+    if (replies)
+    {
+        for (i = 0; i < n; ++i)
+            replies[i] = NULL;
+    }
 
-    n = connect(skt, server, sizeof(struct sockaddr_in));
+    for (i = 0; i < n; i = j)
+    {
+        strcpy(command, method);
+        len = strlen(command);
 
-    if (n == -1 && errno != EINPROGRESS)
-         return -1;
+        for (j = i; j < n; ++j)
+        {
+            m = strlen(lines[j]);
 
-    for (ntime = 0; ntime < TIMEOUT && !AbortFlag;)
-    {
-        errno = 0;
-	FD_SET(skt, &writefds);
-	FD_SET(skt, &exceptfds);
-        timer.tv_sec = 0;
-        timer.tv_usec = 100000;
+            if (len + 1 + m >= SBUFSIZE)
+                break;
+
+            command[len++] = '\n';
+            memcpy(command + len, lines[j], m);
+            len += m;
+        }
 
-        n = select(NFDBITS, 0, &writefds, &exceptfds, &timer);
+        command[len] = '\0';
 
-        if (n == 0)  /* 100 mS time out */
+        if (j == i)  /* line too long for a single datagram */
         {
-            ++ntime;
-            PollEvents(0);
+            ++j;
             continue;
         }
 
-	/*
-        if (FD_ISSET(skt, &exceptfds))
+        /* error message issued by QueryCacheServer() */
+        if (QueryCacheServer(command, &response) <= 0)
+            break;
+
+        if (strncmp(response, "200", 3) != 0)
+            continue;
+
+        if (replies == NULL)
         {
-            perror("XPConnect - aborted via signal");
-            close(skt);
-            return -1;
+            count += j - i;
+            continue;
         }
-	*/
 
-        /* writefds implies the connect activity has now completed
-           it may have failed, so call connect again to check
-           (EISCONN implies socket is already connected, ie success) */
+        /* one reply line per request line after the status line */
+
+        p = strchr(response, '\n');
 
-        if (FD_ISSET(skt, &exceptfds))
+        for (k = i; k < j && p; ++k)
         {
-            n = connect(skt, server, sizeof(struct sockaddr_in));
+            q = p + 1;
 
-            if (n == -1 && errno != EISCONN && errno != EINPROGRESS)
-            {
-                /* EINVAL implies the socket was already shutdown
-                   but results in the confusing msg: Invalid argument */
+            if ((p = strchr(q, '\n')) == NULL || p == q)
+                break;
 
-                if (errno == EINVAL)
-                    errno = ECONNREFUSED;
+            if ((replies[k] = malloc(p - q + 1)) == NULL)
+                break;
 
-                close(skt);
-                return -1;
-            }
+            memcpy(replies[k], q, p - q);
+            replies[k][p - q] = '\0';
+            ++count;
+        }
+    }
 
+    return count;
+}
 
-            return 0;
+/* return idle connection to host:port or -1 if none */
+
+int TakeConnection(char *host, int port)
+{
+    int i, skt;
+    fd_set readfds;
+    struct timeval timer;
+
+    for (i = 0; i < MAXIDLE; ++i)
+    {
+        if (idle[i].host == NULL || idle[i].port != port ||
+                strcasecmp(idle[i].host, host) != 0)
+            continue;
+
+        skt = idle[i].skt;
+        free(idle[i].host);
+        idle[i].host = NULL;
+
+        /* an idle connection which is readable has
+           been closed by the server in the meantime */
+
+        FD_ZERO(&readfds);
+        FD_SET(skt, &readfds);
+        timer.tv_sec = 0;
+        timer.tv_usec = 0;
+
+        if (select(skt + 1, &readfds, 0, 0, &timer) != 0)
+        {
+            close(skt);
+            continue;
         }
+
+        return skt;
     }
 
-    close(skt);
-    Warn("aborted/timed-out during connect");
-    errno = 0;
     return -1;
 }
 
-/* note when an attempt has been made to write
-   to a socket for which there is no reader */
+/* keep connection open for later requests to host:port */
 
-void sigpipe(int sig)
+void KeepConnection(int skt, char *host, int port)
 {
-    BrokenPipe = 1;
+    int i, j;
+
+    for (i = j = 0; i < MAXIDLE; ++i)
+    {
+        if (idle[i].host == NULL)
+            break;
+
+        if (idle[i].used < idle[j].used)
+            j = i;
+    }
+
+    if (i == MAXIDLE)  /* discard least recently used */
+    {
+        i = j;
+        close(idle[i].skt);
+        free(idle[i].host);
+    }
+
+    if ((idle[i].host = strdup(host)) == NULL)
+    {
+        close(skt);
+        return;
+    }
+
+    idle[i].skt = skt;
+    idle[i].port = port;
+    idle[i].used = ++idleseq;
 }
 
-int XPSend(int skt, char *data, int len, int once)
+/* close all idle connections */
+
+void CloseConnections(void)
 {
-    struct timeval timer;
-    int k, ntime, n;
-    fd_set writefds;
-    fd_set exceptfds;
+    int i;
 
-    AbortFlag = 0;
-    k = 0;
+    for (i = 0; i < MAXIDLE; ++i)
+    {
+        if (idle[i].host)
+        {
+            close(idle[i].skt);
+            free(idle[i].host);
+            idle[i].host = NULL;
+        }
+    }
+}
 
-    /* trap writes to pipe with no one to read it */
+/*
+   All waiting on the network is done here. A single select() covers
+   skt, the X server connection and any transfers started by
+   StartFetch(), so there are no polling timers. X events are handled
+   by PollEvents(0) as they arrive, including the abort button which
+   cancels the wait by setting AbortFlag. Returns 1 when skt is ready
+   for reading (or writing) or 0 after abort or timeout, which also
+   sets Interrupted so callers can tell these from network errors.
+*/
+
+static int WaitForSocket(int skt, int writing, char *what)
+{
+    int n, max, xfd;
+    long deadline;
+    fd_set readfds, writefds, *fds;
+    struct timeval timer;
 
-    BrokenPipe = 0;
-    signal(SIGPIPE, sigpipe);
+    xfd = ConnectionNumber(display);
+    deadline = time(NULL) + TIMEOUT;
 
-    for(ntime = 0; ntime < TIMEOUT && !AbortFlag;)
+    for (;;)
     {
-        if (k == len)
-            return len;
+        /* flush our output to the X server and handle its events */
 
-        FD_SET(skt, &writefds);
-	FD_SET(skt, &exceptfds);
-        timer.tv_sec = 0;
-        timer.tv_usec = 100000;
-
-        n = select(NFDBITS, 0, &writefds, &exceptfds, &timer);
+        if (XEventsQueued(display, QueuedAfterFlush) != 0)
+            PollEvents(0);
 
-        if (n == 0)  /* 100 mS time out */
+        if (AbortFlag)
         {
-            ++ntime;
-            PollEvents(0);
-            continue;
+            Warn("Aborted during %s", what);
+            Interrupted = 1;
+            return 0;
         }
 
-        if (FD_ISSET(skt, &writefds))
+        if (time(NULL) > deadline)
         {
-            n = send(skt, data + k, len - k, 0);
+            Warn("Timed-out during %s", what);
+            Interrupted = 1;
+            return 0;
+        }
 
-            if (n == -1)
-            {
-                close(skt);
-                return -1;
-            }
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        fds = (writing ? &writefds : &readfds);
 
-            k += n;
+        FD_SET(xfd, &readfds);
+        FD_SET(skt, fds);
+        max = WatchFetches(&readfds, &writefds, (skt > xfd ? skt : xfd));
 
-            if (once && k < len)
-            {
-                close(skt);
-                return -1;
-            }
-        }
+        timer.tv_sec = 1;  /* to notice timeout */
+        timer.tv_usec = 0;
+
+        n = select(max + 1, &readfds, &writefds, 0, &timer);
+
+        if (n == -1 && errno != EINTR)
+            return 0;
+
+        if (n <= 0)
+            continue;
+
+        AdvanceFetches(&readfds, &writefds);
+
+        if (FD_ISSET(skt, fds))
+            return 1;
     }
+}
 
-    Warn("Aborted/timed-out during send");
-    close(skt);
-    errno = 0;
-    return -1;
+/* Connect, Send and Recv routines that handle X events while waiting */
+
+int XPConnect(int skt, struct sockaddr *server)
+{
+    int flags, err;
+    socklen_t errlen;
+
+    AbortFlag = 0;
+    Interrupted = 0;
+
+    /* connect without blocking so X events can be handled meanwhile */
+
+    flags = fcntl(skt, F_GETFL, 0);
+    fcntl(skt, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(skt, server, sizeof(struct sockaddr_in)) == -1 && errno != EINPROGRESS)
+    {
+        close(skt);
+        return -1;
+    }
+
+    if (!WaitForSocket(skt, 1, "connect"))
+    {
+        close(skt);
+        errno = 0;
+        return -1;
+    }
+
+    /* writable implies the connect has completed, but it may have failed */
+
+    errlen = sizeof(int);
+
+    if (getsockopt(skt, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) == -1 || err)
+    {
+        close(skt);
+        errno = err;
+        return -1;
+    }
+
+    fcntl(skt, F_SETFL, flags);
+    return 0;
 }
 
-/* similar receive operation where len is the maximum amount
-   of data to receive, the amount received is generally less */
+/* note when an attempt has been made to write
+   to a socket for which there is no reader */
 
-int XPRecv(int skt, char *msg, int len)
+void sigpipe(int sig)
 {
-    int n, ntime;
-    fd_set readfds;
-    fd_set exceptfds;
-    struct timeval timer;
+    BrokenPipe = 1;
+}
 
-    /* I maybe should call recv repeatedly until I have got
-       all of the message as indicated by the message contents */
+int XPSend(int skt, char *data, int len, int once)
+{
+    int k, n;
 
     AbortFlag = 0;
-    errno = 0;
+    Interrupted = 0;
+    k = 0;
 
-    for (ntime = 0; ntime < TIMEOUT && !AbortFlag;)
-    {
-	FD_ZERO(&exceptfds);
-	FD_ZERO(&readfds);
-        FD_SET(skt, &exceptfds);
-        FD_SET(skt, &readfds);
-        timer.tv_sec = 0;
-        timer.tv_usec = 10000;
+    /* trap writes to pipe with no one to read it */
 
-        n = select(NFDBITS, &readfds, 0, &exceptfds, &timer);
+    BrokenPipe = 0;
+    signal(SIGPIPE, sigpipe);
 
-        if (n == 0)
+    while (k < len)
+    {
+        if (!WaitForSocket(skt, 1, "send"))
         {
-            ++ntime;
-            PollEvents(0);
-            continue;
+            close(skt);
+            errno = 0;
+            return -1;
         }
-    
-        if (FD_ISSET(skt, &exceptfds))
+
+        n = send(skt, data + k, len - k, 0);
+
+        if (n == -1)
         {
-            perror("XPRecv - aborted via signal");
-            Warn("Aborted during receive");
             close(skt);
             return -1;
         }
 
-	printf("%d\n", n);
+        k += n;
 
-
-        if (n > 0)
-            return recv(skt, msg, len, 0);
+        if (once && k < len)
+        {
+            close(skt);
+            return -1;
+        }
     }
 
-    fprintf(stderr, "aborted/timed-out during receive");
+    return len;
+}
 
-    if (AbortFlag)
-        Warn("Aborted during receive");
-    else
-        Warn("Timed-out during receive");
+/* similar receive operation where len is the maximum amount
+   of data to receive, the amount received is generally less */
 
-    close(skt);
+int XPRecv(int skt, char *msg, int len)
+{
+    AbortFlag = 0;
+    Interrupted = 0;
     errno = 0;
-    return -1;
+
+    if (!WaitForSocket(skt, 0, "receive"))
+    {
+        close(skt);
+        errno = 0;
+        return -1;
+    }
+
+    return recv(skt, msg, len, 0);
 }
 
 
@@ -512,15 +718,206 @@ int Connect(int s, char *host, int port, int *ViaGateway)
     }
 }
 
+/*
+   Find end of HTTP response header and note how the body is
+   delimited. Returns header length or 0 if not yet complete.
+   *clen is set to the Content-Length or -1 if the body runs
+   until the server closes the circuit.
+*/
+
+static int HTTPFraming(char *buf, int len, int *clen, int *chunked, int *keep)
+{
+    int major, minor, status, hdrlen;
+    char *p;
+
+    for (p = buf, hdrlen = 0; p < buf + len; ++p)
+    {
+        if (*p != '\n')
+            continue;
+
+        if (p[1] == '\n')
+        {
+            hdrlen = p + 2 - buf;
+            break;
+        }
+
+        if (p[1] == '\r' && p[2] == '\n')
+        {
+            hdrlen = p + 3 - buf;
+            break;
+        }
+    }
+
+    if (hdrlen == 0)
+        return 0;
+
+    *clen = -1;
+    *chunked = 0;
+    *keep = 0;
+
+    if (sscanf(buf, "HTTP/%d.%d %d", &major, &minor, &status) != 3)
+        return hdrlen;
+
+    if (major > 1 || (major == 1 && minor >= 1))
+        *keep = 1;
+
+    if (status == 204 || status == 304)
+        *clen = 0;
+
+    for (p = strchr(buf, '\n'); p && p < buf + hdrlen; p = strchr(p, '\n'))
+    {
+        ++p;
+
+        if (strncasecmp(p, "content-length:", 15) == 0)
+        {
+            if (*clen == -1)
+                *clen = atoi(p + 15);
+        }
+        else if (strncasecmp(p, "transfer-encoding:", 18) == 0)
+        {
+            for (p += 18; *p == ' '; ++p);
+
+            if (strncasecmp(p, "chunked", 7) == 0)
+                *chunked = 1;
+        }
+        else if (strncasecmp(p, "connection:", 11) == 0)
+        {
+            for (p += 11; *p == ' '; ++p);
+
+            if (strncasecmp(p, "close", 5) == 0)
+                *keep = 0;
+            else if (strncasecmp(p, "keep-alive", 10) == 0)
+                *keep = 1;
+        }
+    }
+
+    if (*chunked)
+        *clen = -1;
+    else if (*clen == -1)
+        *keep = 0;
+
+    return hdrlen;
+}
+
+/*
+   Decode complete chunks in place: *cpos is the offset of the next
+   chunk-size line and *dpos the end of the decoded data which is
+   never beyond *cpos. Returns 1 once the last chunk and any trailer
+   have been received.
+*/
+
+static int Dechunk(char *buf, int len, int *cpos, int *dpos)
+{
+    int size;
+    char *p, *q, *end;
+
+    end = buf + len;
+
+    for (;;)
+    {
+        for (q = p = buf + *cpos; q < end && *q != '\n'; ++q);
+
+        if (q == end)
+            return 0;
+
+        size = strtol(p, NULL, 16);
+        ++q;
+
+        if (size == 0)  /* skip trailer up to blank line */
+        {
+            for (;;)
+            {
+                for (p = q; p < end && *p != '\n'; ++p);
+
+                if (p == end)
+                    return 0;
+
+                if (p == q || (p == q + 1 && *q == '\r'))
+                {
+                    *cpos = p + 1 - buf;
+                    return 1;
+                }
+
+                q = p + 1;
+            }
+        }
+
+        /* need chunk data and its CRLF */
+
+        p = q + size;
+
+        if (p < end && *p == '\r')
+            ++p;
+
+        if (p >= end)
+            return 0;
+
+        memmove(buf + *dpos, q, size);
+        *dpos += size;
+        *cpos = p + 1 - buf;
+    }
+}
+
+/*
+   Returns 1 once the whole of the HTTP response has been
+   received into buf, at which point *len excludes any chunk
+   headers and f->keep says if the circuit may be reused.
+*/
+
+static int EndOfResponse(char *buf, int *len, Framing *f)
+{
+    buf[*len] = '\0';
+
+    if (f->hdrlen == 0)
+    {
+        if ((f->hdrlen = HTTPFraming(buf, *len, &f->clen, &f->chunked, &f->keep)) == 0)
+            return 0;
+
+        f->cpos = f->dpos = f->hdrlen;
+    }
+
+    if (f->chunked)
+    {
+        if (!Dechunk(buf, *len, &f->cpos, &f->dpos))
+            return 0;
+
+        f->keep = (f->keep && f->cpos == *len);
+        *len = f->dpos;
+        buf[*len] = '\0';
+        return 1;
+    }
+
+    if (f->clen >= 0 && *len >= f->hdrlen + f->clen)
+    {
+        f->keep = (f->keep && *len == f->hdrlen + f->clen);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+   Read data from socket. For HTTP the response is delimited by its
+   Content-Length or chunked encoding if given, and KeepAlive is set
+   when the server will keep the circuit open for further requests.
+   Otherwise data is read until the circuit is closed. When Streaming,
+   HTML documents are displayed by PartialBuffer() as they arrive.
+*/
+
 char *GetData(int socket, int *length)
 {
     char *p, *buffer;
-    int count, m, len, size, nfound, readfds, exceptfds;
+    int count, m, len, size, nfound, readfds, exceptfds, partial, err;
     char *host, *path;
+    Framing framing;
 
     host = NewDoc.host;
     path = NewDoc.path;
 
+    KeepAlive = 0;
+    memset(&framing, 0, sizeof(Framing));
+    partial = -1;  /* not yet known if it can be shown */
+
     *length = len = 0;
     size = BUFSIZE;
     buffer = malloc(size);
@@ -533,16 +930,18 @@ char *GetData(int socket, int *length)
 
     for (m = 0;;)
     {
-	printf("!\n");
-        count = XPRecv(socket, buffer+len, size - len);
-	printf("!2\n");
+        count = XPRecv(socket, buffer+len, size - len - 1);
 
         if (count == -1)
         {
-            if (errno)
-                 Warn("Couldn't get data: errno %d", errno);
+            err = errno;  /* for caller, Warn() may change it */
+
+            if (err)
+                 Warn("Couldn't get data: errno %d", err);
 
             free(buffer);
+            *length = len;
+            errno = err;
             return NULL;
         }
 
@@ -552,6 +951,9 @@ char *GetData(int socket, int *length)
 
         if (count == 0)
         {
+            if (framing.chunked)  /* drop undecoded remnant */
+                len = framing.dpos;
+
             buffer[len] = '\0';
 
             *length = len;
@@ -562,10 +964,29 @@ char *GetData(int socket, int *length)
         len += count;
         Announce("received %d bytes", m);
 
+        if (NewDoc.protocol == HTTP && EndOfResponse(buffer, &len, &framing))
+        {
+            KeepAlive = framing.keep;
+            *length = len;
+            return buffer;
+        }
+
+        /* show first part of body once there's something to see,
+           and then follow the buffer when it moves */
+
+        if (Streaming && partial == -1 && framing.hdrlen && len - framing.hdrlen >= THRESHOLD)
+            partial = PartialBuffer(buffer, (framing.chunked ? framing.dpos : len));
+        else if (partial == 1)
+            PartialBuffer(buffer, (framing.chunked ? framing.dpos : len));
+
         if (size - len < THRESHOLD)  /* need to grow buffer */
         {
             size *= 2;  /* attempt to double size */
-            p = realloc(buffer, size);
+
+            if (partial == 1)
+                p = MovePartial(buffer, len, size);
+            else
+                p = realloc(buffer, size);
 
             if (p == NULL)
             {
@@ -581,3 +1002,455 @@ char *GetData(int socket, int *length)
     }
 }
 
+/*
+   Inline images are retrieved concurrently: StartFetch() queues
+   a request without waiting for the response, ServiceFetches()
+   advances all transfers with a single select() and finished
+   ones are collected with TakeFetched(). Access via the gateway
+   isn't supported here and is left to GetDocument().
+
+   gethostbyname() blocks, so each host is looked up once by
+   StartFetch() before its transfers join the select() loop, and
+   the address is remembered for the rest of the document's images
+   and for reconnecting. Hosts which can't be found are remembered
+   too, so that each is only waited on once.
+*/
+
+#define MAXHOSTS    16
+
+static struct
+{
+    char *host;
+    struct in_addr addr;        /* INADDR_NONE if unknown */
+} hosts[MAXHOSTS];
+
+static int nhosts;
+
+static void ForgetHosts(void)
+{
+    while (nhosts > 0)
+        free(hosts[--nhosts].host);
+}
+
+static int LookupHost(char *host, struct in_addr *addr)
+{
+    int i;
+    struct hostent *h;
+
+    for (i = 0; i < nhosts; ++i)
+    {
+        if (strcmp(hosts[i].host, host) == 0)
+        {
+            *addr = hosts[i].addr;
+            return addr->s_addr != INADDR_NONE;
+        }
+    }
+
+    if ((h = gethostbyname(host)) != NULL)
+        addr->s_addr = ((struct in_addr *)(h->h_addr))->s_addr;
+    else
+        addr->s_addr = INADDR_NONE;
+
+    if (nhosts == MAXHOSTS)
+        ForgetHosts();
+
+    if ((hosts[nhosts].host = strdup(host)) != NULL)
+        hosts[nhosts++].addr = *addr;
+
+    return addr->s_addr != INADDR_NONE;
+}
+
+static int FetchConnect(int i)
+{
+    int skt;
+    struct sockaddr_in addr;
+
+    if ((skt = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+        return 0;
+
+    fcntl(skt, F_SETFL, O_NONBLOCK);
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = fetch[i].port;
+    addr.sin_addr = fetch[i].addr;
+
+    if (connect(skt, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1
+            && errno != EINPROGRESS)
+    {
+        close(skt);
+        return 0;
+    }
+
+    fetch[i].skt = skt;
+    fetch[i].reused = 0;
+    fetch[i].state = FETCH_CONNECT;
+    return 1;
+}
+
+static void FreeFetch(int i)
+{
+    Free(fetch[i].host);
+    Free(fetch[i].key);
+    Free(fetch[i].request);
+    Free(fetch[i].buffer);
+    fetch[i].host = fetch[i].key = fetch[i].request = fetch[i].buffer = NULL;
+    fetch[i].state = FETCH_IDLE;
+}
+
+/* start sending request to host:port, key names the transfer */
+
+int StartFetch(char *host, int port, char *request, int len, char *key)
+{
+    int i;
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        if (fetch[i].state == FETCH_IDLE)
+            break;
+    }
+
+    if (i == MAXFETCH)
+        return 0;
+
+    fetch[i].port = port;
+    fetch[i].reqlen = len;
+    fetch[i].sent = fetch[i].len = 0;
+    fetch[i].size = BUFSIZE;
+    memset(&fetch[i].framing, 0, sizeof(Framing));
+
+    fetch[i].host = strdup(host);
+    fetch[i].key = strdup(key);
+    fetch[i].request = malloc(len);
+    fetch[i].buffer = malloc(BUFSIZE);
+
+    if (!fetch[i].host || !fetch[i].key || !fetch[i].request || !fetch[i].buffer)
+    {
+        FreeFetch(i);
+        return 0;
+    }
+
+    memcpy(fetch[i].request, request, len);
+
+    if (!LookupHost(host, &fetch[i].addr))
+    {
+        FreeFetch(i);
+        return 0;
+    }
+
+    if ((fetch[i].skt = TakeConnection(host, port)) != -1)
+    {
+        fcntl(fetch[i].skt, F_SETFL, O_NONBLOCK);
+        fetch[i].reused = 1;
+        fetch[i].state = FETCH_SEND;
+    }
+    else if (!FetchConnect(i))
+    {
+        FreeFetch(i);
+        return 0;
+    }
+
+    /* trap writes to connections closed by the server */
+
+    signal(SIGPIPE, sigpipe);
+    return 1;
+}
+
+/* is transfer named by key in progress or awaiting collection? */
+
+int FetchPending(char *key)
+{
+    int i;
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        if (fetch[i].state != FETCH_IDLE && strcmp(fetch[i].key, key) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+   Look at the body received so far of a successful HTTP transfer
+   named by key, so that it can be shown before it is complete.
+   *buf is only good until the next call to ServiceFetches().
+   Returns 0 if the header hasn't yet arrived.
+*/
+
+int PeekFetch(char *key, char **buf, int *len)
+{
+    int i, major, minor, status;
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        if (fetch[i].state != FETCH_RECV || strcmp(fetch[i].key, key) != 0)
+            continue;
+
+        if (fetch[i].framing.hdrlen == 0 ||
+            sscanf(fetch[i].buffer, "HTTP/%d.%d %d", &major, &minor, &status) != 3 ||
+            status != 200)
+            return 0;
+
+        *buf = fetch[i].buffer + fetch[i].framing.hdrlen;
+        *len = (fetch[i].framing.chunked ? fetch[i].framing.dpos : fetch[i].len)
+                    - fetch[i].framing.hdrlen;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* number of transfers in progress or awaiting collection */
+
+int Fetching(void)
+{
+    int i, n;
+
+    for (i = n = 0; i < MAXFETCH; ++i)
+    {
+        if (fetch[i].state != FETCH_IDLE)
+            ++n;
+    }
+
+    return n;
+}
+
+/* a reused connection may have been closed by the server
+   before it saw our request, in which case start afresh */
+
+static void FetchFailed(int i)
+{
+    close(fetch[i].skt);
+
+    if (fetch[i].reused && fetch[i].len == 0 && FetchConnect(i))
+    {
+        fetch[i].sent = 0;
+        return;
+    }
+
+    free(fetch[i].buffer);
+    fetch[i].buffer = NULL;
+    fetch[i].state = FETCH_DONE;
+}
+
+static void FetchFinished(int i, int keep)
+{
+    fetch[i].buffer[fetch[i].len] = '\0';
+    fetch[i].state = FETCH_DONE;
+
+    if (keep)
+    {
+        fcntl(fetch[i].skt, F_SETFL, 0);
+        KeepConnection(fetch[i].skt, fetch[i].host, fetch[i].port);
+    }
+    else
+        close(fetch[i].skt);
+}
+
+static void FetchReceive(int i)
+{
+    int n;
+    char *p;
+
+    if (fetch[i].size - fetch[i].len < THRESHOLD)  /* need to grow buffer */
+    {
+        if ((p = realloc(fetch[i].buffer, 2 * fetch[i].size)) == NULL)
+        {
+            FetchFailed(i);
+            return;
+        }
+
+        fetch[i].buffer = p;
+        fetch[i].size *= 2;
+    }
+
+    n = recv(fetch[i].skt, fetch[i].buffer + fetch[i].len,
+                fetch[i].size - fetch[i].len - 1, 0);
+
+    if (n == -1)
+    {
+        if (errno != EWOULDBLOCK && errno != EAGAIN)
+            FetchFailed(i);
+
+        return;
+    }
+
+    if (n == 0)  /* server has closed circuit */
+    {
+        if (fetch[i].len == 0)
+        {
+            FetchFailed(i);
+            return;
+        }
+
+        if (fetch[i].framing.chunked)
+            fetch[i].len = fetch[i].framing.dpos;
+
+        FetchFinished(i, 0);
+        return;
+    }
+
+    fetch[i].len += n;
+
+    if (EndOfResponse(fetch[i].buffer, &fetch[i].len, &fetch[i].framing))
+        FetchFinished(i, fetch[i].framing.keep);
+}
+
+/* add sockets of transfers in progress to select() masks,
+   returning the highest numbered fd in the masks */
+
+static int WatchFetches(fd_set *readfds, fd_set *writefds, int max)
+{
+    int i, skt;
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        skt = fetch[i].skt;
+
+        if (fetch[i].state == FETCH_CONNECT || fetch[i].state == FETCH_SEND)
+            FD_SET(skt, writefds);
+        else if (fetch[i].state == FETCH_RECV)
+            FD_SET(skt, readfds);
+        else
+            continue;
+
+        if (skt > max)
+            max = skt;
+    }
+
+    return max;
+}
+
+/* advance transfers whose sockets select() found ready */
+
+static void AdvanceFetches(fd_set *readfds, fd_set *writefds)
+{
+    int i, n, skt, err;
+    socklen_t errlen;
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        skt = fetch[i].skt;
+
+        switch (fetch[i].state)
+        {
+            case FETCH_CONNECT:
+                if (!FD_ISSET(skt, writefds))
+                    break;
+
+                errlen = sizeof(int);
+
+                if (getsockopt(skt, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) == -1 || err)
+                {
+                    FetchFailed(i);
+                    break;
+                }
+
+                fetch[i].state = FETCH_SEND;
+                break;
+
+            case FETCH_SEND:
+                if (!FD_ISSET(skt, writefds))
+                    break;
+
+                n = send(skt, fetch[i].request + fetch[i].sent,
+                            fetch[i].reqlen - fetch[i].sent, 0);
+
+                if (n == -1)
+                {
+                    if (errno != EWOULDBLOCK && errno != EAGAIN)
+                        FetchFailed(i);
+
+                    break;
+                }
+
+                if ((fetch[i].sent += n) == fetch[i].reqlen)
+                    fetch[i].state = FETCH_RECV;
+
+                break;
+
+            case FETCH_RECV:
+                if (FD_ISSET(skt, readfds))
+                    FetchReceive(i);
+
+                break;
+        }
+    }
+}
+
+/*
+   Wait up to timeout mS for progress on any transfer or for fd
+   (if not -1) to become readable. Returns number of transfers
+   in progress or awaiting collection.
+*/
+
+int ServiceFetches(int fd, int timeout)
+{
+    int max;
+    fd_set readfds, writefds;
+    struct timeval timer;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+
+    if (fd != -1)
+        FD_SET(fd, &readfds);
+
+    max = WatchFetches(&readfds, &writefds, fd);
+
+    timer.tv_sec = timeout / 1000;
+    timer.tv_usec = (timeout % 1000) * 1000;
+
+    if (max != -1 && select(max + 1, &readfds, &writefds, 0, &timer) > 0)
+        AdvanceFetches(&readfds, &writefds);
+
+    return Fetching();
+}
+
+/*
+   Collect a finished transfer: *key and *buf are malloc'ed for
+   the caller to free, *buf is NULL if the transfer failed.
+   Returns 0 if none have finished.
+*/
+
+int TakeFetched(char **key, char **buf, int *len)
+{
+    int i;
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        if (fetch[i].state == FETCH_DONE)
+        {
+            *key = fetch[i].key;
+            *buf = fetch[i].buffer;
+            *len = fetch[i].len;
+            fetch[i].key = fetch[i].buffer = NULL;
+            FreeFetch(i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* abandon all transfers, e.g. when leaving the document,
+   whose hosts are then looked up afresh */
+
+void CancelFetches(void)
+{
+    int i;
+
+    ForgetHosts();
+
+    for (i = 0; i < MAXFETCH; ++i)
+    {
+        if (fetch[i].state == FETCH_IDLE)
+            continue;
+
+        if (fetch[i].state != FETCH_DONE)
+            close(fetch[i].skt);
+
+        FreeFetch(i);
+    }
+}
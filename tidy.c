@@ -21,6 +21,7 @@ Useage:     tidy file file file ...
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
+#include "tags.h"
 
 #define VERSION         "1.0a"
 
@@ -137,6 +138,54 @@ Useage:     tidy file file file ...
 
 #define LBUFSIZE 1024
 
+/* the tags known to tidy */
+
+struct tag TidyTags[] =
+{
+    {"a",           TAG_ANCHOR,     EN_TEXT},
+    {"address",     TAG_ADDRESS,    EN_BLOCK},
+    {"b",           TAG_BOLD,       EN_TEXT},
+    {"br",          TAG_BR,         EN_TEXT},
+    {"body",        TAG_BODY,       EN_MAIN},
+    {"code",        TAG_CODE,       EN_TEXT},
+    {"cite",        TAG_CITE,       EN_TEXT},
+    {"dl",          TAG_DL,         EN_LIST},
+    {"dt",          TAG_DT,         EL_DEFLIST},
+    {"dd",          TAG_DD,         EL_DEFLIST},
+    {"em",          TAG_EM,         EN_TEXT},
+    {"fig",         TAG_FIG,        EN_TEXT},
+    {"form",        TAG_FORM,       EN_BLOCK},
+    {"head",        TAG_HEAD,       EN_SETUP},
+    {"h1",          TAG_H1,         EN_HEADER},
+    {"h2",          TAG_H2,         EN_HEADER},
+    {"h3",          TAG_H3,         EN_HEADER},
+    {"h4",          TAG_H4,         EN_HEADER},
+    {"h5",          TAG_H5,         EN_HEADER},
+    {"h6",          TAG_H6,         EN_HEADER},
+    {"hr",          TAG_HR,         EN_BLOCK},
+    {"i",           TAG_ITALIC,     EN_TEXT},
+    {"img",         TAG_IMG,        EN_TEXT},
+    {"input",       TAG_INPUT,      EN_TEXT},
+    {"isindex",     TAG_ISINDEX,    EN_SETUP},
+    {"kbd",         TAG_KBD,        EN_TEXT},
+    {"li",          TAG_LI,         EN_LIST},
+    {"ol",          TAG_OL,         EN_LIST},
+    {"option",      TAG_OPTION,     EN_TEXT},  /* kludge for error recovery */
+    {"p",           TAG_P,          EN_BLOCK},
+    {"pre",         TAG_PRE,        EN_BLOCK},
+    {"q",           TAG_Q,          EN_TEXT},
+    {"s",           TAG_STRIKE,     EN_TEXT},
+    {"samp",        TAG_SAMP,       EN_TEXT},
+    {"strong",      TAG_STRONG,     EN_TEXT},
+    {"select",      TAG_SELECT,     EN_TEXT},
+    {"title",       TAG_TITLE,      EN_SETUP},
+    {"tt",          TAG_TT,         EN_TEXT},
+    {"textarea",    TAG_TEXTAREA,   EN_TEXT},
+    {"u",           TAG_UNDERLINE,  EN_TEXT},
+    {"ul",          TAG_UL,         EN_LIST},
+    {NULL,          UNKNOWN,        EN_UNKNOWN}
+};
+
 int comment = 0;
 int debug = 0;
 
@@ -429,8 +478,9 @@ void SwallowAttributes(void)
 
 int RecogniseTag(void)
 {
-    int c, len;
+    int len;
     char *s;
+    struct tag *tp;
 
     s = bufptr;
 
@@ -450,277 +500,11 @@ int RecogniseTag(void)
     TagLen = s - bufptr;        /* how far to next char after tag name */
     len = TagLen - EndTag - 1;  /* number of chars in tag name itself */
     s -= len;
-    c = tolower(*s);
 
-    if (isalpha(c))
+    if (len > 0 && (tp = LookupTag(s, len)))
     {
-        if (c == 'a')
-        {
-            if (len == 1 && strncasecmp(s, "a", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_ANCHOR;
-            }
-
-            if (len == 7 && strncasecmp(s, "address", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_ADDRESS;
-            }
-        }
-        else if (c == 'b')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_BOLD;
-            }
-
-            if (len == 2 && strncasecmp(s, "br", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_BR;
-            }
-
-            if (len == 4 && strncasecmp(s, "body", len) == 0)
-            {
-                TokenClass = EN_MAIN;
-                return TAG_BODY;
-            }
-        }
-        else if (c == 'c')
-        {
-            if (len == 4)
-            {
-                if (strncasecmp(s, "code", len) == 0)
-                {
-                    TokenClass = EN_TEXT;
-                    return TAG_CODE;
-                }
-
-                if (strncasecmp(s, "cite", len) == 0)
-                {
-                    TokenClass = EN_TEXT;
-                    return TAG_CITE;
-                }
-            }
-        }
-        else if (c == 'd')
-        {
-            if (len != 2)
-                return 0;
-
-            if (strncasecmp(s, "dl", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_DL;
-            }
-
-            if (strncasecmp(s, "dt", len) == 0)
-            {
-                TokenClass = EL_DEFLIST;
-                return TAG_DT;
-            }
-
-            if (strncasecmp(s, "dd", len) == 0)
-            {
-                TokenClass = EL_DEFLIST;
-                return TAG_DD;
-            }
-        }
-        else if (c == 'e')
-        {
-            if (len == 2 && strncasecmp(s, "code", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_EM;
-            }
-        }
-        else if (c == 'f')
-        {
-            if (len == 3 && strncasecmp(s, "fig", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_FIG;
-            }
-
-            if (len == 4 && strncasecmp(s, "form", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_FORM;
-            }
-        }
-        else if (c == 'h')
-        {
-            if (len == 4 && strncasecmp(s, "head", len) == 0)
-            {
-                TokenClass = EN_SETUP;
-                return TAG_HEAD;
-            }
-
-            if (len != 2)
-                return 0;
-
-            TokenClass = EN_HEADER;
-            c = tolower(s[1]);
-
-            switch (c)
-            {
-                case '1':
-                    return TAG_H1;
-                case '2':
-                    return TAG_H2;
-                case '3':
-                    return TAG_H3;
-                case '4':
-                    return TAG_H4;
-                case '5':
-                    return TAG_H5;
-                case '6':
-                    return TAG_H6;
-                case 'r':
-                    TokenClass = EN_BLOCK;
-                    return TAG_HR;
-            }
-        }
-        else if (c == 'i')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_ITALIC;
-            }
-
-            if (len == 3 && strncasecmp(s, "img", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_IMG;
-            }
-
-            if (len == 5 && strncasecmp(s, "input", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_INPUT;
-            }
-
-            if (len == 7 && strncasecmp(s, "isindex", len) == 0)
-            {
-                TokenClass = EN_SETUP;
-                return TAG_ISINDEX;
-            }
-        }
-        else if (c == 'k')
-        {
-            if (len == 3 && strncasecmp(s, "kbd", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_KBD;
-            }
-        }
-        else if (c == 'l')
-        {
-            if (len == 2 && strncasecmp(s, "li", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_LI;
-            }
-        }
-        else if (c == 'o')
-        {
-            if (len == 2 && strncasecmp(s, "ol", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_OL;
-            }
-
-            if (len == 6 && strncasecmp(s, "option", len) == 0)
-            {
-                TokenClass = EN_TEXT;  /* kludge for error recovery */
-                return TAG_OPTION;
-            }
-        }
-        else if (c == 'p')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_P;
-            }
-
-            if (len == 3 && strncasecmp(s, "pre", len) == 0)
-            {
-                TokenClass = EN_BLOCK;
-                return TAG_PRE;
-            }
-        }
-        else if (c == 'q')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_Q;
-            }
-        }
-        else if (c == 's')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_STRIKE;
-            }
-
-            if (len == 4 && strncasecmp(s, "samp", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_SAMP;
-            }
-
-            if (len == 5 && strncasecmp(s, "strong", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_STRONG;
-            }
-
-            if (len == 6 && strncasecmp(s, "select", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_SELECT;
-            }
-        }
-        else if (c == 't')
-        {
-            if (len == 5 && strncasecmp(s, "title", len) == 0)
-            {
-                TokenClass = EN_SETUP;
-                return TAG_TITLE;
-            }
-
-            if (len == 2 && strncasecmp(s, "tt", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_TT;
-            }
-
-            if (len == 8 && strncasecmp(s, "textarea", len) == 0)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_TEXTAREA;
-            }
-        }
-        else if (c == 'u')
-        {
-            if (len == 1)
-            {
-                TokenClass = EN_TEXT;
-                return TAG_UNDERLINE;
-            }
-
-            if (len == 2 && strncasecmp(s, "ul", len) == 0)
-            {
-                TokenClass = EN_LIST;
-                return TAG_UL;
-            }
-        }
+        TokenClass = tp->class;
+        return tp->code;
     }
 
     TokenClass = EN_UNKNOWN;
@@ -2556,6 +2340,7 @@ Help()
 main(int argc, char **argv)
 {
     overwrite = 0;
+    InitTags(TidyTags);
 
     if (argc == 1)
     {
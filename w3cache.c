@@ -1,13 +1,22 @@
-/* w3cache.c 
+/* w3cache.c
 
 This is a UDP server for managing a shared cache of documents
 based on their URLs and HTTP headers. It uses the gdbm library
 for a disk based index of URL-> file name, and runs as a background
-process which processes requests one at a time. It opens the database
-as a writer and hence only one such server can be run at a time
-per cache database. If a URL is unknown the server returns a suggested
-file name which is guaranteed to be unique and is based on a counter
-incremented for each such request.
+process. It opens the database as a writer and hence only one such
+server can be run at a time per cache database. If a URL is unknown
+the server returns a suggested file name which is guaranteed to be
+unique and is based on a counter incremented for each such request.
+
+The index is read into memory at startup and split into NSHARDS
+shards, each with its own lock, so that requests can be served by
+a pool of worker threads. Each worker has its own socket bound to
+the service port (via SO_REUSEPORT where available, otherwise the
+workers share a single socket) and calls ProcessRequest() for each
+datagram. Changes made by REGISTER, PURGE and FORGET are applied to
+the in-memory index at once and queued on a write-behind journal
+which a separate thread transfers to the gdbm database, so that
+clients never wait on disk writes.
 
 Clients are responsible for retrieving documents and saving them into
 the suggested file name (typically a shared directory). The document
@@ -19,8 +28,8 @@ this situation occurs.
 The garbage collector is run as a separate program and continuously
 scans the files in the cache directory and purges them and the entry
 in the database once certain criteria are met. Requests from the
-garbage collector and www clients are serialised by the cache server
-and hence can coexist peacebly. 
+garbage collector and www clients are serialised by the shard locks
+and hence can coexist peacebly.
 
 The FIRST and NEXT methods are used to purge database entries which
 no longer point to files. The garbage collector also scans the
@@ -32,6 +41,14 @@ A recent proposal involves sending the Date: field as part of a GET
 request. HTTP servers then returns error 304 (?) if the client's copy
 is upto date otherwise it returns the document as normal.
 
+To support this, clients can register the Date, Expires and
+Last-Modified times from the document's HTTP header along with its
+file name. FIND returns these after the file name as lines of the
+form "Date: 784111777" (omitted when unknown), and MFIND appends
+them to each "200 filename" line. This lets clients decide whether
+the cached copy is fresh or should be revalidated with the server
+using If-Modified-Since.
+
 I have tried to use the same error codes as HTTP.
 
 The request starts with a method and optionally followed by a URL
@@ -44,6 +61,8 @@ and then other parameters depending on the method type.
         FIND url                  -- return http header or suggested filename
 
         REGISTER url filename     -- add/replace entry for url
+            [date expires lastmod]   with optional freshness info
+                                     as seconds since 1970 or 0
 
         PURGE url                 -- remove entry for url
 
@@ -55,27 +74,43 @@ and then other parameters depending on the method type.
 
         NEXT url                  -- next url following "url"
 
+        MFIND                     -- FIND for each url on following
+        url ...                      lines, replying "200 OK" and then
+                                     "200 filename" or "404 filename"
+                                     per url with suggested filename
+
+        MREGISTER                 -- REGISTER for each url/filename pair
+        url filename ...             on following lines
+
 Dave Ragggett,  Wed  2-Mar-94
 */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <signal.h>
+#include <pthread.h>
 #include "gdbm.h"
 
-#define VERSION     "1.0a"
+#define VERSION     "1.1a"
 
 #define DEBUG  1      /* delete this line for final code */
 #define PORT    2786  /* service port number */
 
 #define BUFSIZE 1024  /* max size of receive packets */
 
+#define NSHARDS     64   /* number of lock stripes for index */
+#define NBUCKETS    64   /* hash buckets per shard */
+#define MAXWORKERS  32   /* upper limit on worker threads */
+
+#define GENSYM_KEY  "Gensym key"
+
 typedef void Sigfunc(int);  /* simplifies event handling */
 
 #if 0
@@ -83,38 +118,128 @@ extern int gdbm_errno;
 #endif
 extern gdbm_error gdbm_errno;
 
-int s;      /* socket descriptor */
+/* freshness info for cached document, seconds since 1970 or 0 */
+
+typedef struct s_meta
+{
+    long date;      /* Date: of server's response */
+    long expires;   /* Expires: */
+    long lastmod;   /* Last-Modified: */
+} Meta;
+
+/* in-memory index entry: url -> filename */
+
+typedef struct s_entry
+{
+    struct s_entry *next;
+    int urllen;
+    int filelen;
+    char *url;
+    char *filename;
+    Meta meta;
+} Entry;
+
+typedef struct s_shard
+{
+    pthread_mutex_t lock;
+    Entry *bucket[NBUCKETS];
+} Shard;
+
+/* write-behind journal of changes awaiting transfer to gdbm */
+
+#define J_STORE   1
+#define J_DELETE  2
+
+typedef struct s_journal
+{
+    struct s_journal *next;
+    int op;
+    datum key;
+    datum content;
+} Journal;
+
+/* each worker has its own socket, receive and response buffers */
+
+typedef struct s_worker
+{
+    pthread_t thread;
+    int s;                  /* socket descriptor */
+    int buflen;             /* number of bytes read */
+    char buffer[BUFSIZE];   /* receive buffer */
+    int rsize;              /* size of response buffer */
+    char *response;         /* malloc'ed response buffer */
+} Worker;
+
+int s;      /* socket descriptor shared when SO_REUSEPORT is missing */
+
+int nworkers;               /* size of worker pool */
+Worker workers[MAXWORKERS];
+
+Shard shards[NSHARDS];
+
+Journal *jhead, *jtail;     /* pending changes, oldest first */
+pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
 
-int buflen;             /* number of bytes read */
-char buffer[BUFSIZE];   /* receive buffer */
+pthread_mutex_t dblock = PTHREAD_MUTEX_INITIALIZER;  /* guards dbf */
 
-int rsize = 0;          /* size of response buffer */
-char *response;         /* malloc'ed response buffer */
+unsigned long gensym;       /* counter for unique file names */
+pthread_mutex_t glock = PTHREAD_MUTEX_INITIALIZER;
+
+int running = 1;            /* cleared by SHUTDOWN method */
 
 struct hostent *hp;   /* pointer to host info for requested host */
 struct servent *sp;   /* pointer to service info */
 
 struct sockaddr_in myaddr_in;       /* for local socket address */
-struct sockaddr_in clientaddr_in;   /* client's socket address */
 
 int NoReader;       /* set bu SIGPIPE */
 GDBM_FILE dbf = NULL;      /* handle to gdbm database */
 char *cache_directory;     /* cache directory passed via argv */
 
-/* most kill signals are caught to ensure a tidy exit */
+sigset_t trapped;           /* kill signals taken by SignalWaiter() */
+
+void FlushJournal(void);
 
-void tidyexit(int sig)
+/* write out pending changes, close database and exit. This takes
+   locks and calls malloc, so it must never be called from a signal
+   handler. Any other thread calling it blocks on dblock until exit */
+
+void tidyexit(int status)
 {
+    FlushJournal();
+    pthread_mutex_lock(&dblock);
+
     if (dbf)
         gdbm_close(dbf);
 
-    exit(0);
+    dbf = NULL;
+    exit(status);
 }
 
+/* most kill signals are caught to ensure a tidy exit, they are
+   blocked in all threads and received with sigwait() by a thread
+   of their own, so tidyexit() runs in a normal thread context */
+
 void trapsignal(int sig)
 {
-    if (signal(sig, SIG_IGN) != SIG_IGN)
-        signal(sig, tidyexit);
+    if (signal(sig, SIG_DFL) == SIG_IGN)
+        signal(sig, SIG_IGN);
+    else
+        sigaddset(&trapped, sig);
+}
+
+void *SignalWaiter(void *arg)
+{
+    int sig;
+
+    while (sigwait(&trapped, &sig) != 0);
+
+#ifdef DEBUG
+    fprintf(stderr, "w3cache: exiting on signal %d\n", sig);
+#endif
+    tidyexit(0);
+    return NULL;
 }
 
 void fatal_func(char *error)
@@ -124,117 +249,542 @@ void fatal_func(char *error)
 #endif
 }
 
+/* hash url to shard and bucket */
 
-/* Generate a unique file name for use by client */
-datum Gensym(void)
+unsigned int HashKey(char *s, int n)
 {
-    datum key, content;
+    unsigned int h = 0;
+
+    while (n-- > 0)
+        h = (h << 5) + h + (unsigned char)*s++;
 
-    key.dptr = "Gensym key";
-    key.dsize = strlen(key.dptr);
+    return h;
+}
 
-    content = gdbm_fetch(dbf, key);
+#define SHARD(h)    ((h) % NSHARDS)
+#define BUCKET(h)   (((h) / NSHARDS) % NBUCKETS)
 
-    /* initialise counter if first time */
+/* find entry for url, caller must hold shard lock */
 
-    if (content.dptr == NULL)
+Entry *LookupEntry(Shard *shard, unsigned int h, char *url, int n)
+{
+    Entry *e;
+
+    for (e = shard->bucket[BUCKET(h)]; e; e = e->next)
     {
-        char *s = "1";
+        if (e->urllen == n && memcmp(e->url, url, n) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+/* append copy of change to journal and wake writer thread */
 
-        content.dsize = 1 + strlen(s);
-        content.dptr = (char *)malloc(content.dsize);
-        strcpy(content.dptr, s);
+int JournalChange(int op, char *key, int klen, char *content, int clen)
+{
+    Journal *j;
+
+    if ((j = (Journal *)malloc(sizeof(Journal))) == NULL)
+        return 0;
+
+    j->next = NULL;
+    j->op = op;
+    j->key.dsize = klen;
+    j->content.dsize = clen;
+    j->content.dptr = NULL;
+
+    if ((j->key.dptr = malloc(klen)) == NULL)
+    {
+        free(j);
+        return 0;
     }
-    else /* increment counter */
+
+    memcpy(j->key.dptr, key, klen);
+
+    if (op == J_STORE)
     {
-        int len;
-        unsigned long counter;
-        char buf[32];
+        if ((j->content.dptr = malloc(clen)) == NULL)
+        {
+            free(j->key.dptr);
+            free(j);
+            return 0;
+        }
 
-        sscanf(content.dptr, "%lu", &counter);
-        sprintf(buf, "%lu", ++counter);
-        len = 1 + strlen(buf);
-        content.dptr = realloc(content.dptr, len);
-        memcpy(content.dptr, buf, len);
+        memcpy(j->content.dptr, content, clen);
     }
 
-    /* increment counter and free old data/alloc new */
+    pthread_mutex_lock(&jlock);
 
-    gdbm_store(dbf, key, content, GDBM_REPLACE);
-    return content;
+    if (jtail)
+        jtail->next = j;
+    else
+        jhead = j;
+
+    jtail = j;
+
+    pthread_cond_signal(&jcond);
+    pthread_mutex_unlock(&jlock);
+    return 1;
+}
+
+/* transfer pending changes to gdbm in the order they were made */
+
+void FlushJournal(void)
+{
+    Journal *j, *next;
+
+    pthread_mutex_lock(&dblock);
+    pthread_mutex_lock(&jlock);
+    j = jhead;
+    jhead = jtail = NULL;
+    pthread_mutex_unlock(&jlock);
+
+    for (; j; j = next)
+    {
+        next = j->next;
+
+        if (dbf)
+        {
+            if (j->op == J_STORE)
+                gdbm_store(dbf, j->key, j->content, GDBM_REPLACE);
+            else
+                gdbm_delete(dbf, j->key);
+        }
+
+        free(j->key.dptr);
+
+        if (j->content.dptr)
+            free(j->content.dptr);
+
+        free(j);
+    }
+
+    pthread_mutex_unlock(&dblock);
 }
 
-int SuitableFileName(char *access, char **msg, int *msglen)
+void *JournalWriter(void *arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&jlock);
+
+        while (jhead == NULL)
+            pthread_cond_wait(&jcond, &jlock);
+
+        pthread_mutex_unlock(&jlock);
+        FlushJournal();
+    }
+
+    return NULL;
+}
+
+/* add/replace entry in index and journal the change */
+
+int IndexStore(char *url, int urllen, char *filename, int filelen, Meta *meta)
 {
     int n;
-    char *p;
+    unsigned int h;
+    Shard *shard;
+    Entry *e;
+    char *file, *content;
+
+    if ((file = malloc(filelen + 1)) == NULL)
+        return 0;
+
+    memcpy(file, filename, filelen);
+    file[filelen] = '\0';
+
+    /* database holds "filename date expires lastmod" */
+
+    if ((content = malloc(filelen + 64)) == NULL)
+    {
+        free(file);
+        return 0;
+    }
+
+    memcpy(content, filename, filelen);
+    sprintf(content + filelen, " %ld %ld %ld%n",
+                meta->date, meta->expires, meta->lastmod, &n);
+
+    h = HashKey(url, urllen);
+    shard = &shards[SHARD(h)];
+    pthread_mutex_lock(&shard->lock);
+
+    if ((e = LookupEntry(shard, h, url, urllen)) != NULL)
+    {
+        free(e->filename);
+        e->filename = file;
+        e->filelen = filelen;
+        e->meta = *meta;
+    }
+    else
+    {
+        if ((e = (Entry *)malloc(sizeof(Entry))) == NULL ||
+            (e->url = malloc(urllen + 1)) == NULL)
+        {
+            pthread_mutex_unlock(&shard->lock);
+
+            if (e)
+                free(e);
+
+            free(file);
+            free(content);
+            return 0;
+        }
+
+        memcpy(e->url, url, urllen);
+        e->url[urllen] = '\0';
+        e->urllen = urllen;
+        e->filename = file;
+        e->filelen = filelen;
+        e->meta = *meta;
+        e->next = shard->bucket[BUCKET(h)];
+        shard->bucket[BUCKET(h)] = e;
+    }
+
+    /* journal while holding the shard lock so that changes to
+       the same url reach the database in the order made */
+
+    n = JournalChange(J_STORE, url, urllen, content, filelen + n);
+    pthread_mutex_unlock(&shard->lock);
+    free(content);
+    return n;
+}
+
+/* parse optional freshness info following file name */
+
+char *ParseMeta(char *p, Meta *meta)
+{
+    long *field[3];
+    int i;
+
+    field[0] = &meta->date;
+    field[1] = &meta->expires;
+    field[2] = &meta->lastmod;
+
+    for (i = 0; i < 3; ++i)
+    {
+        *field[i] = 0;
+
+        while (*p == ' ') ++p;
+
+        if ('0' <= *p && *p <= '9')
+            *field[i] = strtol(p, &p, 10);
+    }
+
+    return p;
+}
+
+/* remove entry from index and journal the change */
+
+int IndexDelete(char *url, int urllen)
+{
+    int n;
+    unsigned int h;
+    Shard *shard;
+    Entry *e, **pe;
+
+    h = HashKey(url, urllen);
+    shard = &shards[SHARD(h)];
+    pthread_mutex_lock(&shard->lock);
+
+    for (pe = &shard->bucket[BUCKET(h)]; (e = *pe); pe = &e->next)
+    {
+        if (e->urllen == urllen && memcmp(e->url, url, urllen) == 0)
+            break;
+    }
+
+    if (e == NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    *pe = e->next;
+    n = JournalChange(J_DELETE, url, urllen, NULL, 0);  /* see IndexStore */
+    pthread_mutex_unlock(&shard->lock);
+
+    free(e->url);
+    free(e->filename);
+    free(e);
+
+    return n;
+}
+
+/* return malloc'ed copy of filename for url and its freshness info */
+
+datum IndexFetch(char *url, int urllen, Meta *meta)
+{
+    unsigned int h;
+    Shard *shard;
+    Entry *e;
     datum content;
 
-    content = Gensym();
-    n = 1024;
+    content.dptr = NULL;
+    content.dsize = 0;
+
+    h = HashKey(url, urllen);
+    shard = &shards[SHARD(h)];
+    pthread_mutex_lock(&shard->lock);
 
-    if (rsize < n)
+    if ((e = LookupEntry(shard, h, url, urllen)) != NULL &&
+        (content.dptr = malloc(e->filelen)) != NULL)
     {
-        response = realloc(response, n);
+        memcpy(content.dptr, e->filename, e->filelen);
+        content.dsize = e->filelen;
+        *meta = e->meta;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return content;
+}
+
+/*
+   return malloc'ed copy of first url found at or after given
+   shard and bucket, scanning the shards in order
+*/
+
+datum IndexScan(int i, int j)
+{
+    Entry *e;
+    datum key;
 
-        if (response == NULL)
+    key.dptr = NULL;
+    key.dsize = 0;
+
+    for (; i < NSHARDS; ++i, j = 0)
+    {
+        pthread_mutex_lock(&shards[i].lock);
+
+        for (; j < NBUCKETS; ++j)
         {
+            if ((e = shards[i].bucket[j]) != NULL)
+            {
+                if ((key.dptr = malloc(e->urllen)) != NULL)
+                {
+                    memcpy(key.dptr, e->url, e->urllen);
+                    key.dsize = e->urllen;
+                }
+
+                pthread_mutex_unlock(&shards[i].lock);
+                return key;
+            }
+        }
+
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    return key;
+}
+
+/* read gdbm database into index before workers are started */
+
+void LoadIndex(void)
+{
+    int n, m;
+    char *p;
+    datum key, next, content;
+    Meta meta;
+
+    for (n = 0; n < NSHARDS; ++n)
+        pthread_mutex_init(&shards[n].lock, NULL);
+
+    n = strlen(GENSYM_KEY);
+    key = gdbm_firstkey(dbf);
+
+    while (key.dptr != NULL)
+    {
+        content = gdbm_fetch(dbf, key);
+
+        if (content.dptr)
+        {
+            if (key.dsize == n && strncmp(key.dptr, GENSYM_KEY, n) == 0)
+                sscanf(content.dptr, "%lu", &gensym);
+            else if ((p = realloc(content.dptr, content.dsize + 1)) != NULL)
+            {
+                /* "filename" or "filename date expires lastmod" */
+
+                content.dptr = p;
+                p[content.dsize] = '\0';
+
+                for (m = 0; p[m] && p[m] != ' '; ++m);
+
+                ParseMeta(p + m, &meta);
+                IndexStore(key.dptr, key.dsize, p, m, &meta);
+            }
+
             free(content.dptr);
-            *msg = "500 internal error - can't realloc buffer\n\n";
-            *msglen = 1 + strlen(*msg);
-            return 0;
         }
 
-        rsize = n;
+        next = gdbm_nextkey(dbf, key);
+        free(key.dptr);
+        key = next;
+    }
+
+    /* loading shouldn't rewrite the database */
+
+    pthread_mutex_lock(&jlock);
+
+    while (jhead)
+    {
+        Journal *j = jhead;
+
+        jhead = j->next;
+        free(j->key.dptr);
+        free(j->content.dptr);
+        free(j);
+    }
+
+    jtail = NULL;
+    pthread_mutex_unlock(&jlock);
+}
+
+/* ensure response buffer has room for n bytes */
+
+int GrowResponse(Worker *w, int n)
+{
+    char *p;
+
+    if (w->rsize < n)
+    {
+        if ((p = realloc(w->response, n)) == NULL)
+            return 0;
+
+        w->response = p;
+        w->rsize = n;
     }
 
-    sprintf(response, "404 Not found\nUseFileName: %s/%s_%s\n\n",
+    return 1;
+}
+
+/* Generate a unique file name for use by client */
+datum Gensym(void)
+{
+    datum content;
+    char buf[32];
+
+    /* journal under glock so the last value stored is the highest */
+
+    pthread_mutex_lock(&glock);
+    sprintf(buf, "%lu", ++gensym);
+    content.dsize = 1 + strlen(buf);
+    JournalChange(J_STORE, GENSYM_KEY, strlen(GENSYM_KEY), buf, content.dsize);
+    pthread_mutex_unlock(&glock);
+
+    content.dptr = (char *)malloc(content.dsize);
+
+    if (content.dptr)
+        memcpy(content.dptr, buf, content.dsize);
+
+    return content;
+}
+
+int SuitableFileName(Worker *w, char *access, char **msg, int *msglen)
+{
+    datum content;
+
+    content = Gensym();
+
+    if (content.dptr == NULL || !GrowResponse(w, 1024))
+    {
+        if (content.dptr)
+            free(content.dptr);
+
+        *msg = "500 internal error - can't realloc buffer\n\n";
+        *msglen = 1 + strlen(*msg);
+        return 0;
+    }
+
+    sprintf(w->response, "404 Not found\nUseFileName: %s/%s_%s\n\n",
          cache_directory, access, content.dptr);
 
     free(content.dptr);
-    *msg = response;
-    *msglen = 1 + strlen(response);
+    *msg = w->response;
+    *msglen = 1 + strlen(w->response);
 
     return 1;
 }
 
 
-int Version(char **msg, int *msglen)
+int Version(Worker *w, char **msg, int *msglen)
 {
-    int n, m;
+    int n;
     char *s;
 
     s = "200 OK\nVersion ";
     n = strlen(s) + strlen(VERSION) + 1;
 
-    if (rsize < n+1)
+    if (!GrowResponse(w, n+1))
     {
-        response = realloc(response, n+1);
+        *msg = "500 internal error - can't realloc buffer\n\n";
+        *msglen = 1 + strlen(*msg);
+        return 0;
+    }
 
-        if (response == NULL)
-        {
-            *msg = "500 internal error - can't realloc buffer\n\n";
-            *msglen = 1 + strlen(*msg);
-            return 0;
-        }
+    sprintf(w->response, "%s%s\n", s, VERSION);
+    *msg = w->response;
+    *msglen = n;
+
+    return 1;
+}
+
+/* build "200 OK\n<data>\n\n" response, freeing data */
 
-        rsize = n+1;
+int ReturnDatum(Worker *w, datum data, char **msg, int *msglen)
+{
+    int n, m;
+    char *p, *s;
+
+    s = "200 OK\n";
+    m = strlen(s);
+    n = data.dsize + m + 3;
+
+    if (!GrowResponse(w, n))
+    {
+        free(data.dptr);
+        *msg = "500 internal error - can't realloc buffer\n\n";
+        *msglen = 1 + strlen(*msg);
+        return 0;
     }
 
-    sprintf(response, "%s%s\n", s, VERSION);
-    *msg = response;
+    p = w->response;
+    strcpy(p, s);
+    p += m;
+
+    memcpy(p, data.dptr, data.dsize);
+    free(data.dptr);
+    p += data.dsize;
+    strcpy(p, "\n\n");  /* 3 bytes including terminator */
+
+    *msg = w->response;
     *msglen = n;
 
     return 1;
 }
 
-int FindURL(char **msg, int *msglen)
+/* access scheme used as prefix for suggested file names */
+
+char *AccessName(char *url)
 {
-    int n, m;
-    char *url, *access, *p, *s;
-    datum key, content;
+    if (strncasecmp(url, "http:", 5) == 0)
+        return "http";
+    else if (strncasecmp(url, "gopher:", 7) == 0)
+        return "gopher";
+    else if (strncasecmp(url, "ftp:", 4) == 0)
+        return "ftp";
+
+    return "www";
+}
 
-    p = buffer;
+int FindURL(Worker *w, char **msg, int *msglen)
+{
+    int n;
+    char *url, *p;
+    datum content;
+    Meta meta;
+
+    p = w->buffer;
     while (*p  && *p != ' ') ++p;
     while (*p == ' ') ++p;
 
@@ -253,68 +803,144 @@ int FindURL(char **msg, int *msglen)
         return 0;
     }
 
-    key.dptr = url;
-    key.dsize = n;
-
-    content = gdbm_fetch (dbf, key);
+    content = IndexFetch(url, n, &meta);
 
     /* if not found then return suitable file name */
 
     if (content.dptr == NULL)
-    {
-        if (strncasecmp(url, "http:", 5) == 0)
-            access = "http";
-        else if (strncasecmp(url, "gopher:", 5) == 0)
-            access = "gopher";
-        else if (strncasecmp(url, "ftp:", 5) == 0)
-            access = "ftp";
-        else
-            access = "www";
+        return SuitableFileName(w, AccessName(url), msg, msglen);
 
-        return SuitableFileName(access, msg, msglen);
+    if (!GrowResponse(w, content.dsize + 128))
+    {
+        free(content.dptr);
+        *msg = "500 internal error - can't realloc buffer\n\n";
+        *msglen = 1 + strlen(*msg);
+        return 0;
     }
 
-    s = "200 OK\n";
-    m = strlen(s);
-    n = content.dsize + m + 3;
+    /* "200 OK\nfile\n" followed by any freshness info */
+
+    p = w->response;
+    strcpy(p, "200 OK\n");
+    p += strlen(p);
+    memcpy(p, content.dptr, content.dsize);
+    p += content.dsize;
+    *p++ = '\n';
+    free(content.dptr);
+
+    if (meta.date)
+        p += sprintf(p, "Date: %ld\n", meta.date);
+
+    if (meta.expires)
+        p += sprintf(p, "Expires: %ld\n", meta.expires);
+
+    if (meta.lastmod)
+        p += sprintf(p, "Last-Modified: %ld\n", meta.lastmod);
+
+    strcpy(p, "\n");  /* 2 bytes including terminator */
+
+    *msg = w->response;
+    *msglen = 2 + p - w->response;
+    return 1;
+}
 
-    if (rsize < n)
+/*
+   MFIND: one url per line after method, reply with status line
+   followed by "200 filename date expires lastmod" or "404 filename"
+   for each url in turn
+*/
+
+int MultiFindURL(Worker *w, char **msg, int *msglen)
+{
+    int n, len;
+    char *url, *p, *r, *access;
+    datum content;
+    Meta meta;
+
+    if (!GrowResponse(w, 1024))
+        goto nomem;
+
+    strcpy(w->response, "200 OK\n");
+    len = strlen(w->response);
+
+    p = w->buffer;
+    while (*p  && *p != ' ' && *p != '\n') ++p;
+
+    for (;;)
     {
-        response = realloc(response, n);
+        while (*p == ' ' || *p == '\n' || *p == '\r') ++p;
+
+        if (*p == '\0')
+            break;
+
+        url = p;
+
+        for (n = 0; (*p && *p != ' ' && *p != '\n' && *p != '\r') ;)
+        {
+            ++p;
+            ++n;
+        }
 
-        if (response == NULL)
+        content = IndexFetch(url, n, &meta);
+
+        if (content.dptr != NULL)
         {
+            if (!GrowResponse(w, len + content.dsize + 72))
+            {
+                free(content.dptr);
+                goto nomem;
+            }
+
+            r = w->response + len;
+            memcpy(r, "200 ", 4);
+            memcpy(r + 4, content.dptr, content.dsize);
+            r += 4 + content.dsize;
+            r += sprintf(r, " %ld %ld %ld\n", meta.date, meta.expires, meta.lastmod);
+            len = r - w->response;
             free(content.dptr);
-            *msg = "500 internal error - can't realloc buffer\n\n";
-            *msglen = 1 + strlen(*msg);
-            return 0;
+            continue;
+        }
+
+        access = AccessName(url);
+        content = Gensym();
+
+        if (content.dptr == NULL ||
+            !GrowResponse(w, len + strlen(cache_directory) + strlen(access) + content.dsize + 16))
+        {
+            if (content.dptr)
+                free(content.dptr);
+
+            goto nomem;
         }
 
-        rsize = n;
+        sprintf(w->response + len, "404 %s/%s_%s\n", cache_directory, access, content.dptr);
+        len += strlen(w->response + len);
+        free(content.dptr);
     }
 
-    p = response;
-    strcpy(p, s);
-    p += m;
-    
-    memcpy(p, content.dptr, content.dsize);
-    free(content.dptr);
-    p += content.dsize;
-    strcpy(p, "\n\n");  /* 3 bytes including terminator */
+    if (!GrowResponse(w, len + 2))
+        goto nomem;
 
-    *msg = response;
-    *msglen = n;
+    strcpy(w->response + len, "\n");  /* 2 bytes including terminator */
 
+    *msg = w->response;
+    *msglen = len + 2;
     return 1;
+
+  nomem:
+
+    *msg = "500 internal error - can't realloc buffer\n\n";
+    *msglen = 1 + strlen(*msg);
+    return 0;
 }
 
-int RegisterURL(char **msg, int *msglen)
+int RegisterURL(Worker *w, char **msg, int *msglen)
 {
-    int n;
-    char *url, *filename, *p, *s;
-    datum key, content;
+    int n, urllen;
+    char *url, *filename, *p;
+    Meta meta;
 
-    p = buffer;
+    p = w->buffer;
     while (*p  && *p != ' ') ++p;
     while (*p == ' ') ++p;
 
@@ -333,8 +959,7 @@ int RegisterURL(char **msg, int *msglen)
         return 0;
     }
 
-    key.dptr = url;
-    key.dsize = n;
+    urllen = n;
 
     while (*p == ' ') ++p;
     filename = p;
@@ -352,28 +977,94 @@ int RegisterURL(char **msg, int *msglen)
         return 0;
     }
 
-    content.dptr = filename;
-    content.dsize = n;
+    ParseMeta(p, &meta);
 
-    if (gdbm_store (dbf, key, content, GDBM_REPLACE) != 0)
+    if (!IndexStore(url, urllen, filename, n, &meta))
     {
         *msg = "500 internal error - can't register URL\n\n";
         *msglen = 1 + strlen(*msg);
+        return 0;
     }
-    else
+
+    *msg = "200 Registered OK\n";
+    *msglen = 1 + strlen(*msg);
+    return 1;
+}
+
+/* MREGISTER: one "url filename [date expires lastmod]" per line */
+
+int MultiRegisterURL(Worker *w, char **msg, int *msglen)
+{
+    int n, urllen, count;
+    char *url, *filename, *p;
+    Meta meta;
+
+    count = 0;
+    p = w->buffer;
+    while (*p  && *p != ' ' && *p != '\n') ++p;
+
+    for (;;)
     {
-        *msg = "200 Registered OK\n";
+        while (*p == ' ' || *p == '\n' || *p == '\r') ++p;
+
+        if (*p == '\0')
+            break;
+
+        url = p;
+
+        for (urllen = 0; (*p && *p != ' ' && *p != '\n' && *p != '\r') ;)
+        {
+            ++p;
+            ++urllen;
+        }
+
+        while (*p == ' ') ++p;
+        filename = p;
+
+        for (n = 0; (*p && *p != ' ' && *p != '\n' && *p != '\r') ;)
+        {
+            ++p;
+            ++n;
+        }
+
+        if (n == 0)
+        {
+            *msg = "400 Bad request - missing filename\n\n";
+            *msglen = 1 + strlen(*msg);
+            return 0;
+        }
+
+        p = ParseMeta(p, &meta);
+
+        if (!IndexStore(url, urllen, filename, n, &meta))
+        {
+            *msg = "500 internal error - can't register URL\n\n";
+            *msglen = 1 + strlen(*msg);
+            return 0;
+        }
+
+        ++count;
+    }
+
+    if (!GrowResponse(w, 64))
+    {
+        *msg = "500 internal error - can't realloc buffer\n\n";
         *msglen = 1 + strlen(*msg);
+        return 0;
     }
+
+    sprintf(w->response, "200 Registered %d OK\n\n", count);
+    *msg = w->response;
+    *msglen = 1 + strlen(w->response);
+    return 1;
 }
 
-int PurgeURL(char **msg, int *msglen)
+int PurgeURL(Worker *w, char **msg, int *msglen)
 {
     int  n;
     char *url, *p;
-    datum key;
 
-    p = buffer;
+    p = w->buffer;
     while (*p  && *p != ' ') ++p;
     while (*p == ' ') ++p;
 
@@ -392,10 +1083,7 @@ int PurgeURL(char **msg, int *msglen)
         return 0;
     }
 
-    key.dptr = url;
-    key.dsize = n;
-
-    if (gdbm_delete (dbf, key) != 0)
+    if (!IndexDelete(url, n))
     {
         *msg = "404 Not found\n\n";
         *msglen = 1 + strlen(*msg);
@@ -410,13 +1098,13 @@ int PurgeURL(char **msg, int *msglen)
 
 /* search for matching entry and remove from database */
 
-int ForgetFileName(char **msg, int *msglen)
+int ForgetFileName(Worker *w, char **msg, int *msglen)
 {
-    int  n;
+    int  i, j, n;
     char *filename, *p;
-    datum key, next;
+    Entry *e, **pe;
 
-    p = buffer;
+    p = w->buffer;
     while (*p  && *p != ' ') ++p;
     while (*p == ' ') ++p;
 
@@ -435,48 +1123,46 @@ int ForgetFileName(char **msg, int *msglen)
         return 0;
     }
 
-    /* iterate through database for matching key */
+    /* iterate through index for matching file name */
 
-    key = gdbm_firstkey (dbf);
-
-    for (;;)
+    for (i = 0; i < NSHARDS; ++i)
     {
-        if (key.dptr == NULL)
+        pthread_mutex_lock(&shards[i].lock);
+
+        for (j = 0; j < NBUCKETS; ++j)
         {
-            *msg = "404 Not found\n\n";
-            *msglen = 1 + strlen(*msg);
-            return 0;
+            for (pe = &shards[i].bucket[j]; (e = *pe); pe = &e->next)
+            {
+                if (n == e->filelen && strncmp(filename, e->filename, n) == 0)
+                {
+                    *pe = e->next;
+                    JournalChange(J_DELETE, e->url, e->urllen, NULL, 0);
+                    pthread_mutex_unlock(&shards[i].lock);
+
+                    free(e->url);
+                    free(e->filename);
+                    free(e);
+
+                    *msg = "200 Deleted OK\n\n";
+                    *msglen = 1 + strlen(*msg);
+                    return 1;
+                }
+            }
         }
 
-        if (n == key.dsize && strncmp(filename, key.dptr, key.dsize) == 0)
-            break;
-
-        next = gdbm_nextkey (dbf, key);
-
-        free(key.dptr);
-        key = next;
+        pthread_mutex_unlock(&shards[i].lock);
     }
 
-    if (gdbm_delete (dbf, key) != 0)
-    {
-        *msg = "404 Not found\n\n";
-        *msglen = 1 + strlen(*msg);
-        return 0;
-    }
-
-    *msg = "200 Deleted OK\n\n";
+    *msg = "404 Not found\n\n";
     *msglen = 1 + strlen(*msg);
-
-    return 1;
+    return 0;
 }
 
-int FirstKey(char **msg, int *msglen)
+int FirstKey(Worker *w, char **msg, int *msglen)
 {
-    int n, m;
-    char *url, *p, *s;
     datum key;
 
-    key = gdbm_firstkey ( dbf );
+    key = IndexScan(0, 0);
 
     if (key.dptr == NULL)
     {
@@ -485,47 +1171,19 @@ int FirstKey(char **msg, int *msglen)
         return 0;
     }
 
-    s = "200 OK\n";
-    m = strlen(s);
-    n = key.dsize + m + 3;
-
-    if (rsize < n)
-    {
-        response = realloc(response, n);
-
-        if (response == NULL)
-        {
-            free(key.dptr);
-            *msg = "500 internal error - can't realloc buffer\n\n";
-            *msglen = 1 + strlen(*msg);
-            return 0;
-        }
-
-        rsize = n;
-    }
-
-    p = response;
-    strcpy(p, s);
-    p += m;
-    
-    memcpy(p, key.dptr, key.dsize);
-    free(key.dptr);
-    p += key.dsize;
-    strcpy(p, "\n\n");  /* 3 bytes including terminator */
-
-    *msg = response;
-    *msglen = n;
-
-    return 1;
+    return ReturnDatum(w, key, msg, msglen);
 }
 
-int NextKey(char **msg, int *msglen)
+int NextKey(Worker *w, char **msg, int *msglen)
 {
-    int n, m;
-    char *url, *p, *s;
-    datum key, nextkey;
+    int n;
+    unsigned int h;
+    char *url, *p;
+    Shard *shard;
+    Entry *e;
+    datum nextkey;
 
-    p = buffer;
+    p = w->buffer;
     while (*p  && *p != ' ') ++p;
     while (*p == ' ') ++p;
 
@@ -544,86 +1202,80 @@ int NextKey(char **msg, int *msglen)
         ++n;
     }
 
-    key.dptr = url;
-    key.dsize = n;
-
-    nextkey = gdbm_nextkey ( dbf, key );
+    nextkey.dptr = NULL;
+    h = HashKey(url, n);
+    shard = &shards[SHARD(h)];
+    pthread_mutex_lock(&shard->lock);
 
-    if (nextkey.dptr == NULL)
+    if ((e = LookupEntry(shard, h, url, n)) != NULL && e->next)
     {
-        *msg = "404 Not found - no more entries\n\n";
-        *msglen = 1 + strlen(*msg);
-        return 0;
-    }
+        e = e->next;
 
-    s = "200 OK\n";
-    m = strlen(s);
-    n = nextkey.dsize + m + 3;
-
-    if (rsize < n)
-    {
-        response = realloc(response, n);
-
-        if (response == NULL)
+        if ((nextkey.dptr = malloc(e->urllen)) != NULL)
         {
-            free(nextkey.dptr);
-            *msg = "500 internal error - can't realloc buffer\n\n";
-            *msglen = 1 + strlen(*msg);
-            return 0;
+            memcpy(nextkey.dptr, e->url, e->urllen);
+            nextkey.dsize = e->urllen;
         }
 
-        rsize = n;
+        pthread_mutex_unlock(&shard->lock);
     }
+    else
+    {
+        pthread_mutex_unlock(&shard->lock);
 
-    p = response;
-    strcpy(p, s);
-    p += m;
-    
-    memcpy(p, nextkey.dptr, nextkey.dsize);
-    free(nextkey.dptr);
-    p += nextkey.dsize;
-    strcpy(p, "\n\n");  /* 3 bytes including terminator */
+        if (e)
+            nextkey = IndexScan(SHARD(h), BUCKET(h) + 1);
+    }
 
-    *msg = response;
-    *msglen = n;
+    if (nextkey.dptr == NULL)
+    {
+        *msg = "404 Not found - no more entries\n\n";
+        *msglen = 1 + strlen(*msg);
+        return 0;
+    }
 
-    return 1;
+    return ReturnDatum(w, nextkey, msg, msglen);
 }
 
 /*
-   Request is null terminated and in buffer with length buflen bytes.
-   Process it and return with *msg pointing to replay msg and *msglen
-   set to its length in bytes.
+   Request is null terminated and in w->buffer with length w->buflen
+   bytes. Process it and return with *msg pointing to replay msg and
+   *msglen set to its length in bytes.
 */
 
-void ProcessRequest(char **msg, int *msglen)
+void ProcessRequest(Worker *w, char **msg, int *msglen)
 {
     int len;
-    char *p;
+    char *p, *buffer;
 
     /* parse request */
 
+    buffer = w->buffer;
+
     for (p = buffer; *p && *p != ' ' && *p != '\n'; ++p);
     len = p - buffer;
 
     if (len == 7 && strncasecmp(buffer, "version", len) == 0)
-        Version(msg, msglen);
+        Version(w, msg, msglen);
     else if (len == 4 && strncasecmp(buffer, "find", len) == 0)
-        FindURL(msg, msglen);
+        FindURL(w, msg, msglen);
     else if (len == 8 && strncasecmp(buffer, "register", len) == 0)
-        RegisterURL(msg, msglen);
+        RegisterURL(w, msg, msglen);
+    else if (len == 5 && strncasecmp(buffer, "mfind", len) == 0)
+        MultiFindURL(w, msg, msglen);
+    else if (len == 9 && strncasecmp(buffer, "mregister", len) == 0)
+        MultiRegisterURL(w, msg, msglen);
     else if (len == 5 && strncasecmp(buffer, "purge", len) == 0)
-        PurgeURL(msg, msglen);
+        PurgeURL(w, msg, msglen);
     else if (len == 6 && strncasecmp(buffer, "forget", len) == 0)
-        ForgetFileName(msg, msglen);
+        ForgetFileName(w, msg, msglen);
     else if (len == 5 && strncasecmp(buffer, "first", len) == 0)
-        FirstKey(msg, msglen);
+        FirstKey(w, msg, msglen);
     else if (len == 4 && strncasecmp(buffer, "next", len) == 0)
-        NextKey(msg, msglen);
+        NextKey(w, msg, msglen);
     else if (len == 8 && strncasecmp(buffer, "shutdown", len) == 0)
     {
-        gdbm_close(dbf);
-        dbf = NULL;
+        running = 0;
         *msg = "202 Shutting down server\n\n";
         *msglen = 1 + strlen(*msg);
     }
@@ -637,51 +1289,88 @@ void ProcessRequest(char **msg, int *msglen)
     }
 }
 
-void nameserver(void)
+/* worker thread: loop receiving datagrams and sending replies */
+
+void *nameserver(void *arg)
 {
-    int addrlen, msglen, len;
-    char *msg, database[64];
+    Worker *w;
+    int addrlen, msglen;
+    char *msg;
+    struct sockaddr_in clientaddr_in;   /* client's socket address */
 
- /* initialise response buffer */
+    w = (Worker *)arg;
 
-    if (rsize == 0)
+    while (running)
     {
-        rsize = 1024;
-        response = malloc(rsize);
+        addrlen = sizeof(struct sockaddr_in);
 
-        if (response == NULL)
-        {
-            if (DEBUG)
-                fprintf(stderr, "Can't alloc response buffer!\n");
+        /* block until client sends us a datagram
+           with address of client and buffer length */
 
-            exit(1);
-        }
+        w->buflen = recvfrom(w->s, w->buffer, BUFSIZE-1, 0, &clientaddr_in, &addrlen);
+
+        if (w->buflen == -1)
+            tidyexit(0);
+
+        w->buffer[w->buflen] = '\0';  /* add null terminator to data */
+
+        ProcessRequest(w, &msg, &msglen);
+        sendto(w->s, msg, msglen, 0, &clientaddr_in, addrlen);
+    }
+
+    /* SHUTDOWN: write out pending changes and close database */
+
+    tidyexit(0);
+    return NULL;
+}
+
+/* create socket bound to service port, returns -1 on failure */
+
+int OpenSocket(void)
+{
+    int skt, on = 1;
+
+    if ((skt = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+        return -1;
+
+#ifdef SO_REUSEPORT
+    setsockopt(skt, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+#endif
+
+    if (bind(skt, &myaddr_in, sizeof(struct sockaddr_in)) == -1)
+    {
+        close(skt);
+        return -1;
     }
 
+    return skt;
+}
+
+/* start journal writer and worker pool, never returns */
+
+void StartWorkers(void)
+{
+    int i;
+    pthread_t writer, waiter;
+
  /* ignore writes on pipe with no reader */
 
     signal(SIGPIPE, SIG_IGN);
 
- /* trap kill signals to avoid problems with lock mechanism */
+ /* trap kill signals to avoid problems with lock mechanism. Faults
+    such as SIGSEGV are left alone as the index can't be trusted
+    after one, and SIGKILL and SIGSTOP can't be caught anyway */
 
+    sigemptyset(&trapped);
     trapsignal(SIGALRM);
-    trapsignal(SIGEMT);
-    trapsignal(SIGFPE);
     trapsignal(SIGHUP);
-    trapsignal(SIGILL);
     trapsignal(SIGINT);
-    trapsignal(SIGIOT);
-    trapsignal(SIGKILL);
     trapsignal(SIGPROF);
 #if 0
     trapsignal(SIGPWR);
 #endif
     trapsignal(SIGQUIT);
-    trapsignal(SIGSEGV);
-    trapsignal(SIGSTOP);
-    trapsignal(SIGSYS);
     trapsignal(SIGTERM);
-    trapsignal(SIGTRAP);
     trapsignal(SIGTSTP);
     trapsignal(SIGTTIN);
     trapsignal(SIGTTOU);
@@ -689,34 +1378,78 @@ void nameserver(void)
     trapsignal(SIGUSR2);
     trapsignal(SIGVTALRM);
 
-    while (dbf != NULL)
+ /* threads created from here on inherit the blocked signals */
+
+    pthread_sigmask(SIG_BLOCK, &trapped, NULL);
+
+    if (pthread_create(&waiter, NULL, SignalWaiter, NULL) != 0)
     {
-        addrlen = sizeof(struct sockaddr_in);
+        if (DEBUG)
+            fprintf(stderr, "Can't start signal thread!\n");
 
-        /* block until client sends us a datagram
-           with address of client and buffer length */
+        exit(1);
+    }
 
-        buflen = recvfrom(s, buffer, BUFSIZE-1, 0, &clientaddr_in, &addrlen);
+    if (pthread_create(&writer, NULL, JournalWriter, NULL) != 0)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Can't start journal writer!\n");
 
-        if (buflen == -1)
-            exit(1);
+        exit(1);
+    }
 
-        buffer[buflen] = '\0';  /* add null terminator to data */
+    for (i = 0; i < nworkers; ++i)
+    {
+        Worker *w = &workers[i];
+
+     /* initialise response buffer */
+
+        w->rsize = 1024;
+        w->response = malloc(w->rsize);
+
+        if (w->response == NULL)
+        {
+            if (DEBUG)
+                fprintf(stderr, "Can't alloc response buffer!\n");
+
+            tidyexit(0);
+        }
+
+     /* first worker uses the socket opened by main */
+
+        if (i == 0)
+            w->s = s;
+        else
+        {
+#ifdef SO_REUSEPORT
+            if ((w->s = OpenSocket()) == -1)
+                w->s = s;
+#else
+            w->s = s;
+#endif
+        }
 
-        ProcessRequest(&msg, &msglen);
-        sendto(s, msg, msglen, 0, &clientaddr_in, addrlen);
+        if (i > 0 && pthread_create(&w->thread, NULL, nameserver, w) != 0)
+        {
+            if (DEBUG)
+                fprintf(stderr, "Can't start worker %d\n", i);
+
+            nworkers = i;
+            break;
+        }
     }
 
-    exit(0);
+    nameserver(&workers[0]);    /* doesn't return */
 }
 
 
 /*
   start server and fork process leaving child to do all the work
   so that it doesn't have to be run in the background. It sets up
-  a socket and for each incoming request returns an answer
+  a socket per worker thread and for each incoming request returns
+  an answer
 
-  w3cache DIRECTORYNAME
+  w3cache [-workers N] DIRECTORYNAME
 
 */
 
@@ -725,11 +1458,26 @@ main(int argc, char **argv)
     int len;
     char database[64];
 
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc == 4 && strcmp(argv[1], "-workers") == 0)
+    {
+        nworkers = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (nworkers < 1)
+        nworkers = 1;
+    else if (nworkers > MAXWORKERS)
+        nworkers = MAXWORKERS;
+
     if (argc != 2)
     {
-        fprintf(stderr, "Useage: %s DirectoryName\n", argv[0]);
+        fprintf(stderr, "Useage: %s [-workers N] DirectoryName\n", argv[0]);
         fprintf(stderr, "where DirectoryName is the name of a\n");
-        fprintf(stderr, "shared directory for placing cache files.\n");
+        fprintf(stderr, "shared directory for placing cache files\n");
+        fprintf(stderr, "and N is the number of worker threads.\n");
         fprintf(stderr, "Avoid using kill -9 to shutdown server\n");
         fprintf(stderr, "as this screws lock mechanism\n");
         exit(1);
@@ -738,19 +1486,12 @@ main(int argc, char **argv)
     cache_directory = argv[1];
     myaddr_in.sin_port = PORT;
 
-    s = socket(AF_INET, SOCK_DGRAM, 0);  /* create socket */
+    s = OpenSocket();  /* create socket */
 
     if (s == -1)
     {
         perror(argv[0]);
-        printf("%s: unable to create socket for port %d\n", PORT);
-        exit(1);
-    }
-
-    if (bind(s, &myaddr_in, sizeof(struct sockaddr_in)) == -1)
-    {
-        perror(argv[0]);
-        printf("%s: unable to bind socket for port %d\n", PORT);
+        printf("%s: unable to create socket for port %d\n", argv[0], PORT);
         exit(1);
     }
 
@@ -770,6 +1511,8 @@ main(int argc, char **argv)
         exit(1);
     }
 
+    LoadIndex();
+
     /* Do setpgrp() so that daemon won't be associated with user's
        control terminal. This is done before the fork, so that the
        child will not become a process group leader. */
@@ -793,7 +1536,7 @@ main(int argc, char **argv)
             fclose(stdout);
             fclose(stderr);
 #endif
-            nameserver();    /* doesn't return */
+            StartWorkers();    /* doesn't return */
 #ifndef DEBUG
 
         default:    /* parent process */
@@ -37,7 +37,9 @@ extern int PixelIndent;
 extern int buf_width;
 extern char *buffer;
 extern int hdrlen;
+extern char *LayoutEnd;
 extern int Authorize;
+extern int AbortFlag;
 extern int OpenURL;
 extern int IsIndex;
 extern int SaveFile;
@@ -48,6 +50,7 @@ extern int font;
 extern Field *focus;
 extern Frame background;
 extern Byte *paint;
+extern struct tag HTMLTags[];
 
 int debug = 0;        /* used to control reporting of errors */
 int initialised = 0;  /* avoid X output until this is true! */
@@ -102,6 +105,7 @@ XFontStruct *Fonts[FONTS];  /* array of fonts */
 int LineSpacing[FONTS];
 int BaseLine[FONTS];
 int StrikeLine[FONTS];
+static short CharWidth[FONTS][256];  /* glyph widths for layout */
 
 int ListIndent1, ListIndent2;
 
@@ -451,6 +455,21 @@ void PollEvents(int block)
 
     while (block || XEventsQueued(display, QueuedAfterReading) != 0)
     {
+        /* when idle finish laying out a large document */
+
+        if (block && LayoutEnd && XEventsQueued(display, QueuedAfterFlush) == 0 &&
+                MoreLayout())
+            continue;
+
+        /* and then wait on both the X server and the images */
+
+        if (block && Fetching() && XEventsQueued(display, QueuedAfterFlush) == 0)
+        {
+            ServiceFetches(ConnectionNumber(display), 1000);
+            CollectImages();
+            continue;
+        }
+
         if (RepeatButtonDown && !ExposeCount &&
                 XEventsQueued(display, QueuedAfterReading) == 0)
         {
@@ -480,8 +499,13 @@ void PollEvents(int block)
                 SetScrollBarGC(gc_scrollbar);
                 DisplayScrollBar();
 
+                /* the document area can usually be
+                   repaired from its off screen copy */
+
                 SetDisplayGC(gc_text);
-                DisplayDoc(WinLeft, WinTop, WinWidth, WinHeight);
+
+                if (!ShowBacking())
+                    DisplayDoc(WinLeft, WinTop, WinWidth, WinHeight);
                 break;
 
             case GraphicsExpose:
@@ -511,6 +535,10 @@ void PollEvents(int block)
                 break;
 
             case ConfigureNotify:
+                /* while the user drags the window border only the
+                   latest size matters, so skip any that are queued */
+                while (XCheckTypedWindowEvent(display, win, ConfigureNotify, &event));
+
                 if (win_width == event.xconfigure.width &&
                         win_height == event.xconfigure.height)
                     break;
@@ -602,7 +630,7 @@ void PollEvents(int block)
                     if (Authorize)
                         HideAuthorizeWidget();
                     else if (busy)
-                        Beep();
+                        AbortFlag = 1;  /* same as abort button */
                     else if (OpenURL)
                     {
                         OpenURL = 0;
@@ -679,6 +707,91 @@ void PollEvents(int block)
     busy = 0;
 }
 
+/*
+ Layout measures every word it places, so rather than call
+ XTextWidth() each time we take a copy of each font's glyph
+ widths from its per_char metrics once the fonts are loaded.
+ Chars outside the font's range, or which it doesn't define,
+ take the width of the font's default_char as in XTextWidth().
+ This lets the layout code run without calling into Xlib.
+*/
+
+static int GlyphWidth(XFontStruct *font, unsigned int c)
+{
+    XCharStruct *cs;
+
+    if (c < font->min_char_or_byte2 || c > font->max_char_or_byte2)
+        return -1;
+
+    cs = font->per_char + (c - font->min_char_or_byte2);
+
+    if (cs->width == 0 && cs->lbearing == 0 && cs->rbearing == 0 &&
+            cs->ascent == 0 && cs->descent == 0)
+        return -1;  /* non-existent char */
+
+    return cs->width;
+}
+
+void SetCharWidths(void)
+{
+    int i, c, w, dw;
+    char ch;
+    XFontStruct *font;
+
+    for (i = 0; i < FONTS; ++i)
+    {
+        font = Fonts[i];
+
+        if (font->per_char == NULL ||
+                font->min_bounds.width == font->max_bounds.width)
+        {
+            for (c = 0; c < 256; ++c)  /* fixed pitch font */
+                CharWidth[i][c] = font->min_bounds.width;
+
+            continue;
+        }
+
+        if (font->min_byte1 != 0 || font->max_byte1 != 0)
+        {
+            for (c = 0; c < 256; ++c)  /* leave 2 byte fonts to Xlib */
+            {
+                ch = c;
+                CharWidth[i][c] = XTextWidth(font, &ch, 1);
+            }
+
+            continue;
+        }
+
+        if ((dw = GlyphWidth(font, font->default_char)) < 0)
+            dw = 0;
+
+        for (c = 0; c < 256; ++c)
+        {
+            if ((w = GlyphWidth(font, c)) < 0)
+                w = dw;
+
+            CharWidth[i][c] = w;
+        }
+    }
+}
+
+/* equivalent to XTextWidth(Fonts[font], s, len) */
+
+int TextWidth(int font, char *s, int len)
+{
+    int width;
+    short *cw;
+    unsigned char *p;
+
+    cw = CharWidth[font];
+    p = (unsigned char *)s;
+
+    for (width = 0; len > 0; --len)
+        width += cw[*p++];
+
+    return width;
+}
+
 /* get font/colour resources */
 
 void GetResources(void)
@@ -799,6 +912,8 @@ void GetResources(void)
     StrikeLine[IDX_BIFIXEDFONT] = STRIKELINE(fixed_font);
     StrikeLine[IDX_SYMBOLFONT] = STRIKELINE(normal_font);
 
+    SetCharWidths();
+
     /* list indents for ordered/unordered lists */
 
     ListIndent1 = XTextWidth(normal_font, "ABCabc", 6)/6;
@@ -893,7 +1008,7 @@ void MakePaper(int UsePaper)
              depth, ZPixmap, 0, data,
              tileWidth, tileHeight, (depth == 24 ? 32 : 8), 0)) == 0)
         {
-            free(data);
+            FreeImageData(data);
             XFreePixmap(display, pixmap);
             fprintf(stderr, "Failed to create X Image for background!\n");
             exit(1);
@@ -901,9 +1016,9 @@ void MakePaper(int UsePaper)
 
         drawGC = XCreateGC(display, pixmap, 0, 0);
         XSetFunction(display, drawGC, GXcopy);
-        XPutImage(display, pixmap, drawGC, image, 0, 0, 0, 0, tileWidth, tileHeight);
+        PutImage(pixmap, drawGC, image, 0, tileHeight);
         XFreeGC(display, drawGC);
-        XDestroyImage(image); /* also free's image data */
+        DestroyImage(image);
 
         valuemask = GCTile|GCFillStyle;
         values.tile = pixmap;
@@ -936,10 +1051,10 @@ int CloneSelf(void)
     unsigned int display_width, display_height;
     char *window_name = "World Wide Web Browser";
     char *icon_name = "web";
-    int i, fh, depth, tag;
+    int fh, depth, tag;
     unsigned int class;
     Visual *visual;
-    unsigned long valuemask, where;
+    unsigned long valuemask;
     XSetWindowAttributes attributes;
     Pixmap icon_pixmap;
 
@@ -947,6 +1062,10 @@ int CloneSelf(void)
 
     CloseFTP();
 
+    /* and idle HTTP connections which mustn't be shared with clone */
+
+    CloseConnections();
+
     if ((tty = open("/dev/tty", 2)) == -1 && (tty = open("/dev/null", 2)) == -1)
     {
         Warn("Can't open /dev/tty");
@@ -996,6 +1115,7 @@ int CloneSelf(void)
 
     /* free memory but not pixmaps which we no longer own! */
     FreeImages(1);
+    ResetPutImage();
     FreeForms();   /* is this right? */
                      
   /* try to allocate 128 fixed colors + 16 grey scales */
@@ -1075,14 +1195,10 @@ int CloneSelf(void)
     if (document != HTMLDOCUMENT)
         SetBanner(CurrentDoc.url);
 
-    /* refresh paint buffer to ensure that images resources are created */
+    /* refresh paint buffer to ensure that images resources are created,
+       laying out no more of a large document than before */
 
-    where = PixelOffset;
-    PixelOffset = 0;
-    ParseHTML(&i);
-
-    if (where > 0)
-        DeltaHTMLPosition(where);
+    RefreshLayout();
 
     /* Map Display Window */
 
@@ -1178,6 +1294,10 @@ void main(int argc, char **argv)
 
     InitEntities();
 
+    /* and the HTML tag names */
+
+    InitTags(HTMLTags);
+
     /* connect to X server */
 
     if ( (display=XOpenDisplay(display_name)) == NULL )
@@ -1368,8 +1488,8 @@ void main(int argc, char **argv)
           NewDoc.type != HTMLDOCUMENT)
     {
         DisplayExtDocument(buffer+NewDoc.hdrlen, NewDoc.length-NewDoc.hdrlen, NewDoc.type, NewDoc.path);
-        free(buffer);
-        NewDoc.buffer = buffer = 0;
+        FreeDocBuffer(&NewDoc);
+        buffer = 0;
         NewDoc.hdrlen = 0;
         NewDoc.length = 0;
         NewDoc.type = TEXTDOCUMENT;
@@ -144,13 +144,16 @@ back through the document.
 #define BEGIN_FRAME 2   /* begining of a frame */
 #define END_FRAME   3   /* end of a frame */
 
-#define FRAMESTLEN  17  /* number of bytes in start of frame marker */
-#define FRAMENDLEN  5   /* number of bytes in end of frame marker */
+#define PAINTVERSION 2  /* bumped when the object layout changes */
+
+#define FRAMESTLEN  19  /* number of bytes in start of frame marker */
+#define FRAMENDLEN  9   /* number of bytes in end of frame marker */
 #define TXTLINLEN   11  /* number of bytes in TEXTLINE header */
+#define SIZELEN     4   /* number of bytes in trailing size field */
 
 /* parameters in frame-like objects:
 
-Each object starts with an 8 bit tag and ends with a 2 byte
+Each object starts with an 8 bit tag and ends with a 4 byte
 size field that permits moving back up the list of objects.
 The size is set to the number of bytes from the tag up to
 the size field itself.
@@ -162,9 +165,9 @@ the size field itself.
     height (4 bytes)
     style  (1 byte)
     border (1 byte)
-    length (2 bytes)
+    length (4 bytes)
     zero or more elements
-    size   (2 bytes)
+    size   (4 bytes)
 
 The length parameter gives the number of bytes until
 the end of the frame's data. It is used to skip quickly
@@ -176,8 +179,8 @@ the END_FRAME object which specifies the number of bytes
 back to the corresponding BEGIN_FRAME object.
 
     tag = END_FRAME
-    start  (2 bytes)
-    size   (2 bytes)
+    start  (4 bytes)
+    size   (4 bytes)
 
 A frame for a line of text composed of multiple elements:
 
@@ -190,7 +193,15 @@ TEXTLINE:
     height (two bytes)
     zero or more elements
     1 byte marker (= 0)
-    size (two bytes)
+    size (four bytes)
+
+Version 1 of this format used 2 byte length, start and size
+fields, which overflowed on documents with more than 64K bytes
+of paint commands. Multi-byte fields are stored least significant
+byte first. The stream is only ever made and painted by the same
+process, so PAINTVERSION isn't stored in it and isn't checked. The
+paint buffer itself is reserved up front so that it never moves
+while the document is being laid out, see MakeRoom().
 */
 
 typedef unsigned char Byte;
@@ -257,13 +268,13 @@ typedef struct sframe_struct
 
 #define BSIZE 6     /* size of bullet graphic */
 
-#define CHWIDTH(font)    XTextWidth(Fonts[font], " ", 1)
+#define CHWIDTH(font)    TextWidth(font, " ", 1)
 #define SPACING(font)    (2 + font->max_bounds.ascent + font->max_bounds.descent)
 #define BASELINE(font)   (1 + font->max_bounds.ascent)
 #define STRIKELINE(font) (font->max_bounds.ascent - font->max_bounds.descent + 1)
 #define ASCENT(font)     (1 + Fonts[font]->max_bounds.ascent)
 #define DESCENT(font)    (1 + Fonts[font]->max_bounds.descent)
-#define WIDTH(font, str, len) XTextWidth(Fonts[font], str, len)
+#define WIDTH(font, str, len) TextWidth(font, str, len)
 
 #define EMPH(emph, font)    (emph | (font & 0xF))
 
@@ -365,6 +376,7 @@ typedef struct s_doc
     int port;       /* 80 for HTTP by default */
     int protocol;   /* HTTP, ... WAIS */
     char *buffer;   /* document's contents (including header */
+    long mapped;    /* size of mmap'ed buffer or 0 if malloc'ed */
     int hdrlen;     /* number of bytes in MIME header */
     long length;    /* in bytes (including header) */
     long height;    /* of viewable portion in pixels */
@@ -374,6 +386,10 @@ typedef struct s_doc
     char *anchor;   /* named anchor point in document */
     char *url;      /* absolute URL reference */
     char *cache;    /* file name in shared cache */
+    long date;      /* Date: from HTTP header, seconds since 1970 */
+    long expires;   /* Expires: or 0 if unknown */
+    long lastmod;   /* Last-Modified: or 0 if unknown */
+    long validate;  /* If-Modified-Since for revalidation or 0 */
 } Doc;
 
 #define TABSIZE         8
@@ -404,6 +420,8 @@ void Redraw(int x, int y, int w, int h);
 void SetBanner(char *title);
 void PollEvents(int block);
 void BackDoc();
+void SetCharWidths(void);
+int TextWidth(int font, char *s, int len);
 
 /* file.c */
 
@@ -431,7 +449,17 @@ void SetDisplayFont(XFontStruct *pFont_info);
 void SetFont(GC gc, int fontIndex);
 void SetEmphFont(GC gc, XFontStruct *pFont, XFontStruct *pNormal);
 void NewBuffer(char *buf);
+int PartialBuffer(char *buf, int len);
+char *MovePartial(char *buf, int len, int size);
+void EndPartialBuffer(int arrived);
 void DisplaySizeChanged(int all);
+int MoreLayout(void);
+void RefreshLayout(void);
+void BeginPaint(void);
+void EndPaint(void);
+void Damage(int x, int y, unsigned int w, unsigned int h);
+void ShowDamage(void);
+int ShowBacking(void);
 
 char *TextLine(char *txt);
 long CurrentHeight(char *buf);
@@ -689,7 +717,10 @@ void SearchIndex(char *keywords);
 /* html.c */
 
 long ParseHTML(int *width);
+long ResumeHTML(int *width);
 char *TopStr(Frame *frame);
+void IndexPaint(long from);
+void RepaintImage(Pixmap pixmap, int top, int bottom);
 
 /* http.c */
 
@@ -709,17 +740,32 @@ void InitCurrent(char *path);
 char *UnivRefLoc(Doc *doc);
 char *ParseReference(char *s, int local);
 int HeaderLength(char *buf, int *type);
+long ParseHTTPDate(char *s);
+char *HTTPDate(long t);
+void HeaderDates(Doc *doc);
 char *GetDocument(char *href, char *who, int local);
+char *FetchedDocument(char *href, char *buf, int len);
+int PrefetchDocument(char *href);
 char *SearchRef(char *keywords);
 
 /* cache.c */
 
 int CloneHistoryFile(void);
+void FreeDocBuffer(Doc *doc);
+void FreeDoc(Doc *doc);
 void SetCurrent();
 int ViewStack(void);
 int PushDoc(long offset);
 char *PopDoc(long *where);
 char *GetCachedDoc(void);
+int IsCached(char *url);
+int IsFresh(Doc *doc);
+int RegisterCacheEntry(void);
+char *RecallDoc(void);
+void RememberDoc(void);
+void ForgetDoc(char *url);
+void BeginCacheBatch(char **urls, int n);
+void EndCacheBatch(void);
 int StoreNamePW(char *who);
 char *RetrieveNamePW(void);
 
@@ -742,30 +788,59 @@ int XPSend(int skt, char *data, int len, int once);
 int XPRecv(int skt, char *msg, int len);
 int Connect(int s, char *host, int port, int *ViaGateway);
 char *GetData(int socket, int *length);
+int TakeConnection(char *host, int port);
+void KeepConnection(int skt, char *host, int port);
+void CloseConnections(void);
+int StartFetch(char *host, int port, char *request, int len, char *key);
+int FetchPending(char *key);
+int PeekFetch(char *key, char **buf, int *len);
+int Fetching(void);
+int ServiceFetches(int fd, int timeout);
+int TakeFetched(char **key, char **buf, int *len);
+void CancelFetches(void);
+int QueryCacheBatch(char *method, char **lines, int n, char **replies);
 
 /* entities.c */
 
 int entity(char *name, int *len);
 void InitEntities(void);
 
+/* tags.c */
+
+#include "tags.h"
+
 /* image.c */
 
 typedef struct image_struct
         {
-            struct image_struct *next;
-            char *url;
+            struct image_struct *next;  /* images of current document */
+            struct image_struct *chain; /* hash table, see image.c */
+            struct image_struct *newer; /* least recently used order */
+            struct image_struct *older;
+            char *url;                  /* absolute url */
             Pixmap pixmap;
             unsigned long *pixels;
             int npixels;           
             unsigned int width;
             unsigned int height;
+            unsigned char used;         /* on images list */
+            unsigned char cached;       /* in hash table */
+            unsigned char pending;      /* pixmap stands in until it arrives */
+            Pixmap stale;               /* stand-in replaced since last layout */
         } Image;
 
 int InitImaging(int ColorStyle);
 unsigned long GreyColor(unsigned int grey);
+char *NewImageData(long size);
+void FreeImageData(char *data);
+void DestroyImage(XImage *ximage);
+void PutImage(Drawable d, GC gc, XImage *ximage, int y, unsigned int height);
+void ResetPutImage(void);
 unsigned long StandardColor(unsigned char red, unsigned char green, unsigned char blue);
 unsigned char *CreateBackground(unsigned int width, unsigned int height, unsigned int depth);
 Image *GetImage(char *href, int hreflen);
+void ResolveImages(char *buf);
+void CollectImages(void);
 void FreeImages(int cloned);
 void ReportStandardColorMaps(Atom which_map);
 void ReportVisuals(void);
@@ -775,7 +850,13 @@ void MakeFaces(unsigned int depth);
 
 /* gif.c */
 
+typedef struct gif_state GifState;
+
 unsigned char *LoadGifImage(Image *image, Block *bp, unsigned int depth);
+GifState *StartGif(Image *image, Block *bp, unsigned int depth, unsigned char **data);
+int ContinueGif(GifState *gs, Block *bp, int partial, int *top, int *bottom);
+unsigned char *EndGif(GifState *gs);
+int GifReady(char *buf, long len);
 
 /* forms.c */
 